@@ -8,19 +8,24 @@ int
 asprintf(char **str, const char *format, ...)
 {
 	int size = 0;
-	va_list args;
+	va_list args, copy;
 
 	va_start(args, format);
+	/* vsnprintf uses up the arguments, they're read again from a copy */
+	va_copy(copy, args);
 	size = vsnprintf(NULL, 0, format, args);
+	va_end(args);
 
 	if (size < 0)
 		size = -1;
 	*str = malloc((size + 1) * sizeof(char));
-	if (str == NULL)
+	if (*str == NULL) {
+		va_end(copy);
 		return -1;
+	}
 
-	size = vsprintf(*str, format, args);
-	va_end(args);
+	size = vsprintf(*str, format, copy);
+	va_end(copy);
 
 	return size;
 }
@@ -0,0 +1,84 @@
+#!/bin/sh
+# End-to-end benchmark of ruler against Xvfb, then the microbenchmarks.
+#
+# For each size in $BENCH_RULES, a configuration of that many rules is made,
+# ruler is started with it, and windows are mapped at each rate of
+# $BENCH_RATES (windows per second, 0 for as fast as possible). The rules
+# run bench/stamp, which tells bench/mapwin when the command started.
+#
+# Run from the top of the tree, by make bench.
+
+BENCH_RULES=${BENCH_RULES:-10 100 1000 10000}
+BENCH_RATES=${BENCH_RATES:-100 1000 0}
+BENCH_WINDOWS=${BENCH_WINDOWS:-2000}
+BENCH_DISPLAY=${BENCH_DISPLAY:-:99}
+RULER_FLAGS=${RULER_FLAGS:-}
+
+top=$(pwd)
+tmp=$(mktemp -d)
+xvfb=
+ruler=
+
+cleanup() {
+	[ -n "$ruler" ] && kill "$ruler" 2> /dev/null
+	[ -n "$xvfb" ] && kill "$xvfb" 2> /dev/null
+	rm -rf "$tmp"
+}
+trap cleanup EXIT INT TERM
+
+# the rules of bench/micro, each running bench/stamp
+gen_rules() {
+	awk -v n="$1" -v cmd="$top/bench/stamp $tmp/stamps" 'BEGIN {
+		for (i = 0; i < n; i++) {
+			if (i % 8 == 7)
+				printf "class=\"^bench%d$\",type=\"normal\"\n", i
+			else if (i % 4 == 3)
+				printf "class=\"^bench%d$\",name=\"term.*%d\"\n", i, i
+			else
+				printf "class=\"^bench%d$\"\n", i
+			printf "\t%s\n\n", cmd
+		}
+	}'
+}
+
+if ! command -v Xvfb > /dev/null; then
+	echo "Xvfb not found, only running the microbenchmarks that don't need X" >&2
+	unset DISPLAY
+	exec ./bench/micro
+fi
+
+Xvfb "$BENCH_DISPLAY" -screen 0 1280x1024x24 -nolisten tcp 2> "$tmp/xvfb.log" &
+xvfb=$!
+export DISPLAY="$BENCH_DISPLAY"
+i=0
+while ! [ -S "/tmp/.X11-unix/X${BENCH_DISPLAY#:}" ]; do
+	i=$((i + 1))
+	if [ $i -gt 50 ]; then
+		echo "Xvfb didn't start:" >&2
+		cat "$tmp/xvfb.log" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+for rules in $BENCH_RULES; do
+	gen_rules "$rules" > "$tmp/rulerrc"
+	./ruler $RULER_FLAGS "$tmp/rulerrc" &
+	ruler=$!
+
+	# ruler is ready once it handles a window
+	: > "$tmp/stamps"
+	./bench/mapwin -s "$tmp/stamps" -n 1 -c 1 > /dev/null || exit 1
+
+	for rate in $BENCH_RATES; do
+		: > "$tmp/stamps"
+		./bench/mapwin -s "$tmp/stamps" -n "$BENCH_WINDOWS" -r "$rate" -c "$rules" |
+			sed "s/^/e2e rules=$rules rate=$rate /"
+	done
+
+	kill "$ruler"
+	wait "$ruler"
+	ruler=
+done
+
+./bench/micro
@@ -0,0 +1,239 @@
+/*
+ * Map windows at a given rate and measure how long ruler takes to start
+ * their command.
+ *
+ * Window i gets the class "bench<k>", the name "term <k> ~" and the type
+ * normal, with k spread over the classes of the generated configuration,
+ * whose rule for "bench<k>" runs bench/stamp. The time each window is mapped
+ * is kept, and once the commands of all the windows are in the stamp file
+ * (or none came for a while), the latency from map to command start and the
+ * windows handled per second are printed.
+ *
+ * usage: mapwin -s stamps [-n windows] [-r windows per second, 0 for
+ * as fast as possible] [-c classes] [-t seconds to wait for the commands]
+ */
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xcb/xcb.h>
+
+struct mapped {
+	unsigned int win;
+	long long map_ns;
+	long long start_ns;
+};
+
+static xcb_connection_t *conn;
+static xcb_screen_t *scrn;
+static xcb_atom_t type_atom, normal_atom;
+
+static long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleep_until(long long ns)
+{
+	struct timespec ts;
+	long long left = ns - now_ns();
+
+	if (left <= 0)
+		return;
+	ts.tv_sec = left / 1000000000;
+	ts.tv_nsec = left % 1000000000;
+	nanosleep(&ts, NULL);
+}
+
+static xcb_atom_t
+intern(const char *name)
+{
+	xcb_intern_atom_reply_t *r;
+	xcb_atom_t atom;
+
+	r = xcb_intern_atom_reply(conn, xcb_intern_atom(conn, 0, strlen(name), name), NULL);
+	if (r == NULL)
+		errx(1, "couldn't intern %s", name);
+	atom = r->atom;
+	free(r);
+
+	return atom;
+}
+
+/*
+ * Make window k of the benchmark and map it.
+ */
+static xcb_window_t
+map_window(int k)
+{
+	xcb_window_t win = xcb_generate_id(conn);
+	char class[32], name[32];
+	int len;
+
+	/* WM_CLASS is the instance and the class, each ending with a NUL */
+	len = snprintf(class, sizeof(class), "bench%c" "bench%d", '\0', k) + 1;
+
+	xcb_create_window(conn, XCB_COPY_FROM_PARENT, win, scrn->root,
+			0, 0, 16, 16, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+			scrn->root_visual, 0, NULL);
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, win, XCB_ATOM_WM_CLASS,
+			XCB_ATOM_STRING, 8, len, class);
+	len = snprintf(name, sizeof(name), "term %d ~", k);
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, win, XCB_ATOM_WM_NAME,
+			XCB_ATOM_STRING, 8, len, name);
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, win, type_atom,
+			XCB_ATOM_ATOM, 32, 1, &normal_atom);
+	xcb_map_window(conn, win);
+
+	return win;
+}
+
+static int
+cmp_win(const void *a, const void *b)
+{
+	const struct mapped *x = a, *y = b;
+
+	return (x->win > y->win) - (x->win < y->win);
+}
+
+static int
+cmp_latency(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Read the stamps written so far, filling in the start of the windows.
+ *
+ * Returns how many windows have started their command.
+ */
+static int
+read_stamps(const char *path, struct mapped *m, int n)
+{
+	struct mapped key, *found;
+	unsigned int win;
+	long long ns;
+	FILE *f;
+	int started = 0;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+
+	while (fscanf(f, "%x %lld", &win, &ns) == 2) {
+		key.win = win;
+		found = bsearch(&key, m, n, sizeof(struct mapped), cmp_win);
+		/* a window can match more than one rule, the first command counts */
+		if (found != NULL && found->start_ns == 0) {
+			found->start_ns = ns;
+			started++;
+		}
+	}
+	fclose(f);
+
+	return started;
+}
+
+static long long
+percentile(long long *sorted, int n, int p)
+{
+	return sorted[(long long)(n - 1) * p / 100];
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mapped *m;
+	long long *lat, start, last_start, wait_ns = 10000000000LL;
+	char *stamps = NULL;
+	int n = 1000, rate = 0, classes = 10, started = 0, prev = -1, i, c;
+
+	while ((c = getopt(argc, argv, "n:r:c:s:t:")) != -1) {
+		switch (c) {
+			case 'n': n = atoi(optarg); break;
+			case 'r': rate = atoi(optarg); break;
+			case 'c': classes = atoi(optarg); break;
+			case 's': stamps = optarg; break;
+			case 't': wait_ns = atoll(optarg) * 1000000000LL; break;
+			default: return 1;
+		}
+	}
+	if (stamps == NULL || n <= 0 || classes <= 0)
+		errx(1, "usage: mapwin -s stamps [-n windows] [-r rate] [-c classes] [-t seconds]");
+
+	conn = xcb_connect(NULL, NULL);
+	if (xcb_connection_has_error(conn))
+		errx(1, "couldn't connect to the X server");
+	scrn = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+	type_atom = intern("_NET_WM_WINDOW_TYPE");
+	normal_atom = intern("_NET_WM_WINDOW_TYPE_NORMAL");
+
+	m = calloc(n, sizeof(struct mapped));
+	lat = malloc(n * sizeof(long long));
+	if (m == NULL || lat == NULL)
+		err(1, "malloc");
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if (rate > 0)
+			sleep_until(start + (long long)i * 1000000000 / rate);
+		m[i].win = map_window((int)((i * 7919LL) % classes));
+		xcb_flush(conn);
+		m[i].map_ns = now_ns();
+	}
+
+	/* wait for the commands, as long as they keep coming */
+	qsort(m, n, sizeof(struct mapped), cmp_win);
+	last_start = now_ns();
+	while (started < n && now_ns() - last_start < wait_ns) {
+		usleep(20000);
+		for (i = 0; i < n; i++)
+			m[i].start_ns = 0;
+		started = read_stamps(stamps, m, n);
+		if (started != prev) {
+			prev = started;
+			last_start = now_ns();
+		}
+	}
+
+	for (i = 0, c = 0; i < n; i++) {
+		if (m[i].start_ns != 0)
+			lat[c++] = m[i].start_ns - m[i].map_ns;
+	}
+	qsort(lat, c, sizeof(long long), cmp_latency);
+
+	printf("windows %d\n", n);
+	printf("started %d\n", c);
+	printf("rate %d\n", rate);
+	if (c > 0) {
+		last_start = 0;
+		for (i = 0; i < n; i++) {
+			if (m[i].start_ns > last_start)
+				last_start = m[i].start_ns;
+		}
+		printf("windows_per_sec %.0f\n", c / ((last_start - start) / 1e9));
+		printf("latency_p50_us %lld\n", percentile(lat, c, 50) / 1000);
+		printf("latency_p90_us %lld\n", percentile(lat, c, 90) / 1000);
+		printf("latency_p99_us %lld\n", percentile(lat, c, 99) / 1000);
+		printf("latency_max_us %lld\n", lat[c - 1] / 1000);
+	}
+
+	for (i = 0; i < n; i++)
+		xcb_destroy_window(conn, m[i].win);
+	xcb_flush(conn);
+	xcb_disconnect(conn);
+	free(m);
+	free(lat);
+
+	return c == n ? 0 : 1;
+}
@@ -0,0 +1,750 @@
+/*
+ * Microbenchmarks of the parts of ruler that handle a window, on their own.
+ *
+ * Linked with the objects of ruler, its main renamed. Each benchmark prints
+ * lines of its name, the size it ran with, the result and its unit. The
+ * ones that need an X server are skipped without $DISPLAY.
+ *
+ * usage: micro [benchmark...]
+ */
+#include <err.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+#include <xcb/xcb.h>
+#include <xcb/xcb_ewmh.h>
+#include <xcb/xcb_icccm.h>
+#include <wm.h>
+
+#include "../ruler.h"
+#include "../ruleset.h"
+#include "../winmap.h"
+
+/* windows matched against each configuration */
+#define MATCH_WINDOWS 1000
+/* times the properties of a window are fetched */
+#define PROPS_ROUNDS 1000
+/* commands started, and started with fork, which is much slower */
+#define SPAWN_ROUNDS 1000
+#define FORK_ROUNDS 100
+/* scans of the windows mapped at startup */
+#define STARTUP_ROUNDS 10
+/* times the windows of a desktop are handled */
+#define COALESCE_ROUNDS 100
+/* lookups in the window set, and in the list, which is much slower */
+#define WINMAP_LOOKUPS 1000000
+#define LIST_LOOKUPS 200
+
+struct bench {
+	const char *name;
+	void (*fn)(void);
+	int needs_x;
+};
+
+extern struct conf conf;
+extern struct stats stats;
+extern xcb_connection_t *conn;
+extern xcb_screen_t *scrn;
+extern xcb_ewmh_connection_t *ewmh;
+extern xcb_atom_t allowed_atoms[NR_ATOMS];
+extern char **environ;
+
+/* sizes of the generated configurations */
+static int rule_counts[] = { 10, 100, 1000, 10000 };
+/* windows mapped when ruler starts */
+static int startup_counts[] = { 100, 1000 };
+/* memory touched when starting commands, in MiB */
+static int rss_sizes[] = { 0, 256, 1024 };
+/* windows tracked */
+static int window_counts[] = { 10000, 100000, 1000000 };
+
+static void
+report(const char *name, long size, double value, const char *unit)
+{
+	printf("%-28s %8ld %14.1f %s\n", name, size, value, unit);
+	fflush(stdout);
+}
+
+/*
+ * Add a descriptor to a block being made, like the parser does.
+ */
+static void
+add_descriptor(struct list **d, char *criterion, const char *fmt, int i)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), fmt, i);
+	list_add(d, new_descriptor(criterion, strdup(buf)));
+}
+
+/*
+ * Make the rules of a configuration of n rules: each matches one class,
+ * and if mixed is set, some a name or a type as well.
+ *
+ * Returns the blocks, last first, as the parser makes them.
+ */
+static struct list *
+make_rules(int n, int mixed)
+{
+	struct list *l = NULL, *d;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		d = NULL;
+		if (mixed && i % 8 == 7)
+			add_descriptor(&d, "type", "\"normal\"", i);
+		else if (mixed && i % 4 == 3)
+			add_descriptor(&d, "name", "\"term.*%d\"", i);
+		add_descriptor(&d, "class", "\"^bench%d$\"", i);
+		list_add(&l, new_block(d, strdup("\ttrue")));
+	}
+
+	return l;
+}
+
+/*
+ * Make the properties of window i of a benchmark against n rules.
+ */
+static struct win_props *
+make_props(int i, int n)
+{
+	struct win_props *p = new_win_props();
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "bench%d", (int)((i * 7919LL) % n));
+	p->class = strdup(buf);
+	p->instance = strdup("bench");
+	p->type = strdup("normal");
+	snprintf(buf, sizeof(buf), "term %d ~", i);
+	p->name = strdup(buf);
+	p->role = strdup("");
+
+	return p;
+}
+
+/*
+ * Match windows against n rules with match_props on every block, the way
+ * the rules were matched before they were compiled into a ruleset, and with
+ * ruleset_match.
+ */
+static void
+bench_match_rules(int n, int mixed)
+{
+	struct win_props *props[MATCH_WINDOWS];
+	struct ruleset *rs;
+	long long start;
+	unsigned long matched = 0, compiled = 0;
+	int *matches;
+	int i, b;
+
+	rs = ruleset_new(make_rules(n, mixed), NULL);
+	matches = malloc(rs->nr_blocks * sizeof(int));
+	if (matches == NULL)
+		err(1, "malloc");
+	for (i = 0; i < MATCH_WINDOWS; i++)
+		props[i] = make_props(i, n);
+
+	start = now_ns();
+	for (i = 0; i < MATCH_WINDOWS; i++) {
+		for (b = 0; b < rs->nr_blocks; b++)
+			matched += match_props(props[i], rs->blocks[b]->d) > 0;
+	}
+	report(mixed ? "match_props" : "match_props_class", n,
+			(double)(now_ns() - start) / MATCH_WINDOWS, "ns/window");
+
+	start = now_ns();
+	for (i = 0; i < MATCH_WINDOWS; i++)
+		compiled += ruleset_match(rs, props[i], matches);
+	report(mixed ? "ruleset_match" : "ruleset_match_class", n,
+			(double)(now_ns() - start) / MATCH_WINDOWS, "ns/window");
+
+	if (matched != compiled)
+		warnx("ruleset_match found %lu matches, match_props %lu", compiled, matched);
+
+	for (i = 0; i < MATCH_WINDOWS; i++)
+		free_win_props(props[i]);
+	free(matches);
+	ruleset_put(rs);
+}
+
+/*
+ * Rules of classes and some names and types, then rules of classes only,
+ * which are all found by the literal index.
+ */
+static void
+bench_match(void)
+{
+	int r;
+
+	for (r = 0; r < (int)(sizeof(rule_counts) / sizeof(rule_counts[0])); r++)
+		bench_match_rules(rule_counts[r], 1);
+	for (r = 0; r < (int)(sizeof(rule_counts) / sizeof(rule_counts[0])); r++)
+		bench_match_rules(rule_counts[r], 0);
+}
+
+/*
+ * Make a window with all the properties get_props fetches.
+ */
+static xcb_window_t
+make_window(void)
+{
+	xcb_window_t win = xcb_generate_id(conn);
+	static const char class[] = "bench\0bench0";
+
+	xcb_create_window(conn, XCB_COPY_FROM_PARENT, win, scrn->root,
+			0, 0, 16, 16, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+			scrn->root_visual, 0, NULL);
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, win, XCB_ATOM_WM_CLASS,
+			XCB_ATOM_STRING, 8, sizeof(class), class);
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, win, ewmh->_NET_WM_NAME,
+			ewmh->UTF8_STRING, 8, 8, "term 0 ~");
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, win, XCB_ATOM_WM_NAME,
+			XCB_ATOM_STRING, 8, 8, "term 0 ~");
+	xcb_change_property(conn, XCB_PROP_MODE_REPLACE, win, allowed_atoms[ATOM_WM_ROLE],
+			XCB_ATOM_STRING, 8, 5, "bench");
+	xcb_ewmh_set_wm_window_type(ewmh, win, 1, &ewmh->_NET_WM_WINDOW_TYPE_NORMAL);
+	/* a round trip, so the window is there before timing */
+	free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+
+	return win;
+}
+
+/*
+ * Fetch the properties the way get_props did before it sent all the
+ * requests at once: one at a time, each waited for, and the atom of the
+ * role interned every time.
+ */
+static struct win_props *
+get_props_serial(xcb_window_t win)
+{
+	struct win_props *p = new_win_props();
+	xcb_icccm_get_wm_class_reply_t r_class;
+	xcb_ewmh_get_atoms_reply_t r_type;
+
+	if (xcb_icccm_get_wm_class_reply(conn, xcb_icccm_get_wm_class(conn, win),
+				&r_class, NULL) == 1) {
+		p->class = strdup(r_class.class_name);
+		p->instance = strdup(r_class.instance_name);
+		xcb_icccm_get_wm_class_reply_wipe(&r_class);
+	} else {
+		p->class = strdup("");
+		p->instance = strdup("");
+	}
+
+	if (xcb_ewmh_get_wm_window_type_reply(ewmh, xcb_ewmh_get_wm_window_type(ewmh, win),
+				&r_type, NULL) == 1) {
+		p->type = window_type_to_string(&r_type);
+		xcb_ewmh_get_atoms_reply_wipe(&r_type);
+	} else {
+		p->type = strdup("");
+	}
+
+	p->name = get_string_prop(win, ewmh->_NET_WM_NAME, 1);
+	if (p->name[0] == '\0') {
+		free(p->name);
+		p->name = get_string_prop(win, allowed_atoms[ATOM_WM_NAME], 0);
+	}
+	p->role = get_string_prop(win, get_atom("WM_WINDOW_ROLE"), 0);
+
+	return p;
+}
+
+static void
+bench_props(void)
+{
+	xcb_window_t win = make_window();
+	long long start;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < PROPS_ROUNDS; i++)
+		free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+	report("x_round_trip", PROPS_ROUNDS, (double)(now_ns() - start) / PROPS_ROUNDS / 1000,
+			"us");
+
+	start = now_ns();
+	for (i = 0; i < PROPS_ROUNDS; i++)
+		free_win_props(get_props_serial(win));
+	report("get_props_serial", PROPS_ROUNDS,
+			(double)(now_ns() - start) / PROPS_ROUNDS / 1000, "us/window");
+
+	start = now_ns();
+	for (i = 0; i < PROPS_ROUNDS; i++)
+		free_win_props(get_props(win));
+	report("get_props", PROPS_ROUNDS, (double)(now_ns() - start) / PROPS_ROUNDS / 1000,
+			"us/window");
+
+	xcb_destroy_window(conn, win);
+	xcb_flush(conn);
+}
+
+/*
+ * Register events on the existing windows as register_events did before it
+ * requested all their attributes at once: a round trip for each window.
+ */
+static void
+register_events_serial(void)
+{
+	xcb_window_t *windows;
+	int len, i;
+
+	len = wm_get_windows(scrn->root, &windows);
+	for (i = 0; i < len; i++) {
+		if (wm_is_listable(windows[i], 0))
+			wm_reg_window_event(windows[i], XCB_EVENT_MASK_PROPERTY_CHANGE);
+	}
+	if (len > 0)
+		free(windows);
+}
+
+/*
+ * Time the scan of the windows mapped when ruler starts, without -a, one
+ * window at a time and with register_events. Each scan is followed by a
+ * round trip, so the requests it made have been handled.
+ */
+static void
+bench_startup(void)
+{
+	xcb_window_t *wins;
+	long long start;
+	int r, i, n;
+
+	for (r = 0; r < (int)(sizeof(startup_counts) / sizeof(startup_counts[0])); r++) {
+		n = startup_counts[r];
+		wins = malloc(n * sizeof(xcb_window_t));
+		if (wins == NULL)
+			err(1, "malloc");
+		for (i = 0; i < n; i++) {
+			wins[i] = xcb_generate_id(conn);
+			xcb_create_window(conn, XCB_COPY_FROM_PARENT, wins[i], scrn->root,
+					0, 0, 16, 16, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+					scrn->root_visual, 0, NULL);
+			xcb_map_window(conn, wins[i]);
+		}
+		free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+
+		start = now_ns();
+		for (i = 0; i < STARTUP_ROUNDS; i++) {
+			register_events_serial();
+			free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+		}
+		report("register_events_serial", n,
+				(double)(now_ns() - start) / STARTUP_ROUNDS / 1000000, "ms/scan");
+
+		start = now_ns();
+		for (i = 0; i < STARTUP_ROUNDS; i++) {
+			register_events();
+			free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+		}
+		report("register_events", n,
+				(double)(now_ns() - start) / STARTUP_ROUNDS / 1000000, "ms/scan");
+
+		for (i = 0; i < n; i++)
+			xcb_destroy_window(conn, wins[i]);
+		xcb_flush(conn);
+		free(wins);
+	}
+}
+
+/*
+ * Start the shell with the command the way ruler did before posix_spawn:
+ * a fork for the command, in which a fork writes the command to a pipe and
+ * a fork reads it with the shell, both waited for. The first fork copies
+ * the address space of ruler, whose size is what the cost depends on.
+ */
+static pid_t
+fork_shell(char *shell, command_t cmd)
+{
+	char *argv[] = { shell, NULL };
+	int desc[2];
+	pid_t pid;
+
+	pid = fork();
+	if (pid != 0)
+		return pid;
+
+	if (pipe(desc) == -1)
+		_exit(1);
+	if (fork() == 0) {
+		close(STDOUT_FILENO);
+		dup(desc[1]);
+		close(desc[0]);
+		close(desc[1]);
+		fputs(cmd, stdout);
+		exit(0);
+	}
+	if (fork() == 0) {
+		close(STDIN_FILENO);
+		dup(desc[0]);
+		close(desc[1]);
+		close(desc[0]);
+		setsid();
+		execvp(argv[0], argv);
+		_exit(1);
+	}
+	close(desc[0]);
+	close(desc[1]);
+	wait(NULL);
+	wait(NULL);
+	_exit(0);
+}
+
+/*
+ * Start the shell with a command that does nothing and wait for it, with
+ * spawn and with fork_shell.
+ */
+static void
+bench_spawn_rss(long rss_mb)
+{
+	long long start;
+	pid_t pid;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < FORK_ROUNDS; i++) {
+		pid = fork_shell(conf.shell, "true");
+		if (pid == -1)
+			err(1, "fork");
+		waitpid(pid, NULL, 0);
+	}
+	report("fork_shell", rss_mb, (double)(now_ns() - start) / FORK_ROUNDS / 1000,
+			"us/command");
+
+	start = now_ns();
+	for (i = 0; i < SPAWN_ROUNDS; i++) {
+		pid = spawn(conf.shell, "true", environ);
+		if (pid == -1)
+			errx(1, "couldn't spawn %s", conf.shell);
+		waitpid(pid, NULL, 0);
+	}
+	report("spawn", rss_mb, (double)(now_ns() - start) / SPAWN_ROUNDS / 1000,
+			"us/command");
+}
+
+/*
+ * The size is the memory of ruler touched besides its own, in MiB: none,
+ * then as much as a large configuration or a long session could take.
+ */
+static void
+bench_spawn(void)
+{
+	size_t size;
+	char *mem;
+	int r;
+
+	for (r = 0; r < (int)(sizeof(rss_sizes) / sizeof(rss_sizes[0])); r++) {
+		size = (size_t)rss_sizes[r] << 20;
+		mem = NULL;
+		if (size > 0) {
+			mem = malloc(size);
+			if (mem == NULL)
+				err(1, "malloc");
+			memset(mem, 1, size);
+		}
+		bench_spawn_rss(rss_sizes[r]);
+		free(mem);
+	}
+}
+
+/*
+ * Id of window i, as the X server gives them: a few clients, each with
+ * consecutive ids from its own base.
+ */
+static xcb_window_t
+window_id(int i)
+{
+	return ((xcb_window_t)(i % 64 + 1) << 21) | (i / 64);
+}
+
+/*
+ * Rules of a desktop, each with one criterion, with the programs of the
+ * window manager replaced by /bin/true with the same arguments.
+ */
+static const char *desktop_rules[][3] = {
+	{ "name", "\".*\"", "/bin/true created \"$RULER_WID\"" },
+	{ "type", "\"^normal$\"", "/bin/true raise \"$RULER_WID\"" },
+	{ "type", "\"^dialog$\"", "/bin/true center \"$RULER_WID\"" },
+	{ "type", "\"^notification$\"", "/bin/true ignore \"$RULER_WID\"" },
+	{ "class", "\"^(URxvt|Alacritty|kitty)$\"", "/bin/true group_add \"$RULER_WID\" 2" },
+	{ "class", "\"^(URxvt|Alacritty|kitty)$\"", "/bin/true opacity 0.9 \"$RULER_WID\" > /dev/null" },
+	{ "class", "\"^firefox$\"", "/bin/true desktop 1 \"$RULER_WID\"" },
+	{ "role", "\"browser\"", "/bin/true \"$RULER_WID\" && /bin/true group_add_window 2" },
+	{ "name", "\"Picture-in-Picture\"", "/bin/true sticky \"$RULER_WID\"" },
+	{ "class", "\"^mpv$\"", "/bin/true fullscreen \"$RULER_WID\"" },
+	{ "class", "\"^mpv$\"", "/bin/true notify playing" },
+	{ "class", "\"^Gimp$\"", "/bin/true desktop 4 \"$RULER_WID\"" },
+};
+
+/* windows of the desktop: class, type, name and role */
+static const char *desktop_windows[][4] = {
+	{ "URxvt", "normal", "~ - zsh", "" },
+	{ "Alacritty", "normal", "vim ruler.c", "" },
+	{ "firefox", "normal", "Mozilla Firefox", "browser" },
+	{ "firefox", "dialog", "Save As", "GtkFileChooserDialog" },
+	{ "firefox", "normal", "Picture-in-Picture", "PictureInPicture" },
+	{ "mpv", "normal", "video.mkv - mpv", "" },
+	{ "Gimp", "normal", "GNU Image Manipulation Program", "gimp-image-window" },
+	{ "Dunst", "notification", "dunst", "" },
+	{ "Pavucontrol", "normal", "Volume Control", "" },
+	{ "kitty", "normal", "htop", "" },
+};
+
+/*
+ * Returns the processes made on the system since it booted, or -1 if it
+ * isn't known.
+ */
+static long
+forks_made(void)
+{
+	char line[128];
+	long n = -1;
+	FILE *f;
+
+	f = fopen("/proc/stat", "r");
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "processes %ld", &n) == 1)
+			break;
+	}
+	fclose(f);
+
+	return n;
+}
+
+/*
+ * Handle the windows of the desktop against its rules, for COALESCE_ROUNDS
+ * rounds, with the commands of a window each run on their own or, with
+ * coalesce, joined into one shell. The commands of a round are waited for
+ * before the next.
+ */
+static void
+bench_coalesce_run(struct ruleset *rs, const char *name, int coalesce)
+{
+	struct win_props *props[sizeof(desktop_windows) / sizeof(desktop_windows[0])];
+	int nr_windows = sizeof(desktop_windows) / sizeof(desktop_windows[0]);
+	unsigned long started;
+	long long start;
+	long forks;
+	int *matches;
+	int i, r, nr;
+
+	matches = malloc(rs->nr_blocks * sizeof(int));
+	if (matches == NULL)
+		err(1, "malloc");
+	for (i = 0; i < nr_windows; i++) {
+		props[i] = new_win_props();
+		props[i]->class = strdup(desktop_windows[i][0]);
+		props[i]->instance = strdup(desktop_windows[i][0]);
+		props[i]->type = strdup(desktop_windows[i][1]);
+		props[i]->name = strdup(desktop_windows[i][2]);
+		props[i]->role = strdup(desktop_windows[i][3]);
+	}
+
+	conf.coalesce = coalesce;
+	memset(&stats, 0, sizeof(stats));
+	forks = forks_made();
+	start = now_ns();
+	for (r = 0; r < COALESCE_ROUNDS; r++) {
+		for (i = 0; i < nr_windows; i++) {
+			nr = ruleset_match(rs, props[i], matches);
+			execute_blocks(rs, matches, nr, now_us(), window_id(i));
+		}
+		while (wait(NULL) > 0)
+			;
+	}
+	nr = COALESCE_ROUNDS * nr_windows;
+	started = stats.spawns + stats.direct_spawns;
+	report(name, nr, (double)(now_ns() - start) / nr / 1000, "us/window");
+	report(name, nr, (double)started / nr, "starts/window");
+	if (forks != -1)
+		report(name, nr, (double)(forks_made() - forks) / nr, "forks/window");
+
+	conf.coalesce = 0;
+	for (i = 0; i < nr_windows; i++)
+		free_win_props(props[i]);
+	free(matches);
+}
+
+/*
+ * Make the rules of the desktop. With shell, every command is sent to
+ * /dev/null by the shell, so none can be run without it.
+ */
+static struct ruleset *
+make_desktop(int shell)
+{
+	struct list *l = NULL, *d;
+	char cmd[128];
+	int i;
+
+	for (i = 0; i < (int)(sizeof(desktop_rules) / sizeof(desktop_rules[0])); i++) {
+		d = NULL;
+		list_add(&d, new_descriptor((char *)desktop_rules[i][0],
+				strdup(desktop_rules[i][1])));
+		snprintf(cmd, sizeof(cmd), "%s%s", desktop_rules[i][2],
+				shell && strchr(desktop_rules[i][2], '>') == NULL ? " > /dev/null" : "");
+		list_add(&l, new_block(d, strdup(cmd)));
+	}
+
+	return ruleset_new(l, NULL);
+}
+
+/*
+ * Run the commands of the windows of a desktop with and without -c, for
+ * the commands ruler starts for each window, the processes they make in
+ * all and the time to run them. Then the same with commands that all need
+ * the shell.
+ */
+static void
+bench_coalesce(void)
+{
+	struct ruleset *rs;
+	int shell;
+
+	for (shell = 0; shell <= 1; shell++) {
+		rs = make_desktop(shell);
+		bench_coalesce_run(rs, shell ? "no_coalesce_shell" : "no_coalesce", 0);
+		bench_coalesce_run(rs, shell ? "coalesce_shell" : "coalesce", 1);
+		ruleset_put(rs);
+	}
+}
+
+/*
+ * Is the window in the list, a walk like is_new_window did.
+ */
+static struct list *
+list_find(struct list *l, xcb_window_t win)
+{
+	for (; l != NULL; l = l->next) {
+		if (*(xcb_window_t *)l->n == win)
+			return l;
+	}
+
+	return NULL;
+}
+
+/*
+ * Track windows in a winmap, and in a list of allocated ids as win_list
+ * did, then look them up, half of them not there, and forget them.
+ */
+static void
+bench_winmap(void)
+{
+	struct winmap set;
+	struct list *list, *node;
+	xcb_window_t *id;
+	long long start;
+	unsigned long found = 0;
+	int r, n, i;
+
+	for (r = 0; r < (int)(sizeof(window_counts) / sizeof(window_counts[0])); r++) {
+		n = window_counts[r];
+
+		winmap_init(&set);
+		start = now_ns();
+		for (i = 0; i < n; i++)
+			winmap_put(&set, window_id(i), NULL);
+		report("winmap_insert", n, (double)(now_ns() - start) / n, "ns/window");
+
+		start = now_ns();
+		for (i = 0; i < WINMAP_LOOKUPS; i++)
+			found += winmap_has(&set, window_id(i % (2 * n)));
+		report("winmap_lookup", n, (double)(now_ns() - start) / WINMAP_LOOKUPS, "ns/window");
+
+		start = now_ns();
+		for (i = 0; i < n; i++)
+			winmap_del(&set, window_id(i), NULL);
+		report("winmap_delete", n, (double)(now_ns() - start) / n, "ns/window");
+		winmap_free(&set);
+
+		list = NULL;
+		start = now_ns();
+		for (i = 0; i < n; i++) {
+			id = malloc(sizeof(xcb_window_t));
+			*id = window_id(i);
+			list_add(&list, id);
+		}
+		report("list_insert", n, (double)(now_ns() - start) / n, "ns/window");
+
+		/* spread over the list, as windows are destroyed in any order */
+		start = now_ns();
+		for (i = 0; i < LIST_LOOKUPS; i++)
+			found += list_find(list, window_id((int)(i * 7919LL % (2 * n)))) != NULL;
+		report("list_lookup", n, (double)(now_ns() - start) / LIST_LOOKUPS, "ns/window");
+
+		start = now_ns();
+		for (i = 0; i < LIST_LOOKUPS; i++) {
+			node = list_find(list, window_id((int)(i * 7919LL % n)));
+			if (node != NULL)
+				list_delete(&list, node);
+		}
+		report("list_delete", n, (double)(now_ns() - start) / LIST_LOOKUPS, "ns/window");
+
+		for (node = list; node != NULL; node = node->next)
+			free(node->n);
+		list_free(&list);
+	}
+
+	if (found == 0)
+		warnx("no window found");
+}
+
+static struct bench benches[] = {
+	{ "match", bench_match, 0 },
+	{ "props", bench_props, 1 },
+	{ "startup", bench_startup, 1 },
+	{ "spawn", bench_spawn, 0 },
+	{ "coalesce", bench_coalesce, 0 },
+	{ "winmap", bench_winmap, 0 },
+	{ NULL, NULL, 0 }
+};
+
+/*
+ * Connect to the X server like ruler does.
+ *
+ * Returns -1 if there is none.
+ */
+static int
+connect_x(void)
+{
+	if (getenv("DISPLAY") == NULL || wm_init_xcb() == -1 || wm_get_screen() == -1)
+		return -1;
+	init_ewmh();
+	populate_allowed_atoms();
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int have_x, i, j;
+
+	init_conf();
+	if (conf.shell == NULL)
+		conf.shell = "/bin/sh";
+	/* the commands are waited for */
+	signal(SIGCHLD, SIG_DFL);
+	have_x = connect_x() == 0;
+
+	for (i = 0; benches[i].name != NULL; i++) {
+		for (j = 1; j < argc && strcmp(argv[j], benches[i].name) != 0; j++)
+			;
+		if (argc > 1 && j == argc)
+			continue;
+		if (benches[i].needs_x && !have_x) {
+			warnx("no X server, skipping %s", benches[i].name);
+			continue;
+		}
+		benches[i].fn();
+	}
+
+	if (have_x)
+		wm_kill_xcb();
+
+	return 0;
+}
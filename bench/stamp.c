@@ -0,0 +1,35 @@
+/*
+ * Command run by the rules of the benchmark: appends the window it was run
+ * for, from $RULER_WID, and the time it started, in ns on the monotonic
+ * clock, as a line to the file given.
+ *
+ * The line is written at once with O_APPEND, so the lines of commands
+ * running together aren't mixed.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+int
+main(int argc, char **argv)
+{
+	struct timespec ts;
+	char line[64];
+	char *wid = getenv("RULER_WID");
+	int fd, len;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (argc != 2 || wid == NULL)
+		return 1;
+
+	len = snprintf(line, sizeof(line), "%s %lld\n", wid,
+			(long long)ts.tv_sec * 1000000000 + ts.tv_nsec);
+	fd = open(argv[1], O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd == -1 || write(fd, line, len) != len)
+		return 1;
+	close(fd);
+
+	return 0;
+}
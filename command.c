@@ -0,0 +1,304 @@
+#include <ctype.h>
+#include <err.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ruler.h"
+#include "command.h"
+
+/*
+ * Words that mean something to the shell when they start a command:
+ * reserved words and the builtins that change the state of the shell or
+ * exist only inside it.
+ */
+static const char *shell_words[] = {
+	"!", "{", "}", "[[", "]]", "case", "do", "done", "elif", "else", "esac",
+	"fi", "for", "function", "if", "in", "select", "then", "time", "until",
+	"while", ".", ":", "alias", "bg", "break", "builtin", "cd", "command",
+	"continue", "declare", "eval", "exec", "exit", "export", "fc", "fg",
+	"getopts", "hash", "jobs", "let", "local", "read", "readonly", "return",
+	"set", "shift", "source", "trap", "type", "typeset", "ulimit", "umask",
+	"unalias", "unset", "wait", "pushd", "popd", "dirs", "disown", "shopt",
+	"times", "enable", "caller", "mapfile", "readarray"
+};
+
+/*
+ * Characters that stand for themselves outside of quotes.
+ */
+static int
+is_plain(char c)
+{
+	return isalnum((unsigned char)c) || (c != '\0' && strchr("-_./:,+=%@", c) != NULL);
+}
+
+/*
+ * Skip a reference to the window id at *p, written as $RULER_WID or
+ * ${RULER_WID}. Returns 0 if there isn't one.
+ */
+static int
+skip_wid(const char **p)
+{
+	size_t len = strlen(ENV_VARIABLE);
+	const char *s = *p + 1;
+
+	if (*s == '{') {
+		if (strncmp(s + 1, ENV_VARIABLE, len) != 0 || s[len + 1] != '}')
+			return 0;
+		*p = s + len + 2;
+		return 1;
+	}
+
+	if (strncmp(s, ENV_VARIABLE, len) != 0
+			|| isalnum((unsigned char)s[len]) || s[len] == '_')
+		return 0;
+	*p = s + len;
+	return 1;
+}
+
+static int
+is_shell_word(const char *word)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(shell_words) / sizeof(shell_words[0]); i++) {
+		if (strcmp(word, shell_words[i]) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Whether a command name is an executable file in $PATH, where
+ * posix_spawnp looks for it. Names with a slash aren't looked up.
+ */
+static int
+in_path(const char *name)
+{
+	const char *dir, *end, *path = getenv("PATH");
+	char *file;
+	size_t len;
+	int found = 0;
+
+	if (strchr(name, '/') != NULL)
+		return 1;
+	if (path == NULL)
+		path = "/bin:/usr/bin";
+
+	for (dir = path; !found; dir = end + 1) {
+		end = strchr(dir, ':');
+		if (end == NULL)
+			end = dir + strlen(dir);
+		len = end - dir;
+
+		file = malloc(len + strlen(name) + 2);
+		if (file == NULL)
+			err(1, "malloc");
+		/* an empty entry is the current directory */
+		memcpy(file, dir, len);
+		file[len] = '/';
+		strcpy(file + len + (len > 0), name);
+		found = access(file, X_OK) == 0;
+		free(file);
+
+		if (*end == '\0')
+			break;
+	}
+
+	return found;
+}
+
+/*
+ * Split cmd into words if it can be run without a shell.
+ *
+ * Words can be made of plain characters, single quoted strings, double
+ * quoted strings without expansions and at most one reference to the
+ * window id. Anything else (pipes, redirections, other variables, globs,
+ * escapes, more commands) needs the shell. So do assignments, reserved
+ * words and builtins like `cd` at the start of the command, and names that
+ * aren't in $PATH, which can be functions or builtins of the shell.
+ *
+ * Returns NULL if the command needs the shell.
+ */
+struct direct_cmd *
+direct_cmd_new(const char *cmd)
+{
+	struct direct_cmd *dc;
+	const char *p = cmd;
+	char *word;
+	size_t len;
+	int quoted, wid_at;
+
+	dc = calloc(1, sizeof(struct direct_cmd));
+	if (dc == NULL)
+		err(1, "calloc");
+	/* there can't be more words than half the characters, rounded up */
+	dc->argv = calloc(strlen(cmd) / 2 + 2, sizeof(char *));
+	dc->wid_at = calloc(strlen(cmd) / 2 + 2, sizeof(int));
+	word = malloc(strlen(cmd) + 1);
+	if (dc->argv == NULL || dc->wid_at == NULL || word == NULL)
+		err(1, "malloc");
+
+	while (isblank((unsigned char)*p))
+		p++;
+
+	while (*p != '\0') {
+		len = 0;
+		quoted = 0;
+		wid_at = -1;
+		while (*p != '\0' && !isblank((unsigned char)*p)) {
+			if (*p == '\'') {
+				for (p++; *p != '\'' && *p != '\0'; p++)
+					word[len++] = *p;
+				if (*p++ == '\0')
+					goto shell;
+				quoted = 1;
+			} else if (*p == '"') {
+				for (p++; *p != '"' && *p != '\0'; ) {
+					if (*p == '$' && wid_at == -1 && skip_wid(&p))
+						wid_at = len;
+					else if (*p == '$' || *p == '`' || *p == '\\')
+						goto shell;
+					else
+						word[len++] = *p++;
+				}
+				if (*p++ == '\0')
+					goto shell;
+				quoted = 1;
+			} else if (*p == '$' && wid_at == -1 && skip_wid(&p)) {
+				wid_at = len;
+			} else if (is_plain(*p)) {
+				word[len++] = *p++;
+			} else {
+				goto shell;
+			}
+		}
+		word[len] = '\0';
+
+		if (dc->argc == 0 && (quoted || wid_at != -1 || len == 0
+					|| strchr(word, '=') != NULL || is_shell_word(word)
+					|| !in_path(word)))
+			goto shell;
+
+		dc->wid_at[dc->argc] = wid_at;
+		dc->argv[dc->argc++] = strdup(word);
+
+		while (isblank((unsigned char)*p))
+			p++;
+	}
+
+	free(word);
+	if (dc->argc == 0) {
+		direct_cmd_free(dc);
+		return NULL;
+	}
+
+	return dc;
+
+shell:
+	free(word);
+	direct_cmd_free(dc);
+	return NULL;
+}
+
+void
+direct_cmd_free(struct direct_cmd *dc)
+{
+	int i;
+
+	for (i = 0; i < dc->argc; i++)
+		free(dc->argv[i]);
+	free(dc->argv);
+	free(dc->wid_at);
+	free(dc);
+}
+
+/*
+ * Quote cmd for the shell, by enclosing it in single quotes and writing
+ * the single quotes inside it as '\''.
+ */
+char *
+shell_quote(const char *cmd)
+{
+	const char *c;
+	char *quoted, *q;
+	size_t len = 3;
+
+	for (c = cmd; *c != '\0'; c++)
+		len += *c == '\'' ? 4 : 1;
+
+	q = quoted = malloc(len);
+	if (quoted == NULL)
+		err(1, "malloc");
+
+	*q++ = '\'';
+	for (c = cmd; *c != '\0'; c++) {
+		if (*c == '\'') {
+			memcpy(q, "'\\''", 4);
+			q += 4;
+		} else {
+			*q++ = *c;
+		}
+	}
+	*q++ = '\'';
+	*q = '\0';
+
+	return quoted;
+}
+
+/*
+ * Start the command with wid in place of the window id, the environment
+ * envp, and stdin from /dev/null like the commands run by the shell.
+ *
+ * Returns the pid of the command, or -1 if it couldn't be started.
+ */
+pid_t
+direct_cmd_spawn(struct direct_cmd *dc, const char *wid, char **envp)
+{
+	posix_spawn_file_actions_t actions;
+	char **argv;
+	size_t wid_len;
+	pid_t pid;
+	int i;
+
+	if (wid == NULL)
+		wid = "";
+	wid_len = strlen(wid);
+
+	argv = calloc(dc->argc + 1, sizeof(char *));
+	if (argv == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < dc->argc; i++) {
+		char *w = dc->argv[i];
+		int at = dc->wid_at[i];
+
+		if (at == -1) {
+			argv[i] = w;
+			continue;
+		}
+
+		argv[i] = malloc(strlen(w) + wid_len + 1);
+		if (argv[i] == NULL)
+			err(1, "malloc");
+		memcpy(argv[i], w, at);
+		memcpy(argv[i] + at, wid, wid_len);
+		strcpy(argv[i] + at + wid_len, w + at);
+	}
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	pid = spawn_argv(argv, &actions, envp);
+	posix_spawn_file_actions_destroy(&actions);
+
+	for (i = 0; i < dc->argc; i++) {
+		if (dc->wid_at[i] != -1)
+			free(argv[i]);
+	}
+	free(argv);
+
+	return pid;
+}
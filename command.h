@@ -0,0 +1,26 @@
+#ifndef __COMMAND_H
+#define __COMMAND_H
+
+#include <sys/types.h>
+
+/*
+ * A command that can be run without a shell.
+ *
+ * It is a simple command made of words, where the only expansion is the
+ * window id ($RULER_WID). The words are split when the configuration is
+ * loaded, and the window id is put in its place when the command is run.
+ */
+struct direct_cmd {
+	int argc;
+	/* words without the window id */
+	char **argv;
+	/* offset of the window id in each word, -1 if the word doesn't have it */
+	int *wid_at;
+};
+
+struct direct_cmd * direct_cmd_new(const char *);
+void direct_cmd_free(struct direct_cmd *);
+pid_t direct_cmd_spawn(struct direct_cmd *, const char *, char **);
+char * shell_quote(const char *);
+
+#endif
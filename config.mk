@@ -2,5 +2,8 @@ PREFIX = /usr/local
 MANPREFIX = $(PREFIX)/share/man
 MANDIR = $(MANPREFIX)/man1
 
+# engine matching the regexes that aren't plain strings, rx (built in) or libc
+REGEX = rx
+
 CFLAGS += -std=c99 -Wall -g -D_POSIX_C_SOURCE=200112L -D_XOPEN_SOURCE=500
-LDFLAGS += -lxcb -lxcb-ewmh -lxcb-icccm -lwm -lxcb-randr -lxcb-cursor
+LDFLAGS += -lpthread -lxcb -lxcb-ewmh -lxcb-icccm -lwm -lxcb-randr -lxcb-cursor
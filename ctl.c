@@ -0,0 +1,440 @@
+#ifdef __linux__
+#define _GNU_SOURCE	/* struct ucred */
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "asprintf.h"
+#include "ctl.h"
+
+/*
+ * Find where the control socket named name goes. A name with a slash is
+ * a path, anything else is put in a directory only the user can use,
+ * $XDG_RUNTIME_DIR or /tmp/ruler-<uid>, which is made if it doesn't exist.
+ *
+ * Returns the path, to be freed, or NULL if the directory isn't safe.
+ */
+char *
+ctl_path(const char *name)
+{
+	char *dir, *path;
+	struct stat st;
+
+	if (strchr(name, '/') != NULL)
+		return strdup(name);
+
+	dir = getenv("XDG_RUNTIME_DIR");
+	if (dir != NULL && *dir != '\0') {
+		dir = strdup(dir);
+	} else {
+		asprintf(&dir, "/tmp/ruler-%lu", (unsigned long)getuid());
+		if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+			warn("couldn't make %s", dir);
+			free(dir);
+			return NULL;
+		}
+	}
+
+	/* someone else's, or open to others, it could be used to fake a socket */
+	if (lstat(dir, &st) == -1 || !S_ISDIR(st.st_mode) || st.st_uid != getuid()
+			|| (st.st_mode & 077) != 0) {
+		warnx("%s isn't a directory that only you can use", dir);
+		free(dir);
+		return NULL;
+	}
+
+	asprintf(&path, "%s/%s", dir, name);
+	free(dir);
+	return path;
+}
+
+/*
+ * Find the user of the client connected on fd.
+ *
+ * Returns the uid, or -1 if it can't be known.
+ */
+static uid_t
+peer_uid(int fd)
+{
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return (uid_t)-1;
+	return cred.uid;
+#else
+	uid_t uid;
+	gid_t gid;
+
+	if (getpeereid(fd, &uid, &gid) == -1)
+		return (uid_t)-1;
+	return uid;
+#endif
+}
+
+/*
+ * Remove the socket at path if it's left by an instance that is gone, that
+ * is if it refuses connections. One that still accepts them is in use.
+ *
+ * Returns -1 if the socket is in use.
+ */
+static int
+remove_stale(struct sockaddr_un *addr)
+{
+	struct stat st;
+	int fd, status;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return 0;
+
+	status = connect(fd, (struct sockaddr *)addr, sizeof(*addr));
+	if (status == 0) {
+		warnx("%s is in use by another instance", addr->sun_path);
+		close(fd);
+		return -1;
+	}
+	if (errno == ECONNREFUSED && lstat(addr->sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(addr->sun_path);
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Make the control socket at path, replacing a stale one.
+ *
+ * Returns the listening socket, or -1.
+ */
+int
+ctl_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int fd, status;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		warnx("the path of the control socket is too long: %s", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (remove_stale(&addr) == -1)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		warn("socket");
+		return -1;
+	}
+
+	/* made for the user only, before anyone can connect */
+	mask = umask(0177);
+	status = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (status == -1 || listen(fd, 16) == -1) {
+		warn("couldn't listen on %s", path);
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+/*
+ * Stop serving a client, and close its connection.
+ */
+static void
+drop(struct ctl *ctl, struct ctl_req *req)
+{
+	loop_del_fd(ctl->loop, req->fd);
+	close(req->fd);
+	free(req->in);
+	free(req->out);
+
+	/* the others are kept in the order they came */
+	ctl->nr_clients--;
+	memmove(req, req + 1, (char *)&ctl->clients[ctl->nr_clients] - (char *)req);
+}
+
+/*
+ * Copy the command line of a client, and split it into the name of the
+ * command and its arguments.
+ *
+ * Returns the arguments.
+ */
+static char *
+split_line(struct ctl_req *req, char *line)
+{
+	size_t len = req->line_len;
+	char *args;
+
+	if (len > 0 && req->in[len - 1] == '\n')
+		len--;
+	memcpy(line, req->in, len);
+	line[len] = '\0';
+
+	args = line + strcspn(line, " \t\r");
+	if (*args != '\0')
+		*args++ = '\0';
+	args += strspn(args, " \t");
+
+	return args;
+}
+
+/*
+ * Find the command of the line of a client, NULL if there's none by its name.
+ */
+static struct ctl_cmd *
+find_cmd(struct ctl *ctl, struct ctl_req *req)
+{
+	char line[CTL_LINE_MAX];
+	int i;
+
+	split_line(req, line);
+	for (i = 0; ctl->cmds[i].name != NULL; i++) {
+		if (strcmp(ctl->cmds[i].name, line) == 0)
+			return &ctl->cmds[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Write what's left of the answer of a client, and drop it when it's all
+ * written.
+ */
+static void
+write_answer(struct ctl *ctl, struct ctl_req *req)
+{
+	ssize_t n;
+
+	while (req->out_done < req->out_len) {
+		n = write(req->fd, req->out + req->out_done, req->out_len - req->out_done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0)
+			break;
+		req->out_done += n;
+	}
+
+	drop(ctl, req);
+}
+
+/*
+ * Run the command of a client that was read in full, and start writing
+ * the answer, which is made in a temporary file like the rules of parse_text.
+ */
+static void
+run_cmd(struct ctl *ctl, struct ctl_req *req)
+{
+	char line[CTL_LINE_MAX], *args;
+	FILE *f;
+	long len;
+
+	args = split_line(req, line);
+	f = tmpfile();
+	if (f == NULL) {
+		warn("tmpfile");
+		drop(ctl, req);
+		return;
+	}
+
+	if (req->cmd != NULL && (req->cmd->flags & CTL_OWNER) && req->uid != getuid())
+		fprintf(f, "error %s is only for the user running ruler\n", line);
+	else if (req->cmd != NULL)
+		req->cmd->fn(f, args, req);
+	else
+		fprintf(f, "error unknown command: %s\n", line);
+
+	fflush(f);
+	len = ftell(f);
+	rewind(f);
+	req->out = malloc(len > 0 ? len : 1);
+	if (req->out == NULL)
+		err(1, "malloc");
+	req->out_len = len > 0 && fread(req->out, len, 1, f) == 1 ? len : 0;
+	req->out_done = 0;
+	fclose(f);
+
+	loop_watch_fd(ctl->loop, req->fd, 1);
+	write_answer(ctl, req);
+}
+
+/*
+ * Read what a client sent so far, and run its command once it's complete:
+ * at the end of the line, or for a command that reads the text after it, when
+ * the client shuts its side down.
+ */
+static void
+read_request(struct ctl *ctl, struct ctl_req *req)
+{
+	char *nl, *tmp;
+	ssize_t n;
+
+	for (;;) {
+		if (req->in_len == req->in_size) {
+			req->in_size = req->in_size ? 2 * req->in_size : CTL_LINE_MAX;
+			tmp = realloc(req->in, req->in_size);
+			if (tmp == NULL)
+				err(1, "realloc");
+			req->in = tmp;
+		}
+
+		n = read(req->fd, req->in + req->in_len, req->in_size - req->in_len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n == -1) {
+			drop(ctl, req);
+			return;
+		}
+		if (n == 0)
+			break;
+
+		req->in_len += n;
+		if (req->line_len == 0) {
+			nl = memchr(req->in, '\n', req->in_len);
+			if (nl == NULL && req->in_len >= CTL_LINE_MAX - 1) {
+				drop(ctl, req);
+				return;
+			}
+			if (nl == NULL)
+				continue;
+			req->line_len = nl - req->in + 1;
+			req->cmd = find_cmd(ctl, req);
+			if (req->cmd == NULL || !(req->cmd->flags & CTL_BODY))
+				break;
+		}
+		/* ctl_read_body tells the command that the text is too long */
+		if (req->in_len - req->line_len > CTL_BODY_MAX)
+			break;
+	}
+
+	if (req->line_len == 0) {
+		/* a command without a newline is fine at the end of the stream */
+		if (req->in_len == 0) {
+			drop(ctl, req);
+			return;
+		}
+		req->line_len = req->in_len;
+		req->cmd = find_cmd(ctl, req);
+	}
+
+	run_cmd(ctl, req);
+}
+
+/*
+ * Get the text that the client sent after the command line.
+ *
+ * Returns the text, to be freed, or NULL if it is longer than CTL_BODY_MAX.
+ */
+char *
+ctl_read_body(struct ctl_req *req, size_t *len)
+{
+	char *body;
+
+	*len = req->in_len - req->line_len;
+	if (*len > CTL_BODY_MAX)
+		return NULL;
+
+	body = malloc(*len + 1);
+	if (body == NULL)
+		err(1, "malloc");
+	memcpy(body, req->in + req->line_len, *len);
+	body[*len] = '\0';
+
+	return body;
+}
+
+/*
+ * Serve the clients of the listening socket sock, running their command
+ * from cmds, which ends with a NULL name. The clients are watched by loop,
+ * and fn has to call ctl_handle for them.
+ */
+void
+ctl_init(struct ctl *ctl, int sock, struct ctl_cmd *cmds, struct loop *loop, loop_fn fn)
+{
+	ctl->sock = sock;
+	ctl->cmds = cmds;
+	ctl->loop = loop;
+	ctl->client_fn = fn;
+	ctl->nr_clients = 0;
+}
+
+/*
+ * Take the clients waiting on the control socket.
+ */
+void
+ctl_accept(struct ctl *ctl)
+{
+	struct ctl_req *req;
+	int fd;
+
+	while ((fd = accept(ctl->sock, NULL, NULL)) != -1) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+
+		if (ctl->nr_clients == CTL_MAX_CLIENTS)
+			drop(ctl, &ctl->clients[0]);
+		if (loop_add_fd(ctl->loop, fd, ctl->client_fn) == -1) {
+			close(fd);
+			continue;
+		}
+
+		req = &ctl->clients[ctl->nr_clients++];
+		memset(req, 0, sizeof(*req));
+		req->fd = fd;
+		req->uid = peer_uid(fd);
+	}
+}
+
+/*
+ * Go on serving the client of fd, which is ready to be read or written.
+ */
+void
+ctl_handle(struct ctl *ctl, int fd)
+{
+	int i;
+
+	for (i = 0; i < ctl->nr_clients; i++) {
+		if (ctl->clients[i].fd != fd)
+			continue;
+		if (ctl->clients[i].out != NULL)
+			write_answer(ctl, &ctl->clients[i]);
+		else
+			read_request(ctl, &ctl->clients[i]);
+		return;
+	}
+}
+
+/*
+ * Drop the clients and remove the control socket.
+ */
+void
+ctl_close(struct ctl *ctl, const char *path)
+{
+	while (ctl->nr_clients > 0)
+		drop(ctl, &ctl->clients[0]);
+	close(ctl->sock);
+	unlink(path);
+}
@@ -0,0 +1,87 @@
+#ifndef __CTL_H
+#define __CTL_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "loop.h"
+
+/* longest command line that a client can send */
+#define CTL_LINE_MAX 1024
+/* longest text that can follow the command line */
+#define CTL_BODY_MAX 65536
+/* most clients served at once */
+#define CTL_MAX_CLIENTS 16
+
+/* flags of commands */
+enum {
+	/* reads the text after the line */
+	CTL_BODY = 1 << 0,
+	/* changes the rules or their use, so only for the user running ruler */
+	CTL_OWNER = 1 << 1
+};
+
+/*
+ * Control socket, a UNIX stream socket made with -u.
+ *
+ * A client sends a command on a line, "<name> [<args>]", and gets the
+ * answer, after which the connection is closed. Some commands read more
+ * text after the line, until the client shuts its side down. Answers are
+ * made of lines, like "<key> <value>" for the statistics, and a command
+ * that fails answers "error <message>".
+ *
+ * The socket is made only accessible to its owner, in a directory of its
+ * own if the name given has no slash. Commands that change something are
+ * refused to clients of other users anyway, which the socket could have
+ * been opened to.
+ *
+ * The clients are watched by the event loop, and what they send and what
+ * they are answered is buffered, so a slow client never holds up the
+ * handling of events. A command runs once it has been read in full, from
+ * the loop, so never in the middle of handling events. When CTL_MAX_CLIENTS
+ * are being served, the oldest one is dropped for the next.
+ */
+/* a client being served */
+struct ctl_req {
+	int fd;
+	/* user of the client, -1 if unknown */
+	uid_t uid;
+	/* what was read: the command line, then the text after it */
+	char *in;
+	size_t in_len, in_size;
+	/* length of the line with its newline, 0 until it's read */
+	size_t line_len;
+	struct ctl_cmd *cmd;
+	/* the answer, and how much of it was written */
+	char *out;
+	size_t out_len, out_done;
+};
+
+typedef void (*ctl_fn)(FILE *, char *, struct ctl_req *);
+
+struct ctl_cmd {
+	const char *name;
+	ctl_fn fn;
+	int flags;
+};
+
+struct ctl {
+	int sock;
+	struct ctl_cmd *cmds;
+	/* the loop watching the clients, and the callback for them */
+	struct loop *loop;
+	loop_fn client_fn;
+	/* in the order they came */
+	struct ctl_req clients[CTL_MAX_CLIENTS];
+	int nr_clients;
+};
+
+char * ctl_path(const char *);
+int ctl_listen(const char *);
+void ctl_init(struct ctl *, int, struct ctl_cmd *, struct loop *, loop_fn);
+void ctl_accept(struct ctl *);
+void ctl_handle(struct ctl *, int);
+char * ctl_read_body(struct ctl_req *, size_t *);
+void ctl_close(struct ctl *, const char *);
+
+#endif
@@ -0,0 +1,93 @@
+#include <stdio.h>
+
+#include "hist.h"
+
+static int
+bucket_of(unsigned long long v)
+{
+	int shift;
+
+	if (v >= 1ULL << HIST_MAX_BITS)
+		v = (1ULL << HIST_MAX_BITS) - 1;
+	if (v < HIST_SUB)
+		return v;
+
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
+
+/*
+ * Returns the highest value that goes in bucket i.
+ */
+static unsigned long long
+bucket_max(int i)
+{
+	int shift;
+
+	if (i < 2 * HIST_SUB)
+		return i;
+
+	shift = i / HIST_SUB - 1;
+	return ((unsigned long long)(i - shift * HIST_SUB + 1) << shift) - 1;
+}
+
+void
+hist_add(struct hist *h, unsigned long long v)
+{
+	unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&h->counts[bucket_of(v)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->total, v, __ATOMIC_RELAXED);
+	while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Returns the value below which there are q (between 0 and 1) of
+ * the values, rounded up to the end of its bucket.
+ */
+unsigned long long
+hist_percentile(struct hist *h, double q)
+{
+	unsigned long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	unsigned long long v, max;
+	unsigned long seen = 0, want;
+	int i;
+
+	if (count == 0)
+		return 0;
+
+	want = q * count + 0.5;
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+		if (seen >= want)
+			break;
+	}
+
+	v = bucket_max(i < HIST_BUCKETS ? i : HIST_BUCKETS - 1);
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	return v < max ? v : max;
+}
+
+/*
+ * Print the count, the mean, some percentiles and the maximum, as lines of
+ * "<name>_<what> <value>".
+ */
+void
+hist_print(FILE *f, const char *name, struct hist *h)
+{
+	unsigned long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	unsigned long long total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+
+	fprintf(f, "%s_count %lu\n", name, count);
+	fprintf(f, "%s_mean %llu\n", name, count ? total / count : 0);
+	fprintf(f, "%s_p50 %llu\n", name, hist_percentile(h, 0.50));
+	fprintf(f, "%s_p90 %llu\n", name, hist_percentile(h, 0.90));
+	fprintf(f, "%s_p99 %llu\n", name, hist_percentile(h, 0.99));
+	fprintf(f, "%s_p999 %llu\n", name, hist_percentile(h, 0.999));
+	fprintf(f, "%s_max %llu\n", name, __atomic_load_n(&h->max, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,33 @@
+#ifndef __HIST_H
+#define __HIST_H
+
+#include <stdio.h>
+
+/* sub-buckets per power of two, which gives a precision of 1/16 */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+/* values are recorded up to 2^HIST_MAX_BITS - 1, bigger ones are clamped */
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/*
+ * Histogram of latencies, with log-linear buckets like HdrHistogram.
+ *
+ * Values below HIST_SUB have a bucket each. Above, every power of two is
+ * split into HIST_SUB buckets, so the error of a percentile is at most
+ * 1/HIST_SUB of its value, with a fixed and small memory use.
+ *
+ * hist_add can be called from several threads at once.
+ */
+struct hist {
+	unsigned long counts[HIST_BUCKETS];
+	unsigned long count;
+	unsigned long long total;
+	unsigned long long max;
+};
+
+void hist_add(struct hist *, unsigned long long);
+unsigned long long hist_percentile(struct hist *, double);
+void hist_print(FILE *, const char *, struct hist *);
+
+#endif
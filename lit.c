@@ -0,0 +1,133 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lit.h"
+
+/* LIT_NO_SIMD builds the byte by byte search only, to test the other ones */
+#if defined(LIT_NO_SIMD)
+#elif defined(__AVX2__)
+#include <immintrin.h>
+
+#define LIT_WIDTH 32
+typedef __m256i lit_vec;
+#define VEC_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define VEC_SPLAT(c) _mm256_set1_epi8(c)
+#define VEC_EQ(a, b) _mm256_cmpeq_epi8(a, b)
+#define VEC_OR(a, b) _mm256_or_si256(a, b)
+#define VEC_AND(a, b) _mm256_and_si256(a, b)
+#define VEC_MASK(v) (uint32_t)_mm256_movemask_epi8(v)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define LIT_WIDTH 16
+typedef __m128i lit_vec;
+#define VEC_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define VEC_SPLAT(c) _mm_set1_epi8(c)
+#define VEC_EQ(a, b) _mm_cmpeq_epi8(a, b)
+#define VEC_OR(a, b) _mm_or_si128(a, b)
+#define VEC_AND(a, b) _mm_and_si128(a, b)
+#define VEC_MASK(v) (uint32_t)_mm_movemask_epi8(v)
+#endif
+
+/*
+ * Compare n bytes of s with the literal.
+ */
+static int
+lit_eq(const char *s, const char *lit, size_t n, int icase)
+{
+	size_t i;
+
+	if (!icase)
+		return memcmp(s, lit, n) == 0;
+
+	for (i = 0; i < n; i++) {
+		if (tolower((unsigned char)s[i]) != (unsigned char)lit[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Find the first place of the literal of n bytes in the len bytes of s.
+ *
+ * Returns a pointer to it, or NULL if it isn't there.
+ */
+const char *
+lit_find(const char *s, size_t len, const char *lit, size_t n, int icase)
+{
+	const char *p;
+	size_t i = 0;
+
+	if (n == 0)
+		return s;
+	if (n > len)
+		return NULL;
+
+#ifdef LIT_WIDTH
+	{
+		lit_vec first = VEC_SPLAT(lit[0]);
+		lit_vec first_up = VEC_SPLAT(icase ? toupper((unsigned char)lit[0]) : lit[0]);
+		lit_vec last = VEC_SPLAT(lit[n - 1]);
+		lit_vec last_up = VEC_SPLAT(icase ? toupper((unsigned char)lit[n - 1]) : lit[n - 1]);
+		lit_vec a, b;
+		uint32_t mask;
+
+		/* the places where both the first and the last byte are right */
+		for (; i + n - 1 + LIT_WIDTH <= len; i += LIT_WIDTH) {
+			a = VEC_LOAD(s + i);
+			b = VEC_LOAD(s + i + n - 1);
+			mask = VEC_MASK(VEC_AND(VEC_OR(VEC_EQ(a, first), VEC_EQ(a, first_up)),
+					VEC_OR(VEC_EQ(b, last), VEC_EQ(b, last_up))));
+			while (mask != 0) {
+				p = s + i + __builtin_ctz(mask);
+				if (lit_eq(p, lit, n, icase))
+					return p;
+				mask &= mask - 1;
+			}
+		}
+	}
+#endif
+
+	if (!icase) {
+		while ((p = memchr(s + i, lit[0], len - n + 1 - i)) != NULL) {
+			if (memcmp(p, lit, n) == 0)
+				return p;
+			i = p - s + 1;
+		}
+		return NULL;
+	}
+
+	for (; i + n <= len; i++) {
+		if (lit_eq(s + i, lit, n, icase))
+			return s + i;
+	}
+
+	return NULL;
+}
+
+/*
+ * Match a string against the literal of n bytes of a descriptor, with the
+ * anchors found by literal_pattern. This gives the same result as regexec
+ * with the regex of the descriptor.
+ */
+int
+lit_match(const char *s, const char *lit, size_t n, int anchor, int icase)
+{
+	size_t len = strlen(s);
+
+	if (n > len)
+		return 0;
+
+	switch (anchor & (LIT_BOL | LIT_EOL)) {
+		case LIT_BOL | LIT_EOL:
+			return n == len && lit_eq(s, lit, n, icase);
+		case LIT_BOL:
+			return lit_eq(s, lit, n, icase);
+		case LIT_EOL:
+			return lit_eq(s + len - n, lit, n, icase);
+		default:
+			return lit_find(s, len, lit, n, icase) != NULL;
+	}
+}
@@ -0,0 +1,27 @@
+#ifndef __LIT_H
+#define __LIT_H
+
+#include <stddef.h>
+
+/* anchors of a literal, at the start or the end of the string */
+enum {
+	LIT_BOL = 1 << 0,
+	LIT_EOL = 1 << 1
+};
+
+/*
+ * Search of the fixed strings of literal descriptors, without regexec.
+ *
+ * Candidate positions are found by comparing the first and the last byte
+ * of the literal with 16 or 32 bytes of the string at a time, with SSE2 or
+ * AVX2 when the compiler targets them, and byte by byte otherwise. Only the
+ * candidates are compared in full.
+ *
+ * When case is ignored, the literal has to be lowercase, as made by
+ * literal_pattern, and ASCII letters of the string match either case,
+ * like regexec with REG_ICASE in the C locale.
+ */
+const char * lit_find(const char *, size_t, const char *, size_t, int);
+int lit_match(const char *, const char *, size_t, int, int);
+
+#endif
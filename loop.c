@@ -0,0 +1,425 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#else
+#include <poll.h>
+#endif
+
+#include "loop.h"
+
+static struct loop_fd *
+find_fd(struct loop *l, int fd)
+{
+	int i;
+
+	for (i = 0; i < l->nr_fds; i++) {
+		if (l->fds[i].fd == fd)
+			return &l->fds[i];
+	}
+
+	return NULL;
+}
+
+#ifdef __linux__
+
+int
+loop_init(struct loop *l)
+{
+	struct epoll_event ev;
+
+	memset(l, 0, sizeof(*l));
+	sigemptyset(&l->sigs);
+
+	l->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	l->sig_fd = signalfd(-1, &l->sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+	l->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (l->epoll_fd == -1 || l->sig_fd == -1 || l->timer_fd == -1) {
+		warn("couldn't create the event loop");
+		loop_free(l);
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = l->sig_fd;
+	epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, l->sig_fd, &ev);
+	ev.data.fd = l->timer_fd;
+	epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, l->timer_fd, &ev);
+
+	return 0;
+}
+
+void
+loop_free(struct loop *l)
+{
+	if (l->epoll_fd > 0)
+		close(l->epoll_fd);
+	if (l->sig_fd > 0)
+		close(l->sig_fd);
+	if (l->timer_fd > 0)
+		close(l->timer_fd);
+	sigprocmask(SIG_UNBLOCK, &l->sigs, NULL);
+	l->epoll_fd = l->sig_fd = l->timer_fd = -1;
+}
+
+int
+loop_add_fd(struct loop *l, int fd, loop_fn fn)
+{
+	struct epoll_event ev;
+
+	if (l->nr_fds == LOOP_MAX_FDS)
+		return -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		warn("epoll_ctl");
+		return -1;
+	}
+
+	l->fds[l->nr_fds].fd = fd;
+	l->fds[l->nr_fds].fn = fn;
+	l->fds[l->nr_fds].write = 0;
+	l->nr_fds++;
+	return 0;
+}
+
+/*
+ * Watch fd for writing if write is set, for reading otherwise.
+ */
+int
+loop_watch_fd(struct loop *l, int fd, int write)
+{
+	struct loop_fd *f = find_fd(l, fd);
+	struct epoll_event ev;
+
+	if (f == NULL)
+		return -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = write ? EPOLLOUT : EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(l->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+		warn("epoll_ctl");
+		return -1;
+	}
+
+	f->write = write;
+	return 0;
+}
+
+/*
+ * Stop watching fd, before it's closed.
+ */
+void
+loop_del_fd(struct loop *l, int fd)
+{
+	struct loop_fd *f = find_fd(l, fd);
+
+	if (f == NULL)
+		return;
+
+	epoll_ctl(l->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	*f = l->fds[--l->nr_fds];
+}
+
+/*
+ * Block sig and read it from the signalfd instead.
+ */
+int
+loop_add_signal(struct loop *l, int sig, loop_fn fn)
+{
+	if (sig <= 0 || sig >= LOOP_MAX_SIG)
+		return -1;
+
+	sigaddset(&l->sigs, sig);
+	sigprocmask(SIG_BLOCK, &l->sigs, NULL);
+	if (signalfd(l->sig_fd, &l->sigs, 0) == -1) {
+		warn("signalfd");
+		return -1;
+	}
+
+	l->sig_fns[sig] = fn;
+	return 0;
+}
+
+/*
+ * Call fn after ms milliseconds, once. A negative ms disarms the timer.
+ */
+void
+loop_set_timer(struct loop *l, long long ms, loop_fn fn)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (ms >= 0) {
+		/* a zero it_value would disarm the timer */
+		if (ms == 0)
+			its.it_value.tv_nsec = 1;
+		else {
+			its.it_value.tv_sec = ms / 1000;
+			its.it_value.tv_nsec = (ms % 1000) * 1000000;
+		}
+	}
+
+	l->timer_fn = fn;
+	timerfd_settime(l->timer_fd, 0, &its, NULL);
+}
+
+static void
+read_signals(struct loop *l)
+{
+	struct signalfd_siginfo si;
+
+	while (read(l->sig_fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo < LOOP_MAX_SIG && l->sig_fns[si.ssi_signo] != NULL)
+			l->sig_fns[si.ssi_signo](si.ssi_signo);
+	}
+}
+
+/*
+ * Wait for events and call their callbacks.
+ *
+ * Returns -1 if waiting failed.
+ */
+int
+loop_run(struct loop *l)
+{
+	struct epoll_event evs[LOOP_MAX_FDS + 2];
+	struct loop_fd *f;
+	uint64_t expirations;
+	int nr, i;
+
+	nr = epoll_wait(l->epoll_fd, evs, LOOP_MAX_FDS + 2, -1);
+	if (nr == -1)
+		return errno == EINTR ? 0 : -1;
+
+	for (i = 0; i < nr; i++) {
+		int fd = evs[i].data.fd;
+
+		if (fd == l->sig_fd) {
+			read_signals(l);
+		} else if (fd == l->timer_fd) {
+			if (read(l->timer_fd, &expirations, sizeof(expirations)) > 0
+					&& l->timer_fn != NULL)
+				l->timer_fn(0);
+		} else if ((f = find_fd(l, fd)) != NULL) {
+			/* looked up for each event, a callback may remove others */
+			f->fn(fd);
+		}
+	}
+
+	return 0;
+}
+
+#else /* __linux__ */
+
+/* write end of the signal pipe, for the signal handler */
+static int sig_pipe = -1;
+
+static void
+write_signal(int sig)
+{
+	unsigned char c = sig;
+	int saved = errno;
+
+	write(sig_pipe, &c, 1);
+	errno = saved;
+}
+
+static long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+loop_init(struct loop *l)
+{
+	int fds[2];
+
+	memset(l, 0, sizeof(*l));
+	sigemptyset(&l->sigs);
+	l->deadline = -1;
+
+	if (pipe(fds) == -1) {
+		warn("couldn't create the event loop");
+		return -1;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	l->sig_fd = fds[0];
+	sig_pipe = fds[1];
+
+	return 0;
+}
+
+void
+loop_free(struct loop *l)
+{
+	struct sigaction sa;
+	int sig;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	for (sig = 1; sig < LOOP_MAX_SIG; sig++) {
+		if (l->sig_fns[sig] != NULL)
+			sigaction(sig, &sa, NULL);
+	}
+
+	close(l->sig_fd);
+	close(sig_pipe);
+	l->sig_fd = sig_pipe = -1;
+}
+
+int
+loop_add_fd(struct loop *l, int fd, loop_fn fn)
+{
+	if (l->nr_fds == LOOP_MAX_FDS)
+		return -1;
+
+	l->fds[l->nr_fds].fd = fd;
+	l->fds[l->nr_fds].fn = fn;
+	l->fds[l->nr_fds].write = 0;
+	l->nr_fds++;
+	return 0;
+}
+
+/*
+ * Watch fd for writing if write is set, for reading otherwise.
+ */
+int
+loop_watch_fd(struct loop *l, int fd, int write)
+{
+	struct loop_fd *f = find_fd(l, fd);
+
+	if (f == NULL)
+		return -1;
+
+	f->write = write;
+	return 0;
+}
+
+/*
+ * Stop watching fd, before it's closed.
+ */
+void
+loop_del_fd(struct loop *l, int fd)
+{
+	struct loop_fd *f = find_fd(l, fd);
+
+	if (f != NULL)
+		*f = l->fds[--l->nr_fds];
+}
+
+/*
+ * Catch sig with a handler that writes it to the signal pipe.
+ */
+int
+loop_add_signal(struct loop *l, int sig, loop_fn fn)
+{
+	struct sigaction sa;
+
+	if (sig <= 0 || sig >= LOOP_MAX_SIG)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = write_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(sig, &sa, NULL) == -1) {
+		warn("sigaction");
+		return -1;
+	}
+
+	sigaddset(&l->sigs, sig);
+	l->sig_fns[sig] = fn;
+	return 0;
+}
+
+/*
+ * Call fn after ms milliseconds, once. A negative ms disarms the timer.
+ */
+void
+loop_set_timer(struct loop *l, long long ms, loop_fn fn)
+{
+	l->timer_fn = fn;
+	l->deadline = ms >= 0 ? now_ms() + ms : -1;
+}
+
+/*
+ * Wait for events and call their callbacks.
+ *
+ * Returns -1 if waiting failed.
+ */
+int
+loop_run(struct loop *l)
+{
+	struct pollfd pfds[LOOP_MAX_FDS + 1];
+	struct loop_fd *f;
+	unsigned char sigs[16];
+	long long timeout = -1;
+	ssize_t n;
+	int nr, nr_fds, i;
+
+	for (i = 0; i < l->nr_fds; i++) {
+		pfds[i].fd = l->fds[i].fd;
+		pfds[i].events = l->fds[i].write ? POLLOUT : POLLIN;
+	}
+	pfds[i].fd = l->sig_fd;
+	pfds[i].events = POLLIN;
+	nr_fds = l->nr_fds;
+
+	if (l->deadline != -1) {
+		timeout = l->deadline - now_ms();
+		if (timeout < 0)
+			timeout = 0;
+	}
+
+	nr = poll(pfds, nr_fds + 1, (int)timeout);
+	if (nr == -1)
+		return errno == EINTR ? 0 : -1;
+
+	if (l->deadline != -1 && now_ms() >= l->deadline) {
+		l->deadline = -1;
+		if (l->timer_fn != NULL)
+			l->timer_fn(0);
+	}
+
+	if (pfds[nr_fds].revents & POLLIN) {
+		while ((n = read(l->sig_fd, sigs, sizeof(sigs))) > 0) {
+			for (i = 0; i < n; i++) {
+				if (l->sig_fns[sigs[i]] != NULL)
+					l->sig_fns[sigs[i]](sigs[i]);
+			}
+		}
+	}
+
+	for (i = 0; i < nr_fds; i++) {
+		/* looked up for each event, a callback may remove others */
+		if ((pfds[i].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR))
+				&& (f = find_fd(l, pfds[i].fd)) != NULL)
+			f->fn(pfds[i].fd);
+	}
+
+	return 0;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,59 @@
+#ifndef __LOOP_H
+#define __LOOP_H
+
+#include <signal.h>
+
+/* most file descriptors and highest signal number that a loop can watch */
+#define LOOP_MAX_FDS 32
+#define LOOP_MAX_SIG 32
+
+/*
+ * Event loop that waits for file descriptors, signals and a timer.
+ *
+ * The signals added to the loop are delivered as events, so their handlers
+ * run from the loop and not in the middle of something else, and a signal
+ * that comes just before the loop waits isn't missed.
+ *
+ * On Linux, the loop uses epoll, with a signalfd for the signals (which
+ * are blocked) and a timerfd. Elsewhere it uses poll, with a pipe written
+ * by the signal handler, and the poll timeout for the timer.
+ *
+ * Every callback gets the file descriptor, the signal number or 0 for
+ * the timer. A descriptor is watched for reading, or for writing after
+ * loop_watch_fd, and its callback may remove it from the loop.
+ */
+typedef void (*loop_fn)(int);
+
+struct loop_fd {
+	int fd;
+	loop_fn fn;
+	int write;
+};
+
+struct loop {
+	struct loop_fd fds[LOOP_MAX_FDS];
+	int nr_fds;
+	loop_fn sig_fns[LOOP_MAX_SIG];
+	sigset_t sigs;
+	/* signalfd, or read end of the signal pipe */
+	int sig_fd;
+	loop_fn timer_fn;
+#ifdef __linux__
+	int epoll_fd;
+	int timer_fd;
+#else
+	/* when the timer expires in ms on the monotonic clock, -1 if unset */
+	long long deadline;
+#endif
+};
+
+int loop_init(struct loop *);
+void loop_free(struct loop *);
+int loop_add_fd(struct loop *, int, loop_fn);
+int loop_watch_fd(struct loop *, int, int);
+void loop_del_fd(struct loop *, int);
+int loop_add_signal(struct loop *, int, loop_fn);
+void loop_set_timer(struct loop *, long long, loop_fn);
+int loop_run(struct loop *);
+
+#endif
@@ -47,6 +47,9 @@ descriptor: CRITERION EQUALS STRING
 void
 yyerror(const char *str)
 {
+	extern int config_errors;
+
+	config_errors++;
 	fprintf(stderr, "error: %s\n", str);
 }
 
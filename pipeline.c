@@ -0,0 +1,259 @@
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pipeline.h"
+#include "pool.h"
+#include "queue.h"
+#include "ruler.h"
+#include "ruleset.h"
+
+/* the executor keeps up to this many jobs that finished out of order */
+#define REORDER_SIZE (4 * PIPELINE_QUEUE)
+
+extern struct conf conf;
+extern struct pool pool;
+extern struct stats stats;
+extern const int _debug;
+
+static struct queue jobs, results;
+/* count the jobs in each queue, for waiting */
+static sem_t jobs_sem, results_sem;
+/*
+ * count the jobs that can still be submitted, so that there are never more
+ * than REORDER_SIZE jobs between pipeline_submit and the end of run_job
+ */
+static sem_t slots_sem;
+static pthread_t threads[PIPELINE_MAX_THREADS], executor;
+static int nr_threads;
+static int stopping, exec_stopping;
+/* sequence number of the next job, written only by pipeline_submit */
+static unsigned long submitted;
+
+/*
+ * Wait for a job, retrying after interrupts.
+ */
+static void
+sem_wait_intr(sem_t *sem)
+{
+	while (sem_wait(sem) == -1 && errno == EINTR)
+		;
+}
+
+/*
+ * Match the windows of the jobs queue and pass them to the executor.
+ *
+ * The match_ctx is made again when a job comes with another ruleset.
+ * The thread keeps a reference to the ruleset of its match_ctx, so that
+ * it can't be freed, and another one made at the same address.
+ */
+static void *
+match_main(void *arg)
+{
+	struct match_ctx *ctx = NULL;
+	struct job *job;
+	long long start;
+
+	for (;;) {
+		sem_wait_intr(&jobs_sem);
+		while ((job = queue_pop(&jobs)) == NULL) {
+			if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+				goto out;
+			sched_yield();
+		}
+
+		if (ctx == NULL || ctx->rs != job->rs) {
+			if (ctx != NULL) {
+				ruleset_put(ctx->rs);
+				match_ctx_free(ctx);
+			}
+			ctx = match_ctx_new(ruleset_get(job->rs));
+		}
+
+		job->matches = malloc((job->rs->nr_blocks + 1) * sizeof(int));
+		if (job->matches == NULL)
+			err(1, "malloc");
+		start = now_ns();
+		job->nr_matches = match_ctx_match(ctx, job->props, job->matches);
+		hist_add(&stats.match, now_ns() - start);
+
+		while (queue_push(&results, job) == -1)
+			sched_yield();
+		sem_post(&results_sem);
+	}
+
+out:
+	if (ctx != NULL) {
+		ruleset_put(ctx->rs);
+		match_ctx_free(ctx);
+	}
+	return NULL;
+}
+
+static void
+run_job(struct job *job)
+{
+	execute_blocks(job->rs, job->matches, job->nr_matches, job->since, job->win);
+
+	ruleset_put(job->rs);
+	free_win_props(job->props);
+	free(job->matches);
+	free(job);
+}
+
+/*
+ * Run the commands of the matched jobs in the order of their sequence
+ * numbers, keeping the jobs that come early until their turn.
+ *
+ * With -w, the worker pool is used only from here, so its completions are
+ * also read here, at least once a second.
+ */
+static void *
+executor_main(void *arg)
+{
+	struct job **reorder, *job;
+	struct timespec ts;
+	unsigned long next = 0;
+
+	reorder = calloc(REORDER_SIZE, sizeof(struct job *));
+	if (reorder == NULL)
+		err(1, "calloc");
+
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		if (sem_timedwait(&results_sem, &ts) == -1 && conf.workers > 0)
+			pool_reap(&pool);
+
+		while ((job = queue_pop(&results)) != NULL) {
+			/* slots_sem keeps the jobs in flight within the window */
+			if (reorder[job->seq % REORDER_SIZE] != NULL)
+				errx(1, "this is a bug: job %lu came with job %lu pending",
+						job->seq, reorder[job->seq % REORDER_SIZE]->seq);
+			reorder[job->seq % REORDER_SIZE] = job;
+		}
+
+		while ((job = reorder[next % REORDER_SIZE]) != NULL && job->seq == next) {
+			reorder[next % REORDER_SIZE] = NULL;
+			run_job(job);
+			next++;
+			sem_post(&slots_sem);
+		}
+
+		if (__atomic_load_n(&exec_stopping, __ATOMIC_ACQUIRE)
+				&& next == __atomic_load_n(&submitted, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	free(reorder);
+	return NULL;
+}
+
+/*
+ * Start nr match threads and the executor.
+ */
+int
+pipeline_start(int nr)
+{
+	int i, status;
+
+	if (queue_init(&jobs, PIPELINE_QUEUE) == -1
+			|| queue_init(&results, PIPELINE_QUEUE) == -1)
+		err(1, "malloc");
+	sem_init(&jobs_sem, 0, 0);
+	sem_init(&results_sem, 0, 0);
+	sem_init(&slots_sem, 0, REORDER_SIZE);
+
+	for (nr_threads = 0; nr_threads < nr; nr_threads++) {
+		status = pthread_create(&threads[nr_threads], NULL, match_main, NULL);
+		if (status != 0) {
+			warnx("couldn't start a match thread: %s", strerror(status));
+			break;
+		}
+	}
+
+	status = pthread_create(&executor, NULL, executor_main, NULL);
+	if (nr_threads == 0 || status != 0) {
+		if (status != 0)
+			warnx("couldn't start the executor: %s", strerror(status));
+		__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+		for (i = 0; i < nr_threads; i++)
+			sem_post(&jobs_sem);
+		for (i = 0; i < nr_threads; i++)
+			pthread_join(threads[i], NULL);
+		if (status == 0) {
+			__atomic_store_n(&exec_stopping, 1, __ATOMIC_RELEASE);
+			sem_post(&results_sem);
+			pthread_join(executor, NULL);
+		}
+		queue_free(&jobs);
+		queue_free(&results);
+		return -1;
+	}
+
+	DMSG("pipeline with %d match threads\n", nr_threads);
+	return 0;
+}
+
+/*
+ * Hand a window to the match threads. The pipeline takes the properties
+ * and the reference to the ruleset.
+ *
+ * If REORDER_SIZE jobs are already in flight, which happens when the
+ * executor is held up by synchronous commands, this waits until the
+ * executor is done with one.
+ */
+void
+pipeline_submit(xcb_window_t win, struct win_props *props, struct ruleset *rs,
+		long long since)
+{
+	struct job *job = malloc(sizeof(struct job));
+
+	if (job == NULL)
+		err(1, "malloc");
+	sem_wait_intr(&slots_sem);
+
+	job->seq = submitted;
+	job->win = win;
+	job->props = props;
+	job->rs = rs;
+	job->matches = NULL;
+	job->nr_matches = 0;
+	job->since = since;
+	__atomic_store_n(&submitted, submitted + 1, __ATOMIC_RELEASE);
+
+	while (queue_push(&jobs, job) == -1)
+		sched_yield();
+	sem_post(&jobs_sem);
+}
+
+/*
+ * Finish the jobs that were submitted and stop the threads.
+ */
+void
+pipeline_stop(void)
+{
+	int i;
+
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < nr_threads; i++)
+		sem_post(&jobs_sem);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	__atomic_store_n(&exec_stopping, 1, __ATOMIC_RELEASE);
+	sem_post(&results_sem);
+	pthread_join(executor, NULL);
+
+	queue_free(&jobs);
+	queue_free(&results);
+	sem_destroy(&jobs_sem);
+	sem_destroy(&results_sem);
+	sem_destroy(&slots_sem);
+}
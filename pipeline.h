@@ -0,0 +1,40 @@
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <xcb/xcb.h>
+
+/* size of the queues between the stages, a power of two */
+#define PIPELINE_QUEUE 1024
+/* most match threads */
+#define PIPELINE_MAX_THREADS 64
+
+/*
+ * Matching and executing on threads of their own, used with -t.
+ *
+ * The event loop stays the only user of the X connection: it reads the
+ * events and fetches the properties, then hands each window to the match
+ * threads with pipeline_submit. A match thread matches it against the
+ * ruleset it was given, with a match_ctx of its own. The executor thread
+ * runs the commands in the order the windows were submitted, so a
+ * synchronous command only holds up the commands after it.
+ */
+struct ruleset;
+struct win_props;
+
+/* a window going through the pipeline */
+struct job {
+	unsigned long seq;
+	xcb_window_t win;
+	struct win_props *props;
+	struct ruleset *rs;
+	int *matches;
+	int nr_matches;
+	/* time of the event, in µs */
+	long long since;
+};
+
+int pipeline_start(int);
+void pipeline_submit(xcb_window_t, struct win_props *, struct ruleset *, long long);
+void pipeline_stop(void);
+
+#endif
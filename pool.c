@@ -0,0 +1,349 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "asprintf.h"
+#include "command.h"
+#include "ruler.h"
+#include "pool.h"
+
+extern char **environ;
+extern const int _debug;
+
+/*
+ * Move fd above the standard descriptors and the one the workers use for
+ * the completion pipe, and mark it close-on-exec.
+ *
+ * The workers get their descriptors through dup2, which wouldn't clear
+ * close-on-exec if the descriptor was already in the right place.
+ */
+static int
+fd_move(int fd)
+{
+	int nfd;
+
+	if (fd > 3) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		return fd;
+	}
+
+	nfd = fcntl(fd, F_DUPFD, 4);
+	close(fd);
+	if (nfd != -1)
+		fcntl(nfd, F_SETFD, FD_CLOEXEC);
+	return nfd;
+}
+
+/*
+ * Write all of buf, retrying after interrupts and short writes.
+ */
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Start the shell of worker i, reading jobs from a new pipe and writing
+ * completions to fd 3.
+ */
+static int
+worker_start(struct pool *p, int i)
+{
+	struct worker *w = &p->workers[i];
+	posix_spawn_file_actions_t actions;
+	char *argv[] = { p->shell, "-s", NULL };
+	int fds[2];
+
+	if (pipe(fds) == -1) {
+		warn("pipe");
+		return -1;
+	}
+	fds[0] = fd_move(fds[0]);
+	fds[1] = fd_move(fds[1]);
+	if (fds[0] == -1 || fds[1] == -1) {
+		warn("fcntl");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, p->done_w, 3);
+	w->pid = spawn_argv(argv, &actions, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[0]);
+
+	if (w->pid == -1) {
+		close(fds[1]);
+		w->in = -1;
+		return -1;
+	}
+
+	w->in = fds[1];
+	w->job = 0;
+	DMSG("worker %d started, pid %d\n", i, (int)w->pid);
+	return 0;
+}
+
+/*
+ * Close the stdin of worker i, so its shell exits after the running job.
+ */
+static void
+worker_stop(struct pool *p, int i)
+{
+	struct worker *w = &p->workers[i];
+
+	if (w->in != -1)
+		close(w->in);
+	w->in = -1;
+	w->job = 0;
+}
+
+/*
+ * Check if the shell of worker i still runs. Workers aren't waited for,
+ * because SIGCHLD is ignored and the kernel reaps them.
+ */
+static int
+worker_alive(struct pool *p, int i)
+{
+	return kill(p->workers[i].pid, 0) == 0 || errno != ESRCH;
+}
+
+/*
+ * Build the text of a job for worker i.
+ *
+ * The command is run by eval in a subshell, so that it can't change the
+ * state of the worker, with stdin from /dev/null and without the completion
+ * pipe. Its exit status is reported on the completion pipe afterwards.
+ *
+ * Before each job, `jobs` makes the worker reap the background jobs that
+ * are done, which some shells (like dash) only do when asked.
+ */
+static char *
+job_text(int i, unsigned long id, const char *cmd, const char *wid, int sync)
+{
+	char *quoted_cmd, *quoted_wid, *job;
+	const char *fmt = sync
+		? "jobs >/dev/null; "
+		  "(exec 3>&-; %s=%s; export %s; eval %s) </dev/null\n"
+		  "echo \"%d %lu $?\" >&3\n"
+		: "jobs >/dev/null; "
+		  "{ (exec 3>&-; %s=%s; export %s; eval %s) </dev/null; "
+		  "echo \"%d %lu $?\" >&3; } &\n";
+
+	quoted_cmd = shell_quote(cmd);
+	quoted_wid = shell_quote(wid != NULL ? wid : "");
+	if (asprintf(&job, fmt, ENV_VARIABLE, quoted_wid, ENV_VARIABLE,
+				quoted_cmd, i, id) == -1)
+		err(1, "asprintf");
+	free(quoted_cmd);
+	free(quoted_wid);
+
+	return job;
+}
+
+/*
+ * Start nr workers running shell.
+ */
+int
+pool_init(struct pool *p, char *shell, int nr)
+{
+	int fds[2];
+	int i, started = 0;
+
+	memset(p, 0, sizeof(*p));
+	if (shell == NULL)
+		return -1;
+
+	if (pipe(fds) == -1) {
+		warn("pipe");
+		return -1;
+	}
+	p->done = fd_move(fds[0]);
+	p->done_w = fd_move(fds[1]);
+	if (p->done == -1 || p->done_w == -1) {
+		warn("fcntl");
+		close(p->done);
+		close(p->done_w);
+		return -1;
+	}
+	fcntl(p->done, F_SETFL, fcntl(p->done, F_GETFL) | O_NONBLOCK);
+
+	p->shell = shell;
+	p->nr = nr;
+	p->next_job = 1;
+	p->workers = calloc(nr, sizeof(struct worker));
+	if (p->workers == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < nr; i++)
+		started += worker_start(p, i) == 0;
+
+	if (started == 0) {
+		pool_free(p);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Stop the workers. The running jobs aren't interrupted.
+ */
+void
+pool_free(struct pool *p)
+{
+	int i;
+
+	for (i = 0; i < p->nr; i++)
+		worker_stop(p, i);
+	free(p->workers);
+	p->workers = NULL;
+	p->nr = 0;
+
+	if (p->done_w > 0)
+		close(p->done_w);
+	if (p->done > 0)
+		close(p->done);
+	p->done = p->done_w = -1;
+}
+
+/*
+ * Read the completion pipe and mark the workers whose synchronous job is
+ * done as idle. Doesn't block.
+ */
+void
+pool_reap(struct pool *p)
+{
+	char *line, *nl;
+	ssize_t n;
+	unsigned long id;
+	int i, status;
+
+	for (;;) {
+		n = read(p->done, p->buf + p->len, sizeof(p->buf) - p->len - 1);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		p->len += n;
+		p->buf[p->len] = '\0';
+
+		line = p->buf;
+		while ((nl = strchr(line, '\n')) != NULL) {
+			*nl = '\0';
+			if (sscanf(line, "%d %lu %d", &i, &id, &status) == 3
+					&& i >= 0 && i < p->nr) {
+				DMSG("worker %d: job %lu exited with %d\n", i, id, status);
+				if (p->workers[i].job == id)
+					p->workers[i].job = 0;
+			}
+			line = nl + 1;
+		}
+
+		/* keep the partial line, drop garbage that fills the buffer */
+		p->len -= line - p->buf;
+		memmove(p->buf, line, p->len);
+		if (p->len == sizeof(p->buf) - 1)
+			p->len = 0;
+	}
+}
+
+/*
+ * Wait until worker i finishes its job. If the worker dies, start a new one.
+ */
+static void
+pool_wait(struct pool *p, int i)
+{
+	struct pollfd pfd;
+	int ready;
+
+	pfd.fd = p->done;
+	pfd.events = POLLIN;
+	while (p->workers[i].job != 0) {
+		ready = poll(&pfd, 1, 1000);
+		if (ready > 0) {
+			pool_reap(p);
+		} else if (ready == 0 && !worker_alive(p, i)) {
+			warnx("worker %d died", i);
+			worker_stop(p, i);
+			worker_start(p, i);
+			return;
+		}
+	}
+}
+
+/*
+ * Give cmd to a worker, with the window id wid in the environment.
+ * The workers are used in turn, so that the forks are spread among them.
+ * If sync is set, wait until the command is done.
+ *
+ * Returns 0 if the command was run, or -1 if no worker could take it.
+ */
+int
+pool_run(struct pool *p, const char *cmd, const char *wid, int sync)
+{
+	struct worker *w;
+	unsigned long id;
+	char *job;
+	int i, n, status;
+
+	pool_reap(p);
+	for (n = 0; n < p->nr; n++) {
+		i = p->next_worker;
+		p->next_worker = (i + 1) % p->nr;
+		w = &p->workers[i];
+		if (w->job == 0 && (w->in != -1 || worker_start(p, i) == 0))
+			break;
+	}
+	if (n == p->nr)
+		return -1;
+
+	id = p->next_job++;
+	if (p->next_job == 0)
+		p->next_job = 1;
+
+	job = job_text(i, id, cmd, wid, sync);
+	status = write_all(w->in, job, strlen(job));
+	if (status == -1) {
+		/* the shell is gone, SIGPIPE is ignored. try a new one */
+		DMSG("worker %d: %s\n", i, strerror(errno));
+		worker_stop(p, i);
+		if (worker_start(p, i) == 0)
+			status = write_all(w->in, job, strlen(job));
+	}
+	free(job);
+
+	if (status == -1) {
+		worker_stop(p, i);
+		return -1;
+	}
+
+	if (sync) {
+		w->job = id;
+		pool_wait(p, i);
+	}
+
+	return 0;
+}
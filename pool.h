@@ -0,0 +1,42 @@
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <sys/types.h>
+
+/*
+ * Long-lived shells that run the commands sent to them over a pipe, so that
+ * a command doesn't need a new shell to be started.
+ *
+ * A worker reads jobs from its stdin and runs each one in a subshell, which
+ * is only a fork of the worker. Asynchronous jobs run in the background,
+ * synchronous ones in the foreground. After a job, "<worker> <job> <status>"
+ * is written to the completion pipe, which is shared by all the workers.
+ */
+struct worker {
+	pid_t pid;
+	/* write end of the worker's stdin, -1 if the worker isn't running */
+	int in;
+	/* id of the running synchronous job, 0 if there is none */
+	unsigned long job;
+};
+
+struct pool {
+	char *shell;
+	int nr;
+	struct worker *workers;
+	/* both ends of the completion pipe */
+	int done;
+	int done_w;
+	unsigned long next_job;
+	int next_worker;
+	/* partial line read from the completion pipe */
+	char buf[128];
+	size_t len;
+};
+
+int pool_init(struct pool *, char *, int);
+void pool_free(struct pool *);
+int pool_run(struct pool *, const char *, const char *, int);
+void pool_reap(struct pool *);
+
+#endif
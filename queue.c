@@ -0,0 +1,94 @@
+#include <stdlib.h>
+
+#include "queue.h"
+
+/*
+ * Make an empty queue. The size has to be a power of two.
+ */
+int
+queue_init(struct queue *q, size_t size)
+{
+	size_t i;
+
+	q->cells = malloc(size * sizeof(struct queue_cell));
+	if (q->cells == NULL)
+		return -1;
+
+	for (i = 0; i < size; i++)
+		q->cells[i].seq = i;
+	q->mask = size - 1;
+	q->head = q->tail = 0;
+
+	return 0;
+}
+
+void
+queue_free(struct queue *q)
+{
+	free(q->cells);
+	q->cells = NULL;
+}
+
+/*
+ * Returns 0 if data was added, -1 if the queue is full.
+ */
+int
+queue_push(struct queue *q, void *data)
+{
+	struct queue_cell *cell;
+	size_t pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Returns the oldest pointer of the queue, or NULL if it's empty. The queue
+ * can also look empty for a moment while a push is being finished.
+ */
+void *
+queue_pop(struct queue *q)
+{
+	struct queue_cell *cell;
+	size_t pos, seq;
+	long diff;
+	void *data;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)(pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	data = cell->data;
+	__atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+	return data;
+}
@@ -0,0 +1,36 @@
+#ifndef __QUEUE_H
+#define __QUEUE_H
+
+#include <stddef.h>
+
+/*
+ * Bounded queue of pointers for many producers and many consumers, without
+ * locks (Dmitry Vyukov's algorithm). Each cell has a sequence number that
+ * says if it can be written or read at a position, so producers and
+ * consumers only race for the head or the tail.
+ *
+ * Pushing to a full queue and popping from an empty one fail at once,
+ * waiting is up to the caller.
+ */
+struct queue_cell {
+	size_t seq;
+	void *data;
+};
+
+struct queue {
+	struct queue_cell *cells;
+	size_t mask;
+	/* on their own cache lines, written by consumers and by producers */
+	char pad0[64];
+	size_t head;
+	char pad1[64];
+	size_t tail;
+	char pad2[64];
+};
+
+int queue_init(struct queue *, size_t);
+void queue_free(struct queue *);
+int queue_push(struct queue *, void *);
+void * queue_pop(struct queue *);
+
+#endif
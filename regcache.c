@@ -0,0 +1,127 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ruler.h"
+#include "regcache.h"
+
+extern struct stats stats;
+extern const int _debug;
+
+static struct regcache_entry **buckets;
+static size_t nr_buckets, nr_entries;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long
+pattern_hash(const char *pattern, int flags)
+{
+	unsigned long h = 5381 + flags;
+
+	while (*pattern != '\0')
+		h = h * 33 + (unsigned char)*pattern++;
+
+	return h;
+}
+
+/*
+ * Double the number of buckets, or make the first ones.
+ */
+static void
+grow(void)
+{
+	struct regcache_entry **old = buckets, *e, *next;
+	size_t old_size = nr_buckets, i;
+
+	nr_buckets = old_size == 0 ? 64 : old_size * 2;
+	buckets = calloc(nr_buckets, sizeof(struct regcache_entry *));
+	if (buckets == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < old_size; i++) {
+		for (e = old[i]; e != NULL; e = next) {
+			next = e->next;
+			e->next = buckets[e->hash & (nr_buckets - 1)];
+			buckets[e->hash & (nr_buckets - 1)] = e;
+		}
+	}
+	free(old);
+}
+
+/*
+ * Return the compiled regex for pattern and flags, compiling it if it
+ * isn't in the cache.
+ *
+ * Returns NULL if the pattern doesn't compile. Failures aren't cached.
+ */
+regex_t *
+regcache_get(const char *pattern, int flags)
+{
+	struct regcache_entry *e;
+	unsigned long h = pattern_hash(pattern, flags);
+
+	pthread_mutex_lock(&lock);
+
+	if (nr_buckets > 0) {
+		for (e = buckets[h & (nr_buckets - 1)]; e != NULL; e = e->next) {
+			if (e->hash == h && e->flags == flags && strcmp(e->pattern, pattern) == 0) {
+				e->refs++;
+				__atomic_add_fetch(&stats.regcache_hits, 1, __ATOMIC_RELAXED);
+				pthread_mutex_unlock(&lock);
+				return &e->reg;
+			}
+		}
+	}
+
+	__atomic_add_fetch(&stats.regcache_misses, 1, __ATOMIC_RELAXED);
+	e = malloc(sizeof(struct regcache_entry));
+	if (e == NULL)
+		err(1, "malloc");
+
+	DMSG("new regex from `%s`\n", pattern);
+	if (regcomp(&e->reg, pattern, flags) != 0) {
+		free(e);
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+
+	e->pattern = strdup(pattern);
+	e->flags = flags;
+	e->refs = 1;
+	e->hash = h;
+
+	if (nr_entries >= nr_buckets)
+		grow();
+	e->next = buckets[h & (nr_buckets - 1)];
+	buckets[h & (nr_buckets - 1)] = e;
+	nr_entries++;
+
+	pthread_mutex_unlock(&lock);
+	return &e->reg;
+}
+
+/*
+ * Drop a reference to a regex returned by regcache_get, and free it with
+ * the last one.
+ */
+void
+regcache_put(regex_t *reg)
+{
+	struct regcache_entry *e = (struct regcache_entry *)reg, **p;
+
+	if (reg == NULL)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (--e->refs == 0) {
+		for (p = &buckets[e->hash & (nr_buckets - 1)]; *p != e; p = &(*p)->next)
+			;
+		*p = e->next;
+		nr_entries--;
+		regfree(&e->reg);
+		free(e->pattern);
+		free(e);
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,27 @@
+#ifndef __REGCACHE_H
+#define __REGCACHE_H
+
+#include <regex.h>
+
+/*
+ * Compiled regexes shared by the descriptors that use the same pattern
+ * with the same flags, also across reloads.
+ *
+ * A regex is compiled the first time it's asked for and freed when the
+ * last descriptor that uses it is freed. A reload makes the new rules
+ * before freeing the old ones, so the patterns that didn't change aren't
+ * compiled again. The cache can be used by more than one thread.
+ */
+struct regcache_entry {
+	regex_t reg;	/* first, so that the entry can be found from it */
+	char *pattern;
+	int flags;
+	int refs;
+	unsigned long hash;
+	struct regcache_entry *next;
+};
+
+regex_t * regcache_get(const char *, int);
+void regcache_put(regex_t *);
+
+#endif
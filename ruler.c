@@ -1,14 +1,23 @@
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <regex.h>
 #include <unistd.h>
 
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <sys/wait.h>
-#include <sys/select.h>
+#include <time.h>
 #include <xcb/xcb.h>
 #include <xcb/randr.h>
 #include <xcb/xcb_icccm.h>
@@ -17,25 +26,81 @@
 
 #include "arg.h"
 #include "asprintf.h"
+#include "command.h"
+#include "ctl.h"
+#include "lit.h"
+#include "loop.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "regcache.h"
 #include "ruler.h"
+#include "ruleset.h"
+#include "trace.h"
+#include "winmap.h"
 
 extern FILE * yyin;
 
 struct list *last_d = NULL;
+/* blocks being parsed, taken by the ruleset when the parsing is done */
 struct list *block_list = NULL;
-struct list *win_list = NULL;
+/* rules in use, only changed by the event loop */
+struct ruleset *rules = NULL;
+/* errors found while parsing, see load_rules */
+int config_errors = 0;
+struct winmap win_set;
+/* cached win_props of windows, used only when exec_on_prop_change is set */
+struct winmap props_cache;
+/* property changes held back with -d, see debounce_event */
+struct winmap debounced;
+/* shells that run the commands, used only with -w */
+struct pool pool;
+/* waits for X events, signals and timers */
+struct loop loop;
+/* the second windows are counted for, and the windows counted in it */
+long long rate_sec;
+unsigned long rate_windows;
+/* trace written with -T or played back with -X */
+struct trace trace;
+long long replay_base, replay_last;
+/* listening control socket, -1 without -u, and its clients */
+int ctl_fd = -1;
+struct ctl ctl;
+/* file being parsed, and line of the block being parsed */
+const char *parse_name;
+int parse_line;
+/* commands started with -P that didn't finish, by pid */
+struct winmap children;
+/* blocks added on the control socket, kept across reloads */
+struct list *ctl_blocks = NULL;
+int ctl_seq = 0;
 
 command_t last_c;
 extern char **environ;
 
 const int _debug = DEBUG;
 struct conf conf;
+struct stats stats;
 
 int state_run = 0, state_reload = 0, state_pause = 0;
 
 char *argv0;
 char **configs;
 int no_of_configs;
+/* $XDG_CONFIG_HOME/ruler/rulerrc, found at startup */
+char *config_path;
+
+/* reload running in the background, see reload_config */
+pthread_t reload_thread;
+int reload_running = 0, reload_again = 0;
+/* the rules in use when the reload started, and the reloaded ones */
+struct ruleset *reload_base, *reload_result;
+/* blocks of reload_result that were in reload_base */
+int reload_same;
+int reload_pipe[2];
+#ifdef __linux__
+/* watches of the directories of the configuration files, with -r */
+int inotify_fd = -1;
+#endif
 
 xcb_connection_t *conn;
 xcb_screen_t *scrn;
@@ -46,7 +111,7 @@ xcb_atom_t allowed_atoms[NR_ATOMS];
 void
 print_usage(const char *program_name, int exit_value)
 {
-	fprintf(stderr, "Usage: %s [-himopv] [-s shell] filename [filename...]\n", program_name);
+	fprintf(stderr, "Usage: %s [-acfhimoPprSv] [-d ms] [-s shell] [-t threads] [-T trace] [-u socket] [-w workers] [-X trace] filename [filename...]\n", program_name);
 	exit(exit_value);
 }
 
@@ -80,11 +145,64 @@ strip_quotes(char *str)
 	return s;
 }
 
+/*
+ * If the regex `str` can only match one fixed string, return that string
+ * and put its length in `len`. Anchors at the start or the end of the regex
+ * are reported in `anchor` as LIT_BOL and LIT_EOL.
+ *
+ * The string is lowercase when case is ignored.
+ * Returns NULL if the regex isn't a plain literal.
+ */
+char *
+literal_pattern(const char *str, size_t *len, int *anchor)
+{
+	const char *meta = ".[]()*+?{}|^$\\";
+	char *lit = malloc(strlen(str) + 1);
+	size_t n = 0;
+	char c;
+
+	*anchor = 0;
+	if (*str == '^') {
+		*anchor |= LIT_BOL;
+		str++;
+	}
+
+	for (; (c = *str) != '\0'; str++) {
+		if (c == '$' && str[1] == '\0') {
+			*anchor |= LIT_EOL;
+			break;
+		}
+
+		if (c == '\\') {
+			/* only escaped metacharacters stand for themselves */
+			c = *++str;
+			if (c == '\0' || strchr(meta, c) == NULL)
+				goto not_literal;
+		} else if (strchr(meta, c) != NULL) {
+			goto not_literal;
+		}
+
+		lit[n++] = conf.case_insensitive ? tolower((unsigned char)c) : c;
+	}
+
+	if (n == 0)
+		goto not_literal;
+	lit[n] = '\0';
+	*len = n;
+
+	return lit;
+
+not_literal:
+	free(lit);
+	*len = 0;
+	*anchor = 0;
+	return NULL;
+}
+
 struct descriptor *
 new_descriptor(char *criterion, char *str)
 {
 	struct descriptor *d = malloc(sizeof(struct descriptor));
-	int status;
 	str = strip_quotes(str);
 
 	/* convert criterion from string form to enum form */
@@ -97,15 +215,14 @@ new_descriptor(char *criterion, char *str)
 #undef MATCH_CRIT
 
 	d->str = str;
-	d->reg = malloc(sizeof(regex_t));
-
-	DMSG("new regex from `%s`\n", str);
-	status = regcomp(d->reg, str, REGEX_FLAGS | (conf.case_insensitive * REG_ICASE));
-	if (status != 0) {
+	d->evals = d->matches = 0;
+	d->match_ns = 0;
+	d->lit = literal_pattern(str, &d->lit_len, &d->lit_anchor);
+	/* also for the regexes rx matches: -P and one-off values use regexec */
+	d->reg = regcache_get(str, REGEX_FLAGS | (conf.case_insensitive * REG_ICASE));
+	if (d->reg == NULL) {
 		warnx("couldn't compile regex for %s=\"%s\". Check your regex.", criterion, str);
-		regfree(d->reg);
-		free(d->reg);
-		d->reg = NULL;
+		config_errors++;
 	}
 
 	return d;
@@ -121,6 +238,7 @@ criterion_to_string(enum criterion c)
 		case CRIT_TYPE: s = "type"; break;
 		case CRIT_NAME: s = "name"; break;
 		case CRIT_ROLE: s = "role"; break;
+		default: s = "unknown"; break;
 	}
 
 	return strdup(s);
@@ -133,6 +251,9 @@ void
 desc(char *crit, char *str)
 {
 	struct descriptor *d = new_descriptor(crit, str);
+
+	if (last_d == NULL)
+		parse_line = yylineno;
 	list_add(&last_d, d);
 }
 
@@ -141,10 +262,33 @@ desc(char *crit, char *str)
  */
 void descriptor_free(struct descriptor *d)
 {
+	regcache_put(d->reg);
 	free(d->str);
+	free(d->lit);
 	free(d);
 }
 
+/*
+ * Copy a descriptor. The regex is taken from the regex cache, so it isn't
+ * compiled again.
+ */
+struct descriptor *
+descriptor_copy(struct descriptor *d)
+{
+	struct descriptor *copy = malloc(sizeof(struct descriptor));
+
+	if (copy == NULL)
+		err(1, "malloc");
+	*copy = *d;
+	copy->str = strdup(d->str);
+	copy->lit = d->lit != NULL ? strdup(d->lit) : NULL;
+	copy->reg = d->reg != NULL
+		? regcache_get(d->str, REGEX_FLAGS | (conf.case_insensitive * REG_ICASE))
+		: NULL;
+
+	return copy;
+}
+
 /*
  * Add node to the back of the list.
  */
@@ -189,6 +333,8 @@ list_delete(struct list **list, struct list *item)
 
 	if (prev != NULL)
 		prev->next = item->next;
+	if (item->next != NULL)
+		item->next->prev = prev;
 	if (item == *list)
 		*list = item->next;
 	free(item->n);
@@ -225,17 +371,46 @@ comm(char *comm)
 
 /*
  * Create a new block from a list of descriptors and a command.
+ *
+ * Commands that don't need the shell are split into words here, once,
+ * see direct_cmd_new.
  */
 struct block *
 new_block(struct list *d, command_t c)
 {
 	struct block *b = malloc(sizeof(struct block));
+	command_t cmd;
+	int sync;
+
 	b->d = d;
 	b->c = c;
+	b->file = NULL;
+	b->line = 0;
+	memset(&b->prof, 0, sizeof(b->prof));
+
+	cmd = block_command(b, &sync);
+	b->direct = direct_cmd_new(cmd);
+	DMSG("`%s` runs %s\n", cmd, b->direct != NULL ? "directly" : "in the shell");
 
 	return b;
 }
 
+/*
+ * Return the command of a block without the indentation and the `;' that
+ * marks synchronous commands, and set sync if it is there.
+ */
+command_t
+block_command(struct block *b, int *sync)
+{
+	command_t cmd = b->c;
+
+	while (isblank((unsigned char)*cmd))
+		cmd++;
+
+	*sync = *cmd == ';';
+	return cmd + *sync;
+}
+
 /*
  * Create a new block from the last list of descriptors
  * and the last command.
@@ -244,6 +419,8 @@ void
 block(void)
 {
 	struct block *b = new_block(last_d, last_c);
+	b->file = parse_name;
+	b->line = parse_line;
 	last_d = NULL;
 	last_c = NULL;
 	list_add(&block_list, b);
@@ -260,14 +437,104 @@ block_free(struct block *b)
 	struct list *node;
 
 	free(b->c);
+	if (b->direct != NULL)
+		direct_cmd_free(b->direct);
 	for (node = desc_list; node != NULL; node = node->next) {
 		struct descriptor *desc = node->n;
 		descriptor_free(desc);
 	}
-	free(desc_list);
+	list_free(&desc_list);
 	free(b);
 }
 
+/*
+ * Copy a block, with its descriptors, its place in the configuration and
+ * its profile.
+ */
+struct block *
+block_copy(struct block *b)
+{
+	struct list *descs = NULL, *l;
+	struct descriptor **ds;
+	struct block *copy;
+	int nr = 0;
+
+	/* list_add adds to the front, so the descriptors are added from the last */
+	for (l = b->d; l != NULL; l = l->next)
+		nr++;
+	ds = malloc((nr + 1) * sizeof(struct descriptor *));
+	if (ds == NULL)
+		err(1, "malloc");
+	for (l = b->d, nr = 0; l != NULL; l = l->next)
+		ds[nr++] = l->n;
+	while (nr > 0)
+		list_add(&descs, descriptor_copy(ds[--nr]));
+	free(ds);
+
+	copy = new_block(descs, strdup(b->c));
+	copy->file = b->file;
+	copy->line = b->line;
+	copy->prof = b->prof;
+
+	return copy;
+}
+
+/*
+ * Add copies of the blocks of list l, but skip, to the front of *to,
+ * keeping their order.
+ */
+void
+copy_blocks(struct list **to, struct list *l, struct block *skip)
+{
+	struct block **bs;
+	struct list *n;
+	int nr = 0;
+
+	for (n = l; n != NULL; n = n->next)
+		nr++;
+	bs = malloc((nr + 1) * sizeof(struct block *));
+	if (bs == NULL)
+		err(1, "malloc");
+	for (n = l, nr = 0; n != NULL; n = n->next)
+		bs[nr++] = n->n;
+	while (nr > 0) {
+		if (bs[--nr] != skip)
+			list_add(to, block_copy(bs[nr]));
+	}
+	free(bs);
+}
+
+/*
+ * Give rs copies of the file stamps of from, so that the next reload still
+ * reuses the blocks of the files that didn't change. The stamp of the file
+ * `changed`, if not NULL, is left without text, as its blocks aren't the
+ * ones read from it anymore.
+ */
+void
+copy_stamps(struct ruleset *rs, struct ruleset *from, const char *changed)
+{
+	struct file_stamp *s;
+	int i;
+
+	rs->files = malloc((from->nr_files + 1) * sizeof(struct file_stamp));
+	if (rs->files == NULL)
+		err(1, "malloc");
+	rs->nr_files = from->nr_files;
+
+	for (i = 0; i < from->nr_files; i++) {
+		s = &rs->files[i];
+		*s = from->files[i];
+		if (s->text == NULL || s->path == changed) {
+			s->text = NULL;
+			continue;
+		}
+		s->text = malloc(s->len + 1);
+		if (s->text == NULL)
+			err(1, "malloc");
+		memcpy(s->text, from->files[i].text, s->len);
+	}
+}
+
 /*
  * Return empty win_props structure.
  */
@@ -295,6 +562,25 @@ free_win_props(struct win_props *p)
 	free(p);
 }
 
+/*
+ * Copy win_props, with their strings.
+ */
+struct win_props *
+copy_win_props(struct win_props *p)
+{
+	struct win_props *c = new_win_props();
+
+#define COPY(f) c->f = p->f != NULL ? strdup(p->f) : NULL
+	COPY(class);
+	COPY(instance);
+	COPY(type);
+	COPY(name);
+	COPY(role);
+#undef COPY
+
+	return c;
+}
+
 /*
  * For debugging. Print window properties.
  */
@@ -342,14 +628,29 @@ get_atom(const char *name)
 
 /*
  * Populate the list of allowed atoms.
+ *
+ * All the atoms are requested at once and the replies are collected
+ * afterwards, so this costs only one round trip.
  */
 void
 populate_allowed_atoms(void)
 {
+	xcb_intern_atom_cookie_t cookies[NR_ATOMS];
+	xcb_intern_atom_reply_t *r;
 	int i;
 
+	for (i = 0; i < NR_ATOMS; i++)
+		cookies[i] = xcb_intern_atom(conn, 0, strlen(atom_names[i]), atom_names[i]);
+
 	for (i = 0; i < NR_ATOMS; i++) {
-		allowed_atoms[i] = get_atom(atom_names[i]);
+		r = xcb_intern_atom_reply(conn, cookies[i], NULL);
+		if (!r) {
+			warnx("couldn't get atom '%s'\n", atom_names[i]);
+			allowed_atoms[i] = XCB_ATOM_STRING;
+		} else {
+			allowed_atoms[i] = r->atom;
+			free(r);
+		}
 	}
 }
 
@@ -403,15 +704,13 @@ window_type_to_string(xcb_ewmh_get_atoms_reply_t *reply)
 }
 
 /*
- * Get string property of window by atom.
+ * Request string property of window by atom.
+ *
+ * The reply is fetched later with get_string_prop_reply.
  */
-char *
-get_string_prop(xcb_window_t win, xcb_atom_t prop, int utf8)
+xcb_get_property_cookie_t
+get_string_prop_cookie(xcb_window_t win, xcb_atom_t prop, int utf8)
 {
-	char *p, *value;
-	int len = 0;
-	xcb_get_property_cookie_t c;
-	xcb_get_property_reply_t *r = NULL;
 	xcb_atom_t type;
 
 	if (utf8)
@@ -419,13 +718,25 @@ get_string_prop(xcb_window_t win, xcb_atom_t prop, int utf8)
 	else
 		type = XCB_ATOM_STRING;
 
-	c = xcb_get_property(conn, 0, win,
+	return xcb_get_property(conn, 0, win,
 			prop, type, 0L, 4294967295L);
+}
+
+/*
+ * Get the string from a property request made with get_string_prop_cookie.
+ */
+char *
+get_string_prop_reply(xcb_get_property_cookie_t c)
+{
+	char *p, *value;
+	int len = 0;
+	xcb_get_property_reply_t *r = NULL;
+
 	r = xcb_get_property_reply(conn, c, NULL);
 
 	if (r == NULL || xcb_get_property_value_length(r) == 0) {
 		p = strdup("");
-		DMSG("unable to get window property for 0x%08x\n", win);
+		DMSG("unable to get window property\n");
 	} else {
 		len = xcb_get_property_value_length(r);
 		p = malloc((len + 1) * sizeof(char));
@@ -439,54 +750,187 @@ get_string_prop(xcb_window_t win, xcb_atom_t prop, int utf8)
 }
 
 /*
- * Fill win_props structure.
+ * Get string property of window by atom.
  */
-struct win_props *
-get_props(xcb_window_t win)
+char *
+get_string_prop(xcb_window_t win, xcb_atom_t prop, int utf8)
+{
+	return get_string_prop_reply(get_string_prop_cookie(win, prop, utf8));
+}
+
+/*
+ * Send the requests for the properties of a window selected by `mask`
+ * (a combination of PROP_* flags).
+ *
+ * No reply is waited for, so the requests for many windows can be
+ * sent before collecting any of them with collect_props.
+ */
+void
+request_props(xcb_window_t win, int mask, struct props_cookie *c)
+{
+	c->win = win;
+	c->mask = mask;
+	if (trace.mode == TRACE_REPLAY)
+		return;
+	if (mask & PROP_CLASS)
+		c->class = xcb_icccm_get_wm_class(conn, win);
+	if (mask & PROP_TYPE)
+		c->type = xcb_ewmh_get_wm_window_type(ewmh, win);
+	if (mask & PROP_NAME) {
+		c->net_name = get_string_prop_cookie(win, ewmh->_NET_WM_NAME, 1);
+		c->name = get_string_prop_cookie(win, allowed_atoms[ATOM_WM_NAME], 0);
+	}
+	if (mask & PROP_ROLE)
+		c->role = get_string_prop_cookie(win, allowed_atoms[ATOM_WM_ROLE], 0);
+}
+
+/*
+ * Fill the fields of a win_props structure from the replies of request_props.
+ *
+ * Only the requested properties are replaced.
+ */
+void
+collect_props(struct props_cookie *c, struct win_props *p)
 {
-	struct win_props *p = new_win_props();
 	int status;
-	xcb_get_property_cookie_t c_class, c_type;
-	xcb_icccm_get_wm_class_reply_t *r_class;
-	xcb_ewmh_get_atoms_reply_t *r_type;
+	xcb_icccm_get_wm_class_reply_t r_class;
+	xcb_ewmh_get_atoms_reply_t r_type;
+
+	if (trace.mode == TRACE_REPLAY) {
+		trace_read_props(&trace, c->win, c->mask, p);
+		return;
+	}
 
 	/* WM_CLASS */
-	c_class = xcb_icccm_get_wm_class(conn, win);
-	r_class = malloc(sizeof(xcb_icccm_get_wm_class_reply_t));
-	status = xcb_icccm_get_wm_class_reply(conn, c_class, r_class, NULL);
-	if (status == 1) {
-		p->class = strdup(r_class->class_name);
-		p->instance = strdup(r_class->instance_name);
-	} else {
-		p->class = strdup("");
-		p->instance = strdup("");
+	if (c->mask & PROP_CLASS) {
+		free(p->class);
+		free(p->instance);
+		status = xcb_icccm_get_wm_class_reply(conn, c->class, &r_class, NULL);
+		if (status == 1) {
+			p->class = strdup(r_class.class_name);
+			p->instance = strdup(r_class.instance_name);
+			xcb_icccm_get_wm_class_reply_wipe(&r_class);
+		} else {
+			p->class = strdup("");
+			p->instance = strdup("");
+		}
 	}
-	free(r_class);
 
 	/* _NET_WM_WINDOW_TYPE */
-	c_type = xcb_ewmh_get_wm_window_type(ewmh, win);
-	r_type = malloc(sizeof(xcb_ewmh_get_atoms_reply_t));
-	status = xcb_ewmh_get_wm_window_type_reply(ewmh, c_type, r_type, NULL);
-	if (status == 1) {
-		p->type = window_type_to_string(r_type);
-	} else {
-		p->type = strdup("");
+	if (c->mask & PROP_TYPE) {
+		free(p->type);
+		status = xcb_ewmh_get_wm_window_type_reply(ewmh, c->type, &r_type, NULL);
+		if (status == 1) {
+			p->type = window_type_to_string(&r_type);
+			xcb_ewmh_get_atoms_reply_wipe(&r_type);
+		} else {
+			p->type = strdup("");
+		}
 	}
-	free(r_type);
 
-	/* WM_NAME */
-	p->name = get_string_prop(win, ewmh->_NET_WM_NAME, 1);
-	if (p->name[0] == '\0') {
+	/* _NET_WM_NAME, with WM_NAME as a fallback */
+	if (c->mask & PROP_NAME) {
 		free(p->name);
-		p->name = get_string_prop(win, allowed_atoms[ATOM_WM_NAME], 0);
+		p->name = get_string_prop_reply(c->net_name);
+		if (p->name[0] == '\0') {
+			free(p->name);
+			p->name = get_string_prop_reply(c->name);
+		} else {
+			xcb_discard_reply(conn, c->name.sequence);
+		}
 	}
 
 	/* WM_WINDOW_ROLE */
-	p->role = get_string_prop(win, get_atom("WM_WINDOW_ROLE"), 0);
+	if (c->mask & PROP_ROLE) {
+		free(p->role);
+		p->role = get_string_prop_reply(c->role);
+	}
+
+	if (trace.mode == TRACE_RECORD)
+		trace_props(&trace, c->win, c->mask, p);
+}
+
+/*
+ * Fill win_props structure.
+ */
+struct win_props *
+get_props(xcb_window_t win)
+{
+	struct props_cookie c;
+	struct win_props *p = new_win_props();
+
+	request_props(win, PROP_ALL, &c);
+	collect_props(&c, p);
 
 	return p;
 }
 
+/*
+ * Find the cached properties of a window.
+ *
+ * Returns NULL if the window isn't in the cache.
+ */
+struct win_props *
+props_cache_get(xcb_window_t win)
+{
+	return winmap_get(&props_cache, win);
+}
+
+/*
+ * Add the properties of a window to the cache.
+ */
+void
+props_cache_put(xcb_window_t win, struct win_props *p)
+{
+	winmap_put(&props_cache, win, p);
+}
+
+/*
+ * Remove a window from the cache and free its properties.
+ */
+void
+props_cache_drop(xcb_window_t win)
+{
+	void *p;
+
+	if (winmap_del(&props_cache, win, &p)) {
+		free_win_props(p);
+		DMSG("dropped cached properties of 0x%08x\n", win);
+	}
+}
+
+/*
+ * Return the property of a window selected by a criterion.
+ */
+char *
+prop_value(struct win_props *p, enum criterion c)
+{
+	switch (c) {
+		case CRIT_CLASS: return p->class;
+		case CRIT_INSTANCE: return p->instance;
+		case CRIT_TYPE: return p->type;
+		case CRIT_NAME: return p->name;
+		case CRIT_ROLE: return p->role;
+		default: warnx("this is a bug, report it ASAP. (%s: line %d)", __FILE__, __LINE__); return "";
+	}
+}
+
+/*
+ * Returns 1 if a property value matches a descriptor. Literal descriptors
+ * are searched for without regexec.
+ */
+int
+descriptor_match(struct descriptor *d, const char *value)
+{
+	/* a regex that didn't compile never matches */
+	if (d->reg == NULL)
+		return 0;
+	if (d->lit != NULL)
+		return lit_match(value, d->lit, d->lit_len, d->lit_anchor, conf.case_insensitive);
+
+	return regexec(d->reg, value, 0, NULL, 0) == 0;
+}
+
 /*
  * Match window props with descriptor_list.
  *
@@ -505,207 +949,1403 @@ match_props(struct win_props *p, struct list *l)
 	matched = 0;
 	do {
 		struct descriptor *d = node->n;
-		switch (d->criterion) {
-			case CRIT_CLASS: to_match = p->class; break;
-			case CRIT_INSTANCE: to_match = p->instance; break;
-			case CRIT_TYPE: to_match = p->type; break;
-			case CRIT_NAME: to_match = p->name; break;
-			case CRIT_ROLE: to_match = p->role; break;
-			default: warnx("this is a bug, report it ASAP. (%s: line %d)", __FILE__, __LINE__); to_match = "";
-		}
-
-		/* avoid crash if regex failed to compile */
-		if (d->reg != NULL)
-			status = regexec(d->reg, to_match, 0, NULL, 0);
-		else
-			status = 1;
+		to_match = prop_value(p, d->criterion);
+
+		status = !descriptor_match(d, to_match);
 		DMSG("match \"%s\" (%s): %d\n", to_match, criterion_to_string(d->criterion), status);
 		matched += (status == 0) * 1;
 
 		node = node->next;
 	} while (node != NULL && status == 0);
 
-	return (node == NULL) * matched;
+	/* all the descriptors have to match, including the last one */
+	return (node == NULL && status == 0) * matched;
 }
 
 /*
- * Find matching blocks for a window and put them in the `blocks` list.
+ * Start a program with posix_spawn, which doesn't copy the address space
+ * of ruler like fork does.
+ *
+ * The program runs in its own session (or process group, where
+ * POSIX_SPAWN_SETSID is not available), with the default handlers for
+ * SIGCHLD and SIGPIPE, no blocked signals, with the file actions in
+ * `actions` and the environment envp.
+ *
+ * Returns the pid of the program, or -1 if it couldn't be started.
  */
-void
-find_matching_blocks(struct win_props *p, struct list *l, struct list **blocks)
+pid_t
+spawn_argv(char **argv, posix_spawn_file_actions_t *actions, char **envp)
 {
-	struct list *node;
-	int m;
+	posix_spawnattr_t attr;
+	sigset_t sigdef, sigmask;
+	short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+	pid_t pid;
+	int status;
 
-	if (*blocks != NULL)
-		list_free(blocks);
+#ifdef POSIX_SPAWN_SETSID
+	flags |= POSIX_SPAWN_SETSID;
+#else
+	flags |= POSIX_SPAWN_SETPGROUP;
+#endif
 
-	for (node = l; node != NULL; node = node->next) {
-		struct block *b = node->n;
-		struct list *desc_list = b->d;
-		DMSG("trying new block\n");
-		m = match_props(p, desc_list);
-		if (m > 0) {
-			list_add(blocks, b);
-		}
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, flags);
+	posix_spawnattr_setpgroup(&attr, 0);
+	sigemptyset(&sigdef);
+	sigaddset(&sigdef, SIGCHLD);
+	sigaddset(&sigdef, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigdef);
+	/* the signals blocked for the event loop */
+	sigemptyset(&sigmask);
+	posix_spawnattr_setsigmask(&attr, &sigmask);
+
+	status = posix_spawnp(&pid, argv[0], actions, &attr, argv, envp);
+
+	posix_spawnattr_destroy(&attr);
+
+	if (status != 0) {
+		warnx("couldn't execute %s: %s", argv[0], strerror(status));
+		return -1;
 	}
+
+	return pid;
 }
 
 /*
- * Execute program with arguments.
- *
- * cmd is an array of strings representing the
- * executable and the arguments. The last element
- * of cmd must be NULL.
+ * Start the shell with the command as its `-c` argument, stdin from
+ * /dev/null and the environment envp.
  *
- * This function should be called in a separate process,
- * otherwise the execution of the caller process ends.
- *
- * See execvp(3).
+ * Returns the pid of the shell, or -1 if it couldn't be started.
  */
-void
-execute(char **cmd)
+pid_t
+spawn(char *shell, command_t cmd, char **envp)
 {
-	setsid();
-	execvp(cmd[0], cmd);
-	err(1, "command execution failed");
+	posix_spawn_file_actions_t actions;
+	char *argv[] = { shell, "-c", cmd, NULL };
+	pid_t pid;
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	pid = spawn_argv(argv, &actions, envp);
+	posix_spawn_file_actions_destroy(&actions);
+
+	return pid;
 }
 
 /*
- * Pipe command to shell.
+ * Run command in the given shell, with the environment envp made by
+ * window_env.
  *
- * Creates two subprocesses.
- * The first prints to stdout the command.
- * The second is the shell that interprets the command.
+ * With -w, the command is handed to a shell of the worker pool. If none of
+ * them can take it, a new shell is started for it.
  */
-void
-spawn(char *shell, command_t cmd)
+void run_command(char *shell, command_t cmd, int sync, char **envp)
 {
-	int desc[2];
-	if (pipe(desc) == -1) {
-		warnx("pipe failed");
+	long long start = now_ns();
+	pid_t pid;
+
+	DMSG("will execute: `%s`\n", cmd);
+
+	if (conf.workers > 0 && pool_run(&pool, cmd, env_wid(envp), sync) == 0) {
+		__atomic_add_fetch(&stats.pool_jobs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats.commands_started, 1, __ATOMIC_RELAXED);
 		return;
 	}
 
-	if (fork() == 0) {
-		close(STDOUT_FILENO);
-		dup(desc[1]);
-		close(desc[0]);
-		close(desc[1]);
+	__atomic_add_fetch(&stats.spawns, 1, __ATOMIC_RELAXED);
+	pid = spawn(shell, cmd, envp);
+	count_start(pid, start);
+	if (pid != -1 && sync)
+		waitpid(pid, NULL, 0);
+}
 
-		fputs(cmd, stdout);
-		exit(0);
+/*
+ * Count a command that was started at start, in ns, as pid.
+ */
+void
+count_start(pid_t pid, long long start)
+{
+	if (pid == -1) {
+		__atomic_add_fetch(&stats.commands_failed, 1, __ATOMIC_RELAXED);
+		return;
 	}
+	__atomic_add_fetch(&stats.commands_started, 1, __ATOMIC_RELAXED);
+	hist_add(&stats.start, now_ns() - start);
+}
 
-	if (fork() == 0) {
-		close(STDIN_FILENO);
-		dup(desc[0]);
-		close(desc[1]);
-		close(desc[0]);
+/*
+ * Run a command that doesn't need the shell, with the window id and the
+ * environment envp made by window_env.
+ */
+void
+run_direct(struct direct_cmd *dc, int sync, char **envp)
+{
+	long long start = now_ns();
+	pid_t pid;
 
-		char *toexec[] = { shell, NULL };
-		execute(toexec);
-	}
+	DMSG("will execute directly: `%s`\n", dc->argv[0]);
 
-	close(desc[0]);
-	close(desc[1]);
-	wait(NULL);
-	wait(NULL);
+	__atomic_add_fetch(&stats.direct_spawns, 1, __ATOMIC_RELAXED);
+	pid = direct_cmd_spawn(dc, env_wid(envp), envp);
+	count_start(pid, start);
+	if (pid != -1 && sync)
+		waitpid(pid, NULL, 0);
 }
 
 /*
- * Run command in the given shell.
+ * Run the commands of blocks, one after the other.
+ *
+ * More than one command is joined into a script for one shell, where each
+ * command runs in the background in its own subshell, like it would with
+ * a shell of its own.
  */
-void run_command(char *shell, command_t cmd, int sync)
+void
+run_joined(struct block **blocks, int nr, char **envp)
 {
-	DMSG("will execute: `%s`\n", cmd);
+	char *script, *quoted, *cmd;
+	size_t len, size;
+	int i, sync;
+
+	if (nr == 1) {
+		cmd = block_command(blocks[0], &sync);
+		if (blocks[0]->direct != NULL)
+			run_direct(blocks[0]->direct, 0, envp);
+		else
+			run_command(conf.shell, cmd, 0, envp);
+		return;
+	}
 
-	if (sync) {
-		spawn(shell, cmd);
-	} else {
-		if (fork() == 0) {
-			if (conn != NULL)
-				close(xcb_get_file_descriptor(conn));
-			spawn(shell, cmd);
-			exit(0);
+	len = 0;
+	size = 256;
+	script = malloc(size);
+	if (script == NULL)
+		err(1, "malloc");
+
+	for (i = 0; i < nr; i++) {
+		quoted = shell_quote(block_command(blocks[i], &sync));
+		while (len + strlen(quoted) + sizeof("( eval  ) &\n") > size) {
+			size *= 2;
+			script = realloc(script, size);
+			if (script == NULL)
+				err(1, "realloc");
 		}
+		len += sprintf(script + len, "( eval %s ) &\n", quoted);
+		free(quoted);
 	}
+
+	__atomic_add_fetch(&stats.coalesced, nr - 1, __ATOMIC_RELAXED);
+	run_command(conf.shell, script, 0, envp);
+	free(script);
 }
 
 /*
- * Find matching block for a window and execute the command.
+ * Execute the commands of the matching blocks of a ruleset for win,
+ * in order.
+ *
+ * With -c, the asynchronous commands that need the shell are run together
+ * by run_joined, once the next synchronous command or the last one is
+ * reached. Commands that don't need the shell are started on their own
+ * right away, since joining them would start a shell they don't need.
+ * Synchronous commands are still run on their own, after the commands
+ * before them were started.
+ *
+ * since is the time of the event that the window was handled for, in µs.
  */
 void
-execute_matching_block(struct win_props *props, struct list *blocks)
+execute_blocks(struct ruleset *rs, int *matches, int nr_matching, long long since,
+		xcb_window_t win)
 {
-	struct list *matching_blocks = NULL, *node;
-	struct block *b;
-	char chr;
-	int i, skip, sync;
-
-	find_matching_blocks(props, blocks, &matching_blocks);
-	if (matching_blocks != NULL) {
-		for (node = matching_blocks; node != NULL; node = node->next) {
-			b = node->n;
-			i = 0;
-			while ((chr = b->c[i]) != '\0' && isblank(chr))
-				i++;
-
-			if (chr == '\0') {
-				warnx("either the supplied file is strange "
-						"or this is a bug and you should report it ASAP "
-						"(%s: line %d", __FILE__, __LINE__);
-				return;
-			}
+	struct block *b, **joined;
+	command_t cmd;
+	char **envp;
+	int j, nr_joined, sync;
 
-			sync = 0;
-			skip = i;
-			if (chr == ';') {
-				sync = 1;
-				skip++;
-			}
-			run_command(conf.shell, b->c + skip, sync);
+	if (nr_matching == 0)
+		return;
+	count_latency(since);
+	envp = window_env(win);
+
+	joined = malloc((nr_matching + 1) * sizeof(struct block *));
+	nr_joined = 0;
+	for (j = 0; j < nr_matching; j++) {
+		b = rs->blocks[matches[j]];
+		cmd = block_command(b, &sync);
+
+		if (*cmd == '\0') {
+			warnx("either the supplied file is strange "
+					"or this is a bug and you should report it ASAP "
+					"(%s: line %d", __FILE__, __LINE__);
+			break;
+		}
+
+		if (conf.profile) {
+			profile_run(rs, b, cmd, sync, envp);
+			continue;
+		}
+
+		if (conf.coalesce && !sync && b->direct == NULL) {
+			joined[nr_joined++] = b;
+			continue;
+		}
+
+		if (nr_joined > 0) {
+			run_joined(joined, nr_joined, envp);
+			nr_joined = 0;
 		}
-		list_free(&matching_blocks);
+
+		if (b->direct != NULL)
+			run_direct(b->direct, sync, envp);
+		else
+			run_command(conf.shell, cmd, sync, envp);
 	}
+	if (nr_joined > 0)
+		run_joined(joined, nr_joined, envp);
+	free(joined);
+	free(envp);
+}
+
+/*
+ * Find matching block for a window and execute the command.
+ */
+void
+execute_matching_block(struct win_props *props, struct ruleset *rs, long long since,
+		xcb_window_t win)
+{
+	int *matching_blocks;
+	int nr_matching;
+	long long start;
+
+	matching_blocks = malloc((rs->nr_blocks + 1) * sizeof(int));
+	start = now_ns();
+	if (conf.profile)
+		nr_matching = profile_match(rs, props, matching_blocks);
+	else
+		nr_matching = ruleset_match(rs, props, matching_blocks);
+	hist_add(&stats.match, now_ns() - start);
+	execute_blocks(rs, matching_blocks, nr_matching, since, win);
+	free(matching_blocks);
 }
 
 /*
  * Register events on existing windows.
+ *
+ * The attributes of all the windows are requested before waiting for
+ * any reply, so that there is one round trip for the whole tree instead
+ * of one per window. With -a, the rules are applied on the windows that
+ * are mapped, like on a batch of MapNotify events.
  */
 void
 register_events(void)
 {
 	xcb_window_t *windows;
-	int len, i;
+	xcb_get_window_attributes_cookie_t *cookies;
+	xcb_get_window_attributes_reply_t *r;
+	struct batch_entry *entries;
+	int len, nr_wins, listable, i;
 
 	len = wm_get_windows(scrn->root, &windows);
+	if (len <= 0)
+		return;
+
+	cookies = malloc(len * sizeof(xcb_get_window_attributes_cookie_t));
+	entries = malloc(len * sizeof(struct batch_entry));
+	for (i = 0; i < len; i++)
+		cookies[i] = xcb_get_window_attributes(conn, windows[i]);
+
+	nr_wins = 0;
 	for (i = 0; i < len; i++) {
-		if (wm_is_listable(windows[i], 0))
+		r = xcb_get_window_attributes_reply(conn, cookies[i], NULL);
+		if (r == NULL)
+			continue;
+
+		listable = r->map_state == XCB_MAP_STATE_VIEWABLE;
+		if (listable && !r->override_redirect)
 			wm_reg_window_event(windows[i], XCB_EVENT_MASK_PROPERTY_CHANGE);
+		if (conf.apply_existing && listable
+				&& (!r->override_redirect || conf.catch_override_redirect)) {
+			winmap_put(&win_set, windows[i], NULL);
+			entries[nr_wins].type = XCB_MAP_NOTIFY;
+			entries[nr_wins].win = windows[i];
+			entries[nr_wins].mask = PROP_ALL;
+			entries[nr_wins].check_attr = 0;
+			entries[nr_wins].since = now_us();
+			nr_wins++;
+		}
+		free(r);
+	}
+	DMSG("%d existing windows, %d to apply the rules on\n", len, nr_wins);
+
+	if (nr_wins > 0) {
+		if (trace.mode == TRACE_RECORD)
+			trace_entries(&trace, TRACE_SCAN, entries, nr_wins, entries[0].since);
+		apply_rules(entries, nr_wins);
 	}
+
+	free(entries);
+	free(cookies);
 	free(windows);
 }
 
-void
-set_environ(xcb_window_t win)
+/*
+ * Make the environment of the commands run for win: the one of ruler, with
+ * the window id in ENV_VARIABLE. The environment of ruler isn't changed,
+ * so commands can be started from more than one thread.
+ *
+ * The variable of the window id comes first. Returns an array to be freed,
+ * which points into environ for the other variables.
+ */
+char **
+window_env(xcb_window_t win)
 {
-	char *wid = malloc((2 + 8 + 1) * sizeof(char));
-	sprintf(wid, "0x%08x", win);
-	setenv(ENV_VARIABLE, wid, 1);
+	size_t n, i, j, len = strlen(ENV_VARIABLE);
+	char **envp, *var;
+
+	for (n = 0; environ[n] != NULL; n++)
+		;
+	envp = malloc((n + 2) * sizeof(char *) + len + sizeof("=0x00000000"));
+	if (envp == NULL)
+		err(1, "malloc");
+
+	var = (char *)(envp + n + 2);
+	sprintf(var, "%s=0x%08x", ENV_VARIABLE, win);
+	envp[0] = var;
+	for (i = 0, j = 1; i < n; i++) {
+		if (strncmp(environ[i], ENV_VARIABLE, len) != 0 || environ[i][len] != '=')
+			envp[j++] = environ[i];
+	}
+	envp[j] = NULL;
+
+	return envp;
 }
 
 /*
- * Handle X events.
+ * Returns the window id in an environment made by window_env.
  */
-void
-handle_events(void)
+const char *
+env_wid(char **envp)
 {
-	xcb_generic_event_t *ev;
-	xcb_window_t win;
+	return envp[0] + strlen(ENV_VARIABLE) + 1;
+}
+
+/*
+ * Returns 1 if the window attributes say that the window is mapped and
+ * doesn't have override_redirect set, like wm_is_listable(win, 0).
+ */
+int
+is_listable_reply(xcb_get_window_attributes_cookie_t c)
+{
+	xcb_get_window_attributes_reply_t *r;
+	int listable = 0;
+
+	if (trace.mode == TRACE_REPLAY)
+		return trace_read_attr(&trace);
+
+	r = xcb_get_window_attributes_reply(conn, c, NULL);
+	if (r != NULL) {
+		listable = r->map_state == XCB_MAP_STATE_VIEWABLE && !r->override_redirect;
+		free(r);
+	}
+
+	if (trace.mode == TRACE_RECORD)
+		trace_attr(&trace, listable);
+	return listable;
+}
+
+/*
+ * Look at an event and fill the batch entry for it.
+ *
+ * Returns 1 if the event is interesting, 0 otherwise.
+ * If the window has to be checked for override_redirect,
+ * the attributes are requested here.
+ */
+int
+batch_add_event(xcb_generic_event_t *ev, struct batch_entry *e)
+{
+	int pos;
+
+	e->type = ev->response_type & ~0x80;
+	e->check_attr = 0;
+	e->mask = PROP_ALL;
+
+	switch (e->type) {
+		case XCB_MAP_NOTIFY:
+			stats.events_map++;
+			e->win = ((xcb_map_notify_event_t *)ev)->window;
+			break;
+		case XCB_PROPERTY_NOTIFY:
+			stats.events_property++;
+			if (!conf.exec_on_prop_change)
+				return 0;
+
+			xcb_property_notify_event_t *en = (xcb_property_notify_event_t *)ev;
+			pos = 0;
+			while (pos < NR_ATOMS && allowed_atoms[pos] != en->atom)
+				pos++;
+
+			if (pos == NR_ATOMS)
+				return 0;
+			e->win = en->window;
+			e->mask = atom_props[pos];
+			break;
+		case XCB_DESTROY_NOTIFY:
+			stats.events_destroy++;
+			e->win = ((xcb_destroy_notify_event_t *)ev)->window;
+			return 1;
+		default:
+			stats.events_other++;
+			return 0;
+	}
+
+	if (!conf.catch_override_redirect) {
+		e->attr = xcb_get_window_attributes(conn, e->win);
+		e->check_attr = 1;
+	}
+
+	return 1;
+}
+
+/*
+ * Decide if the rules have to be applied on the window of a batch entry.
+ *
+ * Entries have to be passed in the order of the events because
+ * the list of known windows is updated here.
+ */
+int
+batch_want_window(struct batch_entry *e)
+{
+	if (e->type == XCB_DESTROY_NOTIFY) {
+		if (winmap_del(&win_set, e->win, NULL))
+			DMSG("removed window 0x%08x from list\n", e->win);
+		if (conf.exec_on_prop_change)
+			props_cache_drop(e->win);
+		if (conf.debounce > 0)
+			debounce_drop(e->win);
+		return 0;
+	}
+
+	if (e->check_attr && !is_listable_reply(e->attr))
+		return 0;
+
+	if (e->type == XCB_PROPERTY_NOTIFY && conf.debounce > 0) {
+		debounce_event(e);
+		return 0;
+	}
+
+	if (e->type == XCB_MAP_NOTIFY) {
+		if (!conf.exec_on_map && !is_new_window(e->win))
+			return 0;
+		DMSG("new window created: 0x%08x\n", e->win);
+
+		/* we need to get notified for further property changes */
+		if (conf.exec_on_prop_change && trace.mode != TRACE_REPLAY)
+			wm_reg_window_event(e->win, XCB_EVENT_MASK_PROPERTY_CHANGE);
+	}
+
+	return 1;
+}
+
+/*
+ * Milliseconds on the monotonic clock.
+ */
+long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Microseconds on the monotonic clock.
+ */
+long long
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Nanoseconds on the monotonic clock.
+ */
+long long
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Count nr windows the rules are applied on, for the rate printed by -S.
+ */
+void
+count_window(int nr)
+{
+	long long sec = now_ms() / 1000;
+
+	stats.windows += nr;
+	if (sec != rate_sec) {
+		rate_sec = sec;
+		rate_windows = 0;
+	}
+	rate_windows += nr;
+	if (rate_windows > stats.windows_peak)
+		stats.windows_peak = rate_windows;
+}
+
+/*
+ * Count the time from the event of a window to the start of its commands.
+ *
+ * With -t, this is called only by the executor thread.
+ */
+void
+count_latency(long long since)
+{
+	unsigned long long us = now_us() - since;
+
+	__atomic_add_fetch(&stats.latency_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.latency_total, us, __ATOMIC_RELAXED);
+	if (us > __atomic_load_n(&stats.latency_max, __ATOMIC_RELAXED))
+		__atomic_store_n(&stats.latency_max, us, __ATOMIC_RELAXED);
+}
+
+/*
+ * Hold back a property change until the window is quiet for the debounce
+ * period, merging it with the changes that are already held back.
+ *
+ * A window that never gets quiet is handled anyway after DEBOUNCE_MAX_WAIT
+ * periods, so that a title that changes all the time isn't ignored.
+ */
+void
+debounce_event(struct batch_entry *e)
+{
+	struct debounce *d;
+	long long now = now_ms();
+
+	d = winmap_get(&debounced, e->win);
+	if (d == NULL) {
+		d = malloc(sizeof(struct debounce));
+		if (d == NULL)
+			err(1, "malloc");
+		d->mask = 0;
+		d->first = now;
+		winmap_put(&debounced, e->win, d);
+	} else {
+		stats.events_coalesced++;
+	}
+
+	d->mask |= e->mask;
+	d->deadline = now + conf.debounce;
+	if (d->deadline > d->first + DEBOUNCE_MAX_WAIT * conf.debounce)
+		d->deadline = d->first + DEBOUNCE_MAX_WAIT * conf.debounce;
+}
+
+/*
+ * Take the held back changes of a window out, into a batch entry.
+ *
+ * Returns 0 if there are none.
+ */
+int
+debounce_take(xcb_window_t win, struct batch_entry *e)
+{
+	struct debounce *d;
+
+	if (!winmap_del(&debounced, win, (void **)&d))
+		return 0;
+
+	e->type = XCB_PROPERTY_NOTIFY;
+	e->win = win;
+	e->mask = d->mask;
+	e->check_attr = 0;
+	e->since = d->first * 1000;
+	free(d);
+
+	return 1;
+}
+
+/*
+ * Forget the held back changes of a window.
+ */
+void
+debounce_drop(xcb_window_t win)
+{
+	struct debounce *d;
+
+	if (winmap_del(&debounced, win, (void **)&d)) {
+		free(d);
+		stats.events_dropped++;
+	}
+}
+
+/*
+ * Compute in how many ms the next held back change is due.
+ *
+ * Returns -1 if there are no held back changes.
+ */
+long long
+debounce_next(void)
+{
+	struct debounce *d;
+	long long next = -1, now;
+	size_t i;
+
+	if (debounced.count == 0)
+		return -1;
+
+	for (i = 0; i < debounced.size; i++) {
+		d = debounced.vals[i];
+		if (debounced.keys[i] != XCB_NONE && (next == -1 || d->deadline < next))
+			next = d->deadline;
+	}
+
+	now = now_ms();
+	return next > now ? next - now : 0;
+}
+
+/*
+ * Apply the rules on the windows whose held back changes are due,
+ * with their properties as they are now.
+ */
+void
+debounce_flush(void)
+{
+	struct batch_entry *entries;
+	struct debounce *d;
+	long long now;
+	size_t i;
+	int nr = 0, j;
+
+	if (debounced.count == 0)
+		return;
+
+	now = now_ms();
+	entries = malloc(debounced.count * sizeof(struct batch_entry));
+	if (entries == NULL)
+		err(1, "malloc");
+
+	for (i = 0; i < debounced.size; i++) {
+		d = debounced.vals[i];
+		if (debounced.keys[i] == XCB_NONE || d->deadline > now)
+			continue;
+		entries[nr++].win = debounced.keys[i];
+	}
+
+	/* the table can't be changed while walking it */
+	for (j = 0; j < nr; j++)
+		debounce_take(entries[j].win, &entries[j]);
+
+	if (nr > 0 && trace.mode == TRACE_RECORD)
+		trace_entries(&trace, state_pause ? TRACE_DROP : TRACE_FLUSH,
+				entries, nr, now_us());
+	if (nr > 0 && state_pause == 0) {
+		DMSG("%d debounced windows\n", nr);
+		apply_rules(entries, nr);
+	}
+	free(entries);
+}
+
+/*
+ * Match a window against the blocks one by one, with descriptor_match,
+ * counting the matches and the time of every descriptor. Used instead of
+ * ruleset_match with -P, it gives the same result.
+ *
+ * Like match_props, the descriptors of a block are matched in order
+ * until one doesn't match.
+ */
+int
+profile_match(struct ruleset *rs, struct win_props *p, int *matches)
+{
+	struct descriptor *d;
+	struct block *b;
+	struct list *l;
+	long long start, ns;
+	int i, nr = 0, status;
+
+	for (i = 0; i < rs->nr_blocks; i++) {
+		b = rs->blocks[i];
+		b->prof.evals++;
+		status = 0;
+		for (l = b->d; l != NULL && status == 0; l = l->next) {
+			d = l->n;
+			d->evals++;
+			start = now_ns();
+			status = !descriptor_match(d, prop_value(p, d->criterion));
+			ns = now_ns() - start;
+			d->match_ns += ns;
+			b->prof.match_ns += ns;
+			if (status == 0)
+				d->matches++;
+		}
+		if (status == 0) {
+			b->prof.matches++;
+			matches[nr++] = i;
+		}
+	}
+
+	return nr;
+}
+
+/*
+ * Count a command of b that finished, started at start in ns. Its CPU
+ * time is the difference of the usage of the children around waiting
+ * for it.
+ */
+void
+profile_finished(struct block *b, long long start, struct rusage *before,
+		struct rusage *after)
+{
+	b->prof.finished++;
+	b->prof.wall_ns += now_ns() - start;
+	b->prof.user_us += (after->ru_utime.tv_sec - before->ru_utime.tv_sec) * 1000000LL
+		+ after->ru_utime.tv_usec - before->ru_utime.tv_usec;
+	b->prof.sys_us += (after->ru_stime.tv_sec - before->ru_stime.tv_sec) * 1000000LL
+		+ after->ru_stime.tv_usec - before->ru_stime.tv_usec;
+}
+
+/*
+ * Run the command of b with -P, in a process of its own, so that it can
+ * be timed. Asynchronous commands are counted by profile_reap when they
+ * finish, keeping a reference to the ruleset of the block until then.
+ */
+void
+profile_run(struct ruleset *rs, struct block *b, command_t cmd, int sync, char **envp)
+{
+	struct rusage before, after;
+	struct child *c;
+	long long start = now_ns();
+	pid_t pid;
+
+	DMSG("will execute: `%s`\n", cmd);
+
+	if (b->direct != NULL) {
+		__atomic_add_fetch(&stats.direct_spawns, 1, __ATOMIC_RELAXED);
+		pid = direct_cmd_spawn(b->direct, env_wid(envp), envp);
+	} else {
+		__atomic_add_fetch(&stats.spawns, 1, __ATOMIC_RELAXED);
+		pid = spawn(conf.shell, cmd, envp);
+	}
+	count_start(pid, start);
+	if (pid == -1)
+		return;
+	b->prof.commands++;
+
+	if (sync) {
+		getrusage(RUSAGE_CHILDREN, &before);
+		if (waitpid(pid, NULL, 0) == pid) {
+			getrusage(RUSAGE_CHILDREN, &after);
+			profile_finished(b, start, &before, &after);
+		}
+		return;
+	}
+
+	c = malloc(sizeof(struct child));
+	if (c == NULL)
+		err(1, "malloc");
+	c->rs = ruleset_get(rs);
+	c->b = b;
+	c->start = start;
+	winmap_put(&children, pid, c);
+}
+
+/*
+ * Wait for the commands that finished, with -P.
+ */
+void
+profile_reap(void)
+{
+	struct rusage before, after;
+	struct child *c;
+	pid_t pid;
+
+	getrusage(RUSAGE_CHILDREN, &before);
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		getrusage(RUSAGE_CHILDREN, &after);
+		if (winmap_del(&children, pid, (void **)&c)) {
+			profile_finished(c->b, c->start, &before, &after);
+			ruleset_put(c->rs);
+			free(c);
+		}
+		before = after;
+	}
+}
+
+/*
+ * Cost of a block for sorting, in ns: the time of its regexes and
+ * the CPU time of its commands.
+ */
+unsigned long long
+block_cost(struct block *b)
+{
+	return b->prof.match_ns + (b->prof.user_us + b->prof.sys_us) * 1000;
+}
+
+int
+cmp_cost(const void *a, const void *b)
+{
+	unsigned long long ca = block_cost(*(struct block **)a);
+	unsigned long long cb = block_cost(*(struct block **)b);
+
+	return (ca < cb) - (ca > cb);
+}
+
+/*
+ * Print the counters of the n most expensive blocks of the rules, and of
+ * their descriptors, most expensive first. Every block is a "rule" line,
+ * followed by a "desc" line per descriptor.
+ */
+void
+print_profile(FILE *f, int n)
+{
+	struct ruleset *rs = ruleset_get(rules);
+	struct block **blocks;
+	struct descriptor *d;
+	struct list *l;
+	char *crit;
+	int i;
+
+	blocks = malloc((rs->nr_blocks + 1) * sizeof(struct block *));
+	if (blocks == NULL)
+		err(1, "malloc");
+	memcpy(blocks, rs->blocks, rs->nr_blocks * sizeof(struct block *));
+	qsort(blocks, rs->nr_blocks, sizeof(struct block *), cmp_cost);
+
+	for (i = 0; i < rs->nr_blocks && i < n; i++) {
+		struct block_prof *bp = &blocks[i]->prof;
+
+		fprintf(f, "rule %s:%d evals %lu matches %lu match_ns %llu "
+				"commands %lu finished %lu wall_ns %llu user_us %llu sys_us %llu\n",
+				blocks[i]->file != NULL ? blocks[i]->file : "-", blocks[i]->line,
+				bp->evals, bp->matches, bp->match_ns, bp->commands,
+				bp->finished, bp->wall_ns, bp->user_us, bp->sys_us);
+		for (l = blocks[i]->d; l != NULL; l = l->next) {
+			d = l->n;
+			crit = criterion_to_string(d->criterion);
+			fprintf(f, "desc %s=\"%s\" evals %lu matches %lu match_ns %llu\n",
+					crit, d->str, d->evals, d->matches, d->match_ns);
+			free(crit);
+		}
+	}
+
+	free(blocks);
+	ruleset_put(rs);
+}
+
+/*
+ * Apply the rules on the windows of batch entries, one entry per window.
+ *
+ * The properties of all the windows are requested before waiting for
+ * any reply. With -t, the windows are then matched and their commands
+ * run by the pipeline.
+ */
+void
+apply_rules(struct batch_entry *entries, int nr_wins)
+{
+	struct ruleset *rs = ruleset_get(rules);
 	struct win_props *p;
+	long long requested;
+	int i, cached;
+
+	count_window(nr_wins);
+	/*
+	 * With exec_on_prop_change, the properties are kept between events
+	 * and only the ones that changed are requested again.
+	 */
+	for (i = 0; i < nr_wins; i++) {
+		if (conf.exec_on_prop_change && props_cache_get(entries[i].win) == NULL)
+			entries[i].mask = PROP_ALL;
+		request_props(entries[i].win, entries[i].mask, &entries[i].props);
+	}
+
+	/* do the actual work. get props, find matches, execute commands */
+	requested = now_ns();
+	for (i = 0; i < nr_wins; i++) {
+		cached = 0;
+		p = NULL;
+		if (conf.exec_on_prop_change) {
+			cached = 1;
+			p = props_cache_get(entries[i].win);
+			if (p == NULL) {
+				p = new_win_props();
+				props_cache_put(entries[i].win, p);
+			}
+		} else {
+			p = new_win_props();
+		}
+
+		collect_props(&entries[i].props, p);
+		hist_add(&stats.fetch, now_ns() - requested);
+		print_win_props(p);
+		if (conf.match_threads > 0) {
+			pipeline_submit(entries[i].win, copy_win_props(p), ruleset_get(rs),
+					entries[i].since);
+		} else {
+			execute_matching_block(p, rs, entries[i].since, entries[i].win);
+		}
+		if (!cached)
+			free_win_props(p);
+	}
+	ruleset_put(rs);
+}
+
+/*
+ * Handle the batch entries of a batch of events.
+ *
+ * The entries are handled in stages, so that the requests for all
+ * the windows are sent before waiting for any reply:
+ *  - the window list is updated and duplicate windows are dropped,
+ *    after the attributes that were requested for the entries came,
+ *    and so are the windows destroyed later in the batch
+ *  - the properties of the remaining windows are requested
+ *  - the properties are collected and the rules are applied
+ *
+ * With -d, property changes are held back by debounce_event instead.
+ */
+void
+handle_entries(struct batch_entry *entries, int nr_entries)
+{
+	struct winmap seen;
+	void *val;
+	int nr_wins, i, j;
+
+	/* windows of the batch, mapped to their entry index + 1 */
+	winmap_init(&seen);
+	nr_wins = 0;
+	for (i = 0; i < nr_entries; i++) {
+		if (!batch_want_window(&entries[i])) {
+			/*
+			 * The properties of a dead window can't be fetched, and
+			 * they would stay in the cache. Its entry is marked with
+			 * the type of the event, and a window mapped again with
+			 * the same id gets a new entry.
+			 */
+			if (entries[i].type == XCB_DESTROY_NOTIFY
+					&& winmap_del(&seen, entries[i].win, &val))
+				entries[(intptr_t)val - 1].type = XCB_DESTROY_NOTIFY;
+			continue;
+		}
+
+		j = (intptr_t)winmap_get(&seen, entries[i].win);
+		if (j == 0) {
+			entries[nr_wins++] = entries[i];
+			winmap_put(&seen, entries[i].win, (void *)(intptr_t)nr_wins);
+		} else {
+			entries[j - 1].mask |= entries[i].mask;
+			stats.events_coalesced++;
+		}
+	}
+	winmap_free(&seen);
+
+	for (i = j = 0; i < nr_wins; i++) {
+		if (entries[i].type != XCB_DESTROY_NOTIFY)
+			entries[j++] = entries[i];
+	}
+	nr_wins = j;
+	if (nr_wins > 0)
+		DMSG("batch of %d entries, %d windows\n", nr_entries, nr_wins);
+
+	apply_rules(entries, nr_wins);
+}
+
+/*
+ * Handle all the queued X events as a batch.
+ *
+ * The attributes of the windows are requested while the events are turned
+ * into batch entries, which are then handled by handle_entries.
+ *
+ * Returns the number of events read.
+ */
+int
+handle_event_batch(void)
+{
+	xcb_generic_event_t *ev;
+	xcb_generic_event_t **evs;
+	struct batch_entry *entries;
+	int nr_evs, nr_entries, i;
+	long long since;
+
+	evs = malloc(BATCH_MAX * sizeof(xcb_generic_event_t *));
+	nr_evs = 0;
+	while (nr_evs < BATCH_MAX && (ev = xcb_poll_for_event(conn)) != NULL)
+		evs[nr_evs++] = ev;
+
+	/* do work only if not paused */
+	if (nr_evs > 0 && state_pause == 0) {
+		entries = malloc(nr_evs * sizeof(struct batch_entry));
+
+		since = now_us();
+		nr_entries = 0;
+		for (i = 0; i < nr_evs; i++) {
+			entries[nr_entries].since = since;
+			nr_entries += batch_add_event(evs[i], &entries[nr_entries]);
+		}
+
+		if (trace.mode == TRACE_RECORD && nr_entries > 0)
+			trace_entries(&trace, TRACE_BATCH, entries, nr_entries, since);
+		handle_entries(entries, nr_entries);
+		free(entries);
+	}
+
+	for (i = 0; i < nr_evs; i++)
+		free(evs[i]);
+	free(evs);
+
+	return nr_evs;
+}
+
+#ifdef __linux__
+/*
+ * Watch the directories of the configuration files, so that they are
+ * reloaded when changed. Directories are watched rather than the files,
+ * because editors often replace a file instead of writing it.
+ */
+void
+watch_configs(void)
+{
+	char *dir;
+	int i;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd == -1) {
+		warn("inotify_init1");
+		return;
+	}
+
+	for (i = -1; i < no_of_configs; i++) {
+		dir = strdup(i == -1 ? config_path : configs[i]);
+		if (inotify_add_watch(inotify_fd, dirname(dir),
+					IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1)
+			DMSG("can't watch %s: %s\n", dir, strerror(errno));
+		free(dir);
+	}
+
+	loop_add_fd(&loop, inotify_fd, handle_inotify);
+}
+
+/*
+ * Check if a file that changed in a watched directory is a configuration
+ * file. Only the names are compared, which is enough to start a reload.
+ */
+static int
+is_config_name(const char *name)
+{
+	char *path;
+	int i, found = 0;
+
+	for (i = -1; i < no_of_configs && !found; i++) {
+		path = strdup(i == -1 ? config_path : configs[i]);
+		found = strcmp(basename(path), name) == 0;
+		free(path);
+	}
+
+	return found;
+}
+
+void
+handle_inotify(int fd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)p;
+			if (ev->len > 0 && is_config_name(ev->name)) {
+				DMSG("%s changed\n", ev->name);
+				state_reload = 1;
+			}
+		}
+	}
+}
+#endif
+
+/*
+ * Callbacks of the event loop.
+ */
+void
+handle_x_events(int fd)
+{
+	while (handle_event_batch() > 0)
+		;
+}
+
+void
+handle_pool(int fd)
+{
+	pool_reap(&pool);
+}
+
+void
+handle_timer(int unused)
+{
+	debounce_flush();
+}
+
+/* commands of the control socket */
+struct ctl_cmd ctl_cmds[] = {
+	{ "add", ctl_add, CTL_BODY | CTL_OWNER },
+	{ "remove", ctl_remove, CTL_OWNER },
+	{ "list", ctl_list, 0 },
+	{ "pause", ctl_pause, CTL_OWNER },
+	{ "resume", ctl_resume, CTL_OWNER },
+	{ "stats", ctl_stats, 0 },
+	{ "profile", ctl_profile, 0 },
+	{ NULL, NULL, 0 }
+};
+
+void
+handle_ctl(int fd)
+{
+	ctl_accept(&ctl);
+}
+
+void
+handle_ctl_client(int fd)
+{
+	ctl_handle(&ctl, fd);
+}
+
+/*
+ * Print the statistics, like -S does on exit.
+ */
+void
+ctl_stats(FILE *f, char *args, struct ctl_req *req)
+{
+	print_stats(f);
+}
+
+/*
+ * Print the profile of the most expensive blocks, 20 or as many as asked.
+ */
+void
+ctl_profile(FILE *f, char *args, struct ctl_req *req)
+{
+	int n = *args != '\0' ? atoi(args) : PROFILE_TOP;
+
+	if (!conf.profile) {
+		fprintf(f, "error profiling is off, see -P\n");
+		return;
+	}
+	print_profile(f, n > 0 ? n : PROFILE_TOP);
+}
+
+/*
+ * Add the blocks of the text sent after the command line to the rules,
+ * after the others. The rules are made again from copies of the blocks
+ * in use, whose regexes come from the regex cache.
+ *
+ * Each block is named "control:<n>", printed back, which can be given to
+ * remove. The blocks stay when the configuration is reloaded.
+ */
+void
+ctl_add(FILE *f, char *args, struct ctl_req *req)
+{
+	struct list *added, *l, *n;
+	struct ruleset *rs;
+	struct block **bs;
+	char *text;
+	size_t len;
+	int nr = 0;
+
+	if (reload_running) {
+		fprintf(f, "error a reload is running, try again\n");
+		return;
+	}
+
+	text = ctl_read_body(req, &len);
+	if (text == NULL) {
+		fprintf(f, "error the rule is too long\n");
+		return;
+	}
+	added = parse_text(text, len);
+	free(text);
+	if (added == NULL) {
+		fprintf(f, "error no rule could be read\n");
+		return;
+	}
+
+	/* number the blocks in order, the list starts with the last */
+	for (n = added; n != NULL; n = n->next)
+		nr++;
+	bs = malloc(nr * sizeof(struct block *));
+	if (bs == NULL)
+		err(1, "malloc");
+	for (n = added, nr = 0; n != NULL; n = n->next)
+		bs[nr++] = n->n;
+	while (nr > 0) {
+		bs[--nr]->line = ++ctl_seq;
+		fprintf(f, "added %s:%d\n", CTL_FILE, ctl_seq);
+	}
+	free(bs);
+
+	l = NULL;
+	copy_blocks(&l, rules->list, NULL);
+	copy_blocks(&l, added, NULL);
+	rs = ruleset_new(l, rules);
+	copy_stamps(rs, rules, NULL);
+	set_rules(rs);
+
+	/* added to the front of ctl_blocks, like the blocks that came after */
+	for (n = added; n->next != NULL; n = n->next)
+		;
+	n->next = ctl_blocks;
+	if (ctl_blocks != NULL)
+		ctl_blocks->prev = n;
+	ctl_blocks = added;
+}
+
+/*
+ * Remove the block named by "<file>:<line>" from the rules. A block of the
+ * configuration files comes back when they are reloaded.
+ */
+void
+ctl_remove(FILE *f, char *args, struct ctl_req *req)
+{
+	struct block *b = NULL;
+	struct ruleset *rs;
+	struct list *l, *n;
+	char *colon;
+	int i, line;
+
+	colon = strrchr(args, ':');
+	if (colon == NULL || (line = atoi(colon + 1)) <= 0) {
+		fprintf(f, "error usage: remove <file>:<line>\n");
+		return;
+	}
+	if (reload_running) {
+		fprintf(f, "error a reload is running, try again\n");
+		return;
+	}
+
+	*colon = '\0';
+	for (i = 0; i < rules->nr_blocks && b == NULL; i++) {
+		if (rules->blocks[i]->line == line && rules->blocks[i]->file != NULL
+				&& strcmp(rules->blocks[i]->file, args) == 0)
+			b = rules->blocks[i];
+	}
+	if (b == NULL) {
+		fprintf(f, "error no block at %s:%d\n", args, line);
+		return;
+	}
+
+	l = NULL;
+	copy_blocks(&l, rules->list, b);
+	rs = ruleset_new(l, rules);
+	copy_stamps(rs, rules, b->file);
+	set_rules(rs);
+
+	for (n = ctl_blocks; n != NULL; n = n->next) {
+		b = n->n;
+		if (strcmp(b->file, args) == 0 && b->line == line) {
+			n->n = NULL;
+			list_delete(&ctl_blocks, n);
+			block_free(b);
+			break;
+		}
+	}
+	fprintf(f, "removed %s:%d\n", args, line);
+}
+
+/*
+ * Print the blocks in use, in order, as "<file>:<line>" followed by the
+ * descriptors, and the command on a line of its own, with "sync" if it is
+ * synchronous. Newlines in commands are printed as "\n".
+ */
+void
+ctl_list(FILE *f, char *args, struct ctl_req *req)
+{
+	struct ruleset *rs = ruleset_get(rules);
+	struct descriptor *d;
+	struct block *b;
+	struct list *l;
+	char *crit, *cmd;
+	int i, sync;
+
+	for (i = 0; i < rs->nr_blocks; i++) {
+		b = rs->blocks[i];
+		fprintf(f, "block %s:%d", b->file != NULL ? b->file : "-", b->line);
+		/* the descriptors are in the list from the last */
+		for (l = b->d; l != NULL && l->next != NULL; l = l->next)
+			;
+		for (; l != NULL; l = l->prev) {
+			d = l->n;
+			crit = criterion_to_string(d->criterion);
+			fprintf(f, " %s=\"%s\"", crit, d->str);
+			free(crit);
+		}
+
+		cmd = block_command(b, &sync);
+		fprintf(f, "\n%s ", sync ? "sync" : "command");
+		for (; *cmd != '\0'; cmd++) {
+			if (*cmd == '\n')
+				fputs("\\n", f);
+			else
+				putc(*cmd, f);
+		}
+		putc('\n', f);
+	}
+
+	ruleset_put(rs);
+}
+
+void
+ctl_pause(FILE *f, char *args, struct ctl_req *req)
+{
+	state_pause = 1;
+	fprintf(f, "paused\n");
+}
+
+void
+ctl_resume(FILE *f, char *args, struct ctl_req *req)
+{
+	state_pause = 0;
+	fprintf(f, "resumed\n");
+}
+
+/*
+ * Add the descriptors that are waited for besides the X connection
+ * to the event loop.
+ */
+void
+add_loop_fds(void)
+{
+	/*
+	 * The completion pipe of the worker pool tells when workers are idle.
+	 * With -t, the pool is used by the executor thread, which reads it.
+	 */
+	if (conf.workers > 0 && conf.match_threads == 0)
+		loop_add_fd(&loop, pool.done, handle_pool);
+	loop_add_fd(&loop, reload_pipe[0], handle_reload);
+	if (ctl_fd != -1)
+		loop_add_fd(&loop, ctl_fd, handle_ctl);
+	if (conf.watch_configs) {
+#ifdef __linux__
+		watch_configs();
+#else
+		warnx("watching the configuration files isn't supported here");
+#endif
+	}
+}
+
+/*
+ * Handle X events.
+ *
+ * The X connection, the completion pipe of the worker pool, the signals
+ * and the debounce timer are all waited for by the event loop, see loop.h.
+ */
+void
+handle_events(void)
+{
 	int xcb_desc = xcb_get_file_descriptor(conn);
-	fd_set descs;
+
+	loop_add_fd(&loop, xcb_desc, handle_x_events);
+	add_loop_fds();
 
 	/* to receive window creation notifications */
 	wm_reg_window_event(scrn->root, XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY);
@@ -715,74 +2355,18 @@ handle_events(void)
 	state_reload = 0;
 	state_pause = 0;
 	while (state_run) {
-		FD_ZERO(&descs);
-		FD_SET(xcb_desc, &descs);
-
 		/*
-		 * We can't use xcb_wait_for_event because that means
-		 * that after receiving a signal to exit, the program will wait
-		 * for an X event and then it will exit.
-		 *
-		 * Instead, we are checking if there are events and then handle them.
-		 * select should just fail if we abort the execution of the program,
-		 * thus restarting the loop and then exiting from it because state_run
-		 * will be 0.
+		 * Events that xcb read while waiting for a reply are queued
+		 * without making the connection readable, so they are handled
+		 * before waiting.
 		 */
-		if (select(xcb_desc + 1, &descs, NULL, NULL, NULL) > 0) {
-			while((ev = xcb_poll_for_event(conn)) != NULL) {
-				win = -1;
-
-				/* do work only if not paused */
-				if (state_pause == 0) {
-					if ((ev->response_type & ~0x80) == XCB_MAP_NOTIFY) {
-						xcb_map_notify_event_t *ec = (xcb_map_notify_event_t *)ev;
-
-						if ((conf.catch_override_redirect || wm_is_listable(ec->window, 0))
-								&& (conf.exec_on_map || is_new_window(ec->window))) {
-							win = ec->window;
-							DMSG("new window created: 0x%08x\n", win);
-
-							/* we need to get notified for further property changes */
-							if (conf.exec_on_prop_change) {
-								wm_reg_window_event(ec->window, XCB_EVENT_MASK_PROPERTY_CHANGE);
-							}
-						}
-					} else if (conf.exec_on_prop_change && (ev->response_type & ~0x80) == XCB_PROPERTY_NOTIFY) {
-						xcb_property_notify_event_t *en = (xcb_property_notify_event_t *)ev;
-						int pos = 0;
-						while (pos < NR_ATOMS && allowed_atoms[pos] != en->atom)
-							pos++;
-
-						if (pos < NR_ATOMS && (conf.catch_override_redirect || wm_is_listable(en->window, 0)))
-							win = en->window;
-					} else if ((ev->response_type & ~0x80) == XCB_DESTROY_NOTIFY) {
-						xcb_destroy_notify_event_t *ed = (xcb_destroy_notify_event_t *)ev;
-						struct list *l = win_list;
-
-						win = ed->window;
-						while (l != NULL && *(xcb_window_t *)l->n != win)
-							l = l->next;
-
-						if (l != NULL) {
-							list_delete(&win_list, l);
-							DMSG("removed window 0x%08x from list\n", win);
-						}
-						win = -1;
-					}
-
-					/* do the actual work. get props, find matches, execute commands */
-					if (win != -1 && state_pause == 0) {
-						p = get_props(win);
-						print_win_props(p);
-						set_environ(win);
-						execute_matching_block(p, block_list);
-						free_win_props(p);
-					}
-				}
-
-				free(ev);
-				ev = NULL;
-			}
+		handle_x_events(xcb_desc);
+		xcb_flush(conn);
+
+		loop_set_timer(&loop, debounce_next(), handle_timer);
+		if (loop_run(&loop) == -1) {
+			warn("couldn't wait for events");
+			state_run = 0;
 		}
 
 		if (state_reload) {
@@ -794,50 +2378,137 @@ handle_events(void)
 			warnx("X server errored");
 			state_run = 0;
 		}
+	}
+}
+
+/*
+ * Handle the next record of the trace played back with -X.
+ */
+void
+handle_replay(int unused)
+{
+	struct batch_entry *entries;
+	long long time, since;
+	int kind, nr, i, j;
+
+	kind = trace_next(&trace, &time);
+	if (kind == 0)
+		return;
+	entries = trace_read_entries(&trace, &nr);
+	replay_last = time;
+
+	since = now_us();
+	for (i = 0; i < nr; i++)
+		entries[i].since = since;
 
+	switch (kind) {
+		case TRACE_BATCH:
+			handle_entries(entries, nr);
+			break;
+		case TRACE_SCAN:
+			for (i = 0; i < nr; i++)
+				winmap_put(&win_set, entries[i].win, NULL);
+			apply_rules(entries, nr);
+			break;
+		case TRACE_FLUSH:
+		case TRACE_DROP:
+			for (i = j = 0; i < nr; i++)
+				j += debounce_take(entries[i].win, &entries[j]);
+			if (kind == TRACE_FLUSH)
+				apply_rules(entries, j);
+			break;
 	}
+	free(entries);
 }
 
 /*
- * Returns 1 if the windows has been created but not destroyed.
- * 0 otherwise.
+ * Play the trace back instead of handling X events, until its end.
+ *
+ * Every record is handled when its time comes, counted from the start of
+ * the replay, or right after the one before with -f. While paused, the
+ * replay waits, and the time spent paused isn't counted.
  */
-int
-is_new_window(xcb_window_t win)
+void
+replay_events(void)
 {
-	struct list *l;
-	xcb_window_t *w;
+	long long time, delay;
+	int paused = 0;
 
-	l = win_list;
-	while (l != NULL && *(w = l->n) != win)
-		l = l->next;
+	add_loop_fds();
+
+	state_run = 1;
+	state_reload = 0;
+	state_pause = 0;
+	replay_base = now_us();
+	replay_last = 0;
+	while (state_run) {
+		if (state_pause) {
+			paused = 1;
+			delay = -1;
+		} else {
+			if (paused) {
+				replay_base = now_us() - replay_last;
+				paused = 0;
+			}
+			if (trace_next(&trace, &time) == 0)
+				break;
+			delay = conf.replay_fast ? 0 : (time - (now_us() - replay_base)) / 1000;
+			if (delay < 0)
+				delay = 0;
+		}
 
-	if (l == NULL) {
-		w = malloc(sizeof(xcb_window_t));
-		*w = win;
-		list_add(&win_list, w);
+		loop_set_timer(&loop, delay, handle_replay);
+		if (loop_run(&loop) == -1) {
+			warn("couldn't wait for events");
+			state_run = 0;
+		}
 
-		return 1;
-	} else {
-		return 0;
+		if (state_reload) {
+			reload_config();
+			state_reload = 0;
+		}
 	}
 }
 
+/*
+ * Returns 1 if the windows has been created but not destroyed.
+ * 0 otherwise.
+ */
+int
+is_new_window(xcb_window_t win)
+{
+	return winmap_put(&win_set, win, NULL);
+}
+
+/*
+ * Free the rules, after waiting for a reload that is running.
+ */
 void
 cleanup(void)
 {
-	struct list *l;
-	for (l = block_list; l != NULL; l = l->next) {
-		struct block *b = l->n;
-		block_free(b);
+	struct child *c;
+	size_t i;
+
+	if (reload_running) {
+		pthread_join(reload_thread, NULL);
+		reload_running = 0;
+		ruleset_put(reload_base);
+		ruleset_put(reload_result);
+		reload_result = NULL;
 	}
-	list_free(&block_list);
 
-	for (l = last_d; l != NULL; l = l->next) {
-		struct descriptor *d = l->n;
-		descriptor_free(d);
+	/* commands of -P that are still running */
+	for (i = 0; i < children.size; i++) {
+		if (children.keys[i] == XCB_NONE)
+			continue;
+		c = children.vals[i];
+		ruleset_put(c->rs);
+		free(c);
 	}
-	list_free(&last_d);
+	winmap_free(&children);
+
+	ruleset_put(rules);
+	rules = NULL;
 }
 
 void
@@ -848,7 +2519,70 @@ init_conf(void)
 	conf.catch_override_redirect = 0;
 	conf.exec_on_prop_change     = 0;
 	conf.exec_on_map             = 0;
+	conf.print_stats             = 0;
+	conf.workers                 = 0;
+	conf.coalesce                = 0;
+	conf.debounce                = 0;
+	conf.watch_configs           = 0;
+	conf.match_threads           = 0;
+	conf.apply_existing          = 0;
+	conf.record                  = NULL;
+	conf.replay                  = NULL;
+	conf.replay_fast             = 0;
+	conf.ctl_path                = NULL;
+	conf.profile                 = 0;
+}
+
+#define STAT(name) __atomic_load_n(&stats.name, __ATOMIC_RELAXED)
+
+/*
+ * Print the counters in `stats`, one per line.
+ *
+ * With -t and -w, other threads update some of them while they are read.
+ */
+void
+print_stats(FILE *f)
+{
+	unsigned long hits = STAT(memo_hits), misses = STAT(memo_misses);
+	unsigned long latency_count = STAT(latency_count);
+
+	fprintf(f, "memo_hits %lu\n", hits);
+	fprintf(f, "memo_misses %lu\n", misses);
+	fprintf(f, "memo_hit_rate %.3f\n", hits + misses ? (double)hits / (hits + misses) : 0.0);
+	fprintf(f, "pool_jobs %lu\n", STAT(pool_jobs));
+	fprintf(f, "spawns %lu\n", STAT(spawns));
+	fprintf(f, "direct_spawns %lu\n", STAT(direct_spawns));
+	fprintf(f, "coalesced %lu\n", STAT(coalesced));
+	fprintf(f, "events_coalesced %lu\n", STAT(events_coalesced));
+	fprintf(f, "events_dropped %lu\n", STAT(events_dropped));
+	fprintf(f, "regcache_hits %lu\n", STAT(regcache_hits));
+	fprintf(f, "regcache_misses %lu\n", STAT(regcache_misses));
+	fprintf(f, "blocks_same %lu\n", STAT(blocks_same));
+	fprintf(f, "blocks_changed %lu\n", STAT(blocks_changed));
+	fprintf(f, "files_reused %lu\n", STAT(files_reused));
+	fprintf(f, "criteria_reused %lu\n", STAT(criteria_reused));
+	fprintf(f, "direct_rules %lu\n", STAT(direct_rules));
+	fprintf(f, "shell_rules %lu\n", STAT(shell_rules));
+	fprintf(f, "windows %lu\n", STAT(windows));
+	fprintf(f, "windows_peak_per_sec %lu\n", STAT(windows_peak));
+	fprintf(f, "latency_count %lu\n", latency_count);
+	fprintf(f, "latency_avg_us %llu\n",
+			latency_count ? STAT(latency_total) / latency_count : 0);
+	fprintf(f, "latency_max_us %llu\n", STAT(latency_max));
+	fprintf(f, "events_map %lu\n", STAT(events_map));
+	fprintf(f, "events_property %lu\n", STAT(events_property));
+	fprintf(f, "events_destroy %lu\n", STAT(events_destroy));
+	fprintf(f, "events_other %lu\n", STAT(events_other));
+	fprintf(f, "windows_tracked %zu\n", win_set.count);
+	fprintf(f, "windows_cached %zu\n", props_cache.count);
+	fprintf(f, "windows_debounced %zu\n", debounced.count);
+	fprintf(f, "commands_started %lu\n", STAT(commands_started));
+	fprintf(f, "commands_failed %lu\n", STAT(commands_failed));
+	hist_print(f, "fetch_ns", &stats.fetch);
+	hist_print(f, "match_ns", &stats.match);
+	hist_print(f, "start_ns", &stats.start);
 }
+#undef STAT
 
 /*
  * Signal handler.
@@ -868,47 +2602,398 @@ handle_sig(int sig)
 		case SIGUSR2:
 			state_pause = !state_pause;
 			break;
+		case SIGCHLD:
+			profile_reap();
+			break;
+	}
+}
+
+/*
+ * Read all of f. Returns the text, or NULL if it can't be read.
+ */
+static char *
+read_text(FILE *f, size_t *len)
+{
+	char *text = NULL, *tmp;
+	size_t size = 0, n;
+
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? 2 * size : BUFSIZ;
+			tmp = realloc(text, size);
+			if (tmp == NULL) {
+				free(text);
+				return NULL;
+			}
+			text = tmp;
+		}
+		n = fread(text + *len, 1, size - *len, f);
+		*len += n;
+	} while (n > 0);
+
+	if (ferror(f)) {
+		free(text);
+		return NULL;
 	}
+
+	return text;
 }
 
 /*
+ * Parse the configuration file fp, adding its blocks to block_list.
+ *
+ * If the file is as it was when base was loaded, copies of the blocks read
+ * from it then are added instead, with their regexes from the regex cache.
+ * The text of the file is kept in stamp for the next reload.
+ *
  * Returns 0 if parsing succeeded.
  */
 int
-parse_file(char *fp)
+parse_file(char *fp, struct ruleset *base, struct file_stamp *stamp)
 {
-	yyin = fopen(fp, "r");
-	if (yyin == NULL)
+	FILE *f = fopen(fp, "r");
+	struct file_stamp *old = NULL;
+	int i, errors = config_errors;
+
+	if (f == NULL)
 		return 1;
+
+	stamp->path = fp;
+	stamp->text = read_text(f, &stamp->len);
+	stamp->reused = 0;
+	for (i = 0; base != NULL && i < base->nr_files; i++) {
+		if (base->files[i].path == fp)
+			old = &base->files[i];
+	}
+
+	if (old != NULL && old->text != NULL && stamp->text != NULL
+			&& old->len == stamp->len
+			&& memcmp(old->text, stamp->text, stamp->len) == 0) {
+		/* blocks are compared by path pointer, the same for each reload */
+		for (i = 0; i < base->nr_blocks; i++) {
+			if (base->blocks[i]->file == fp)
+				list_add(&block_list, block_copy(base->blocks[i]));
+		}
+		stamp->reused = 1;
+		fclose(f);
+		return 0;
+	}
+
+	rewind(f);
+	parse_stream(f, fp);
+	fclose(f);
+
+	if (config_errors > errors) {
+		free(stamp->text);
+		stamp->text = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse the blocks of f, adding them to block_list.
+ */
+void
+parse_stream(FILE *f, const char *name)
+{
+	yyin = f;
+	parse_name = name;
+	yylineno = 1;
 	yyparse();
-	fclose(yyin);
 	yyrestart(yyin);
+}
 
-	return 0;
+/*
+ * Take the blocks parsed so far, or free them if discard is set.
+ * A block left without a command by the end of a file is freed anyway.
+ */
+struct list *
+parse_take(int discard)
+{
+	struct list *l;
+
+	for (l = last_d; l != NULL; l = l->next)
+		descriptor_free(l->n);
+	list_free(&last_d);
+	free(last_c);
+	last_c = NULL;
+
+	if (discard) {
+		for (l = block_list; l != NULL; l = l->next)
+			block_free(l->n);
+		list_free(&block_list);
+		return NULL;
+	}
+
+	l = block_list;
+	block_list = NULL;
+	return l;
+}
+
+/*
+ * Parse the blocks of a text, like a configuration file named CTL_FILE.
+ *
+ * Returns the blocks, or NULL if there are none or the text has errors.
+ */
+struct list *
+parse_text(const char *text, size_t len)
+{
+	FILE *f;
+
+	f = tmpfile();
+	if (f == NULL) {
+		warn("tmpfile");
+		return NULL;
+	}
+	if (fwrite(text, 1, len, f) != len) {
+		fclose(f);
+		return NULL;
+	}
+	rewind(f);
+
+	config_errors = 0;
+	parse_stream(f, CTL_FILE);
+	fclose(f);
+
+	return parse_take(config_errors > 0);
+}
+
+/*
+ * Path of the default configuration file. The environment is read once,
+ * at startup, and not by the reload thread.
+ */
+char *
+default_config_path(void)
+{
+	char *xdg_home = getenv("XDG_CONFIG_HOME");
+	char *path;
+
+	if (xdg_home != NULL)
+		asprintf(&path, "%s/ruler/rulerrc", xdg_home);
+	else
+		asprintf(&path, "%s/.config/ruler/rulerrc", getenv("HOME"));
+
+	return path;
+}
+
+/*
+ * Parse the configuration files and compile their rules.
+ *
+ * At startup, a configuration file that can't be opened is fatal. When
+ * reloading, NULL is returned instead, and also if a file has errors, so
+ * that the rules in use are kept rather than replaced by part of them.
+ *
+ * The files and the criteria that are the same as in base, if not NULL,
+ * are taken from it rather than parsed and compiled again.
+ *
+ * The parser works on globals, so only one load can run at a time.
+ */
+struct ruleset *
+load_rules(int startup, struct ruleset *base)
+{
+	struct file_stamp *files;
+	struct ruleset *rs;
+	struct list *l;
+	int i, nr_files = 0, failed = 0;
+
+	files = malloc((no_of_configs + 1) * sizeof(struct file_stamp));
+	if (files == NULL)
+		err(1, "malloc");
+
+	config_errors = 0;
+	if (parse_file(config_path, base, &files[nr_files]) == 1) {
+		if (no_of_configs == 0) {
+			if (startup)
+				errx(1, "couldn't open config file '%s' (%s). No other config files supplied, exiting", config_path, strerror(errno));
+			warn("couldn't open config file '%s'", config_path);
+			failed = 1;
+		}
+	} else {
+		nr_files++;
+	}
+
+	for (i = 0; i < no_of_configs && !failed; i++) {
+		if (parse_file(configs[i], base, &files[nr_files]) != 0) {
+			if (startup)
+				err(1, "couldn't open config file '%s'", configs[i]);
+			warn("couldn't open config file '%s'", configs[i]);
+			failed = 1;
+		} else {
+			nr_files++;
+		}
+	}
+
+	if (!startup && (failed || config_errors > 0)) {
+		parse_take(1);
+		for (i = 0; i < nr_files; i++)
+			free(files[i].text);
+		free(files);
+		return NULL;
+	}
+
+	l = parse_take(0);
+
+	/* the blocks added on the control socket come after the files */
+	copy_blocks(&l, ctl_blocks, NULL);
+	rs = ruleset_new(l, base);
+	rs->files = files;
+	rs->nr_files = nr_files;
+
+	return rs;
+}
+
+/*
+ * Count the rules that run with and without the shell, for -S.
+ */
+void
+count_rules(struct ruleset *rs)
+{
+	int i;
+
+	stats.direct_rules = stats.shell_rules = 0;
+	for (i = 0; i < rs->nr_blocks; i++) {
+		if (rs->blocks[i]->direct != NULL)
+			stats.direct_rules++;
+		else
+			stats.shell_rules++;
+	}
+}
+
+/*
+ * Load the rules in the background, see reload_config. Nothing but
+ * reload_result and reload_same is written, and they are read by the
+ * event loop once the thread is joined.
+ */
+void *
+reload_main(void *arg)
+{
+	reload_result = load_rules(0, reload_base);
+	if (reload_result != NULL) {
+		reload_same = ruleset_diff(reload_base, reload_result);
+		DMSG("reload: %d blocks unchanged, %d new, %d removed\n", reload_same,
+				reload_result->nr_blocks - reload_same,
+				reload_base->nr_blocks - reload_same);
+	}
+	write(reload_pipe[1], "", 1);
+	return NULL;
 }
 
+/*
+ * Start reloading the configuration in the background.
+ *
+ * The new rules are parsed and compiled by another thread while events
+ * are handled with the old ones. handle_reload puts them in use when
+ * they are ready. A reload asked for while one is running is done after.
+ *
+ * The regexes of the old rules are still in the regex cache, so only
+ * the patterns that changed are compiled.
+ */
 void
 reload_config(void)
 {
+	int status;
+
+	if (reload_running) {
+		reload_again = 1;
+		return;
+	}
+
+	reload_base = ruleset_get(rules);
+	status = pthread_create(&reload_thread, NULL, reload_main, NULL);
+	if (status != 0) {
+		warnx("couldn't start reloading: %s", strerror(status));
+		ruleset_put(reload_base);
+		return;
+	}
+	reload_running = 1;
+}
+
+/*
+ * Use the ruleset rs in place of the rules. The old rules are freed when
+ * the matches that use them are done.
+ */
+void
+set_rules(struct ruleset *rs)
+{
+	struct ruleset *old = rules;
+
+	rules = rs;
+	ruleset_put(old);
+	count_rules(rules);
+}
+
+/*
+ * Put the reloaded rules in use, in place of the old ones.
+ */
+void
+handle_reload(int fd)
+{
+	char c;
 	int i;
-	char *xdg_home = getenv("XDG_CONFIG_HOME");
-	char *xdg_cfg_path;
 
-	cleanup();
-	if (xdg_home == NULL)
-		asprintf(&xdg_home, "%s/.config", getenv("HOME"));
+	while (read(fd, &c, 1) == 1)
+		;
+	if (!reload_running)
+		return;
 
-	asprintf(&xdg_cfg_path, "%s/ruler/rulerrc", xdg_home);
-	if (parse_file(xdg_cfg_path) == 1 && no_of_configs == 0)
-		errx(1, "couldn't open config file '%s' (%s). No other config files supplied, exiting", xdg_cfg_path, strerror(errno));
-	free(xdg_cfg_path);
+	pthread_join(reload_thread, NULL);
+	reload_running = 0;
+	ruleset_put(reload_base);
 
-	for (i = 0; i < no_of_configs; i++) {
-		if (parse_file(configs[i]) != 0)
-			err(1, "couldn't open config file '%s'", configs[i]);
+	if (reload_result == NULL) {
+		warnx("couldn't reload the configuration, keeping the old rules");
+	} else {
+		stats.blocks_same += reload_same;
+		stats.blocks_changed += reload_result->nr_blocks - reload_same;
+		for (i = 0; i < reload_result->nr_files; i++)
+			stats.files_reused += reload_result->files[i].reused;
+		stats.criteria_reused += reload_result->nr_reused;
+		set_rules(reload_result);
+		reload_result = NULL;
+		DMSG("configs reloaded\n");
+	}
+
+	if (reload_again) {
+		reload_again = 0;
+		reload_config();
 	}
+}
 
-	DMSG("configs reloaded\n");
+/*
+ * Write a trace of what comes from the X server to the file given to -T.
+ */
+void
+start_recording(void)
+{
+	struct trace_header h;
+
+	memset(&h, 0, sizeof(h));
+	h.exec_on_prop_change = conf.exec_on_prop_change;
+	h.exec_on_map = conf.exec_on_map;
+	h.catch_override_redirect = conf.catch_override_redirect;
+	h.apply_existing = conf.apply_existing;
+	h.debounce = conf.debounce;
+	if (trace_create(&trace, conf.record, &h) == -1)
+		exit(1);
+}
+
+/*
+ * Open the trace given to -X, and take the options it was recorded with.
+ */
+void
+start_replay(void)
+{
+	struct trace_header h;
+
+	if (trace_open(&trace, conf.replay, &h) == -1)
+		exit(1);
+	conf.exec_on_prop_change = h.exec_on_prop_change;
+	conf.exec_on_map = h.exec_on_map;
+	conf.catch_override_redirect = h.catch_override_redirect;
+	conf.apply_existing = h.apply_existing;
+	conf.debounce = h.debounce;
 }
 
 int
@@ -918,6 +3003,8 @@ main(int argc, char **argv)
 
 	/* see arg.h */
 	ARGBEGIN {
+		case 'a':
+			conf.apply_existing = 1; break;
 		case 'i':
 			conf.case_insensitive = 1; break;
 		case 's':
@@ -931,22 +3018,97 @@ main(int argc, char **argv)
 			conf.exec_on_prop_change = 1; break;
 		case 'm':
 			conf.exec_on_map = 1; break;
+		case 'c':
+			conf.coalesce = 1; break;
+		case 'd':
+			conf.debounce = atoi(EARGF((
+						warnx("option 'd' requires an argument"),
+						print_usage(argv0, 1)
+					)));
+			if (conf.debounce < 0) {
+				warnx("the debounce period can't be negative");
+				print_usage(argv0, 1);
+			}
+			break;
+		case 'r':
+			conf.watch_configs = 1; break;
+		case 'S':
+			conf.print_stats = 1; break;
+		case 'w':
+			conf.workers = atoi(EARGF((
+						warnx("option 'w' requires an argument"),
+						print_usage(argv0, 1)
+					)));
+			if (conf.workers <= 0) {
+				warnx("the number of workers has to be positive");
+				print_usage(argv0, 1);
+			}
+			break;
 		case 'h':
 			print_usage(argv0, 0); break;
+		case 't':
+			conf.match_threads = atoi(EARGF((
+						warnx("option 't' requires an argument"),
+						print_usage(argv0, 1)
+					)));
+			if (conf.match_threads <= 0 || conf.match_threads > PIPELINE_MAX_THREADS) {
+				warnx("the number of match threads has to be between 1 and %d", PIPELINE_MAX_THREADS);
+				print_usage(argv0, 1);
+			}
+			break;
+		case 'T':
+			conf.record = EARGF((
+						warnx("option 'T' requires an argument"),
+						print_usage(argv0, 1)
+					)); break;
+		case 'X':
+			conf.replay = EARGF((
+						warnx("option 'X' requires an argument"),
+						print_usage(argv0, 1)
+					)); break;
+		case 'f':
+			conf.replay_fast = 1; break;
+		case 'P':
+			conf.profile = 1; break;
+		case 'u':
+			conf.ctl_path = EARGF((
+						warnx("option 'u' requires an argument"),
+						print_usage(argv0, 1)
+					)); break;
 		case 'v':
 			print_version(); break;
 	} ARGEND
 
+	if (conf.record != NULL && conf.replay != NULL) {
+		warnx("a trace can't be recorded while one is played back");
+		print_usage(argv0, 1);
+	}
+	if (conf.replay != NULL)
+		start_replay();
+	if (conf.profile && (conf.match_threads > 0 || conf.workers > 0 || conf.coalesce)) {
+		/* every command needs a process of its own, waited for by the event loop */
+		warnx("-c, -t and -w are ignored with -P");
+		conf.match_threads = conf.workers = conf.coalesce = 0;
+	}
+
 	/* the remaining arguments should be files */
 	no_of_configs = argc;
 	DMSG("%d extra config files\n", no_of_configs);
 	configs = argv;
-	reload_config();
+	config_path = default_config_path();
+	rules = load_rules(1, NULL);
+	count_rules(rules);
+
+	if (pipe(reload_pipe) == -1)
+		err(1, "pipe");
+	fcntl(reload_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(reload_pipe[1], F_SETFD, FD_CLOEXEC);
+	fcntl(reload_pipe[0], F_SETFL, O_NONBLOCK);
 
 	if (_debug) {
-		struct list *l;
-		for (l = block_list; l != NULL; l = l->next) {
-			struct block *b = l->n;
+		int i;
+		for (i = 0; i < rules->nr_blocks; i++) {
+			struct block *b = rules->blocks[i];
 			struct list *ld;
 			for (ld = b->d; ld != NULL; ld = ld->next) {
 				struct descriptor *d = ld->n;
@@ -958,24 +3120,86 @@ main(int argc, char **argv)
 		}
 	}
 
-	if (wm_init_xcb() == -1)
-		errx(1, "error while estabilishing connection to the X server");
-	if (wm_get_screen() == -1)
-		errx(1, "couldn't get X screen");
-	init_ewmh();
+	if (conf.replay == NULL) {
+		if (wm_init_xcb() == -1)
+			errx(1, "error while estabilishing connection to the X server");
+		if (wm_get_screen() == -1)
+			errx(1, "couldn't get X screen");
+		/* the X connection is not for the commands */
+		fcntl(xcb_get_file_descriptor(conn), F_SETFD, FD_CLOEXEC);
+		init_ewmh();
+	}
 
 	/* don't let childrens become zombies. kill them for real (bwahaha) */
-	signal(SIGCHLD, SIG_IGN);
-	/* more signals */
-	signal(SIGINT, handle_sig);
-	signal(SIGHUP, handle_sig);
-	signal(SIGTERM, handle_sig);
-	signal(SIGUSR1, handle_sig);
-	signal(SIGUSR2, handle_sig);
-
-	populate_allowed_atoms();
-	register_events();
-	handle_events();
-	wm_kill_xcb();
+	if (!conf.profile)
+		signal(SIGCHLD, SIG_IGN);
+	/* more signals, handled by the event loop */
+	if (loop_init(&loop) == -1)
+		errx(1, "couldn't start the event loop");
+	/* with -P, the children are waited for, to time them */
+	if (conf.profile)
+		loop_add_signal(&loop, SIGCHLD, handle_sig);
+	loop_add_signal(&loop, SIGINT, handle_sig);
+	loop_add_signal(&loop, SIGHUP, handle_sig);
+	loop_add_signal(&loop, SIGTERM, handle_sig);
+	loop_add_signal(&loop, SIGUSR1, handle_sig);
+	loop_add_signal(&loop, SIGUSR2, handle_sig);
+
+	winmap_init(&win_set);
+	winmap_init(&props_cache);
+	winmap_init(&debounced);
+	winmap_init(&children);
+
+	if (conf.workers > 0) {
+		/* a dead worker shows up as EPIPE when writing to it */
+		signal(SIGPIPE, SIG_IGN);
+		if (pool_init(&pool, conf.shell, conf.workers) == -1) {
+			warnx("couldn't start the worker pool");
+			conf.workers = 0;
+		}
+	}
+
+	if (conf.ctl_path != NULL) {
+		/* a client that goes away shows up as EPIPE */
+		signal(SIGPIPE, SIG_IGN);
+		conf.ctl_path = ctl_path(conf.ctl_path);
+		if (conf.ctl_path == NULL)
+			exit(1);
+		ctl_fd = ctl_listen(conf.ctl_path);
+		if (ctl_fd == -1)
+			exit(1);
+		ctl_init(&ctl, ctl_fd, ctl_cmds, &loop, handle_ctl_client);
+	}
+
+	/* started after the signals are blocked, so that the threads block them too */
+	if (conf.match_threads > 0 && pipeline_start(conf.match_threads) == -1) {
+		warnx("couldn't start the match threads");
+		conf.match_threads = 0;
+	}
+
+	if (conf.replay != NULL) {
+		replay_events();
+	} else {
+		populate_allowed_atoms();
+		if (conf.record != NULL)
+			start_recording();
+		register_events();
+		handle_events();
+	}
+	trace_close(&trace);
+	if (ctl_fd != -1)
+		ctl_close(&ctl, conf.ctl_path);
+	if (conf.match_threads > 0)
+		pipeline_stop();
+	if (conf.workers > 0)
+		pool_free(&pool);
+	if (conf.profile)
+		print_profile(stderr, PROFILE_TOP);
+	cleanup();
+	loop_free(&loop);
+	if (conf.print_stats)
+		print_stats(stderr);
+	if (conf.replay == NULL)
+		wm_kill_xcb();
 	return 0;
 }
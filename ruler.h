@@ -1,13 +1,28 @@
 #ifndef __RULER_H
 #define __RULER_H
 
+#include <spawn.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/types.h>
 #include <xcb/xcb_ewmh.h>
 #include <regex.h>
 
+#include "hist.h"
+#include "lit.h"
+
 #define WINDOW_TYPE_STRING_LENGTH 110
 #define REGEX_FLAGS REG_EXTENDED | REG_NOSUB
 #define ENV_VARIABLE "RULER_WID"
 #define DEBUG 0
+/* maximum number of events handled in one batch */
+#define BATCH_MAX 512
+/* longest wait for a window to get quiet, in debounce periods */
+#define DEBOUNCE_MAX_WAIT 10
+/* blocks printed by the profile report, unless asked for more */
+#define PROFILE_TOP 20
+/* file name of the blocks added on the control socket */
+#define CTL_FILE "control"
 
 #ifndef NAME
 #define NAME "ruler"
@@ -32,6 +47,23 @@ static const char *atom_names[] = {
 	"_NET_WM_WINDOW_TYPE"
 };
 
+/* properties of a window, used to select which ones are fetched */
+enum {
+	PROP_CLASS = 1 << 0, /* class and instance */
+	PROP_TYPE  = 1 << 1,
+	PROP_NAME  = 1 << 2,
+	PROP_ROLE  = 1 << 3,
+	PROP_ALL   = PROP_CLASS | PROP_TYPE | PROP_NAME | PROP_ROLE
+};
+
+/* property changed by each of the atoms above */
+static const int atom_props[] = {
+	PROP_NAME,
+	PROP_CLASS,
+	PROP_ROLE,
+	PROP_TYPE
+};
+
 #define DMSG(fmt, ...) if (_debug) { fprintf(stderr, fmt, ##__VA_ARGS__); }
 
 typedef char * command_t;
@@ -41,13 +73,23 @@ enum criterion {
 	CRIT_INSTANCE,
 	CRIT_TYPE,
 	CRIT_NAME,
-	CRIT_ROLE
+	CRIT_ROLE,
+	NR_CRITERIA
 };
 
+/* anchors of a literal regex */
 struct descriptor {
 	enum criterion criterion;
 	char *str;
 	regex_t *reg;
+	/* fixed string matched by the regex, NULL if it isn't a literal */
+	char *lit;
+	size_t lit_len;
+	int lit_anchor;
+	/* with -P, times it was matched and matched, and matching time in ns */
+	unsigned long evals;
+	unsigned long matches;
+	unsigned long long match_ns;
 };
 
 struct list {
@@ -56,10 +98,47 @@ struct list {
 	struct list *prev;
 };
 
+/* counters of a block, kept with -P */
+struct block_prof {
+	unsigned long evals;
+	unsigned long matches;
+	/* matching time of the descriptors, in ns */
+	unsigned long long match_ns;
+	/* commands started and finished, and the time and CPU of the finished */
+	unsigned long commands;
+	unsigned long finished;
+	unsigned long long wall_ns;
+	unsigned long long user_us;
+	unsigned long long sys_us;
+};
+
 struct block {
 	/* list of descriptors */
 	struct list *d;
 	command_t c;
+	/* the command split into words, NULL if it needs the shell */
+	struct direct_cmd *direct;
+	/* where the block starts in the configuration */
+	const char *file;
+	int line;
+	struct block_prof prof;
+};
+
+/* a command started with -P that didn't finish yet */
+struct child {
+	struct ruleset *rs;
+	struct block *b;
+	long long start;
+};
+
+/* a configuration file, as it was when its blocks were read */
+struct file_stamp {
+	const char *path;
+	/* its text, NULL if it had errors */
+	char *text;
+	size_t len;
+	/* whether the blocks were copied from the previous rules */
+	int reused;
 };
 
 struct win_props {
@@ -70,12 +149,112 @@ struct win_props {
 	char *role;
 };
 
+/* pending property requests of a window, see request_props */
+struct props_cookie {
+	xcb_window_t win;
+	int mask;
+	xcb_get_property_cookie_t class;
+	xcb_get_property_cookie_t type;
+	xcb_get_property_cookie_t net_name;
+	xcb_get_property_cookie_t name;
+	xcb_get_property_cookie_t role;
+};
+
+/* a window event waiting to be handled, see handle_event_batch */
+struct batch_entry {
+	int type;
+	xcb_window_t win;
+	/* properties to fetch */
+	int mask;
+	int check_attr;
+	xcb_get_window_attributes_cookie_t attr;
+	struct props_cookie props;
+	/* time of the event, in µs */
+	long long since;
+};
+
+/* property changes of a window held back with -d */
+struct debounce {
+	int mask;
+	/* times of the first change and of when the changes are due, in ms */
+	long long first;
+	long long deadline;
+};
+
 struct conf {
 	int case_insensitive;
 	char *shell;
 	int catch_override_redirect;
 	int exec_on_prop_change;
 	int exec_on_map;
+	int print_stats;
+	/* number of shells in the worker pool, 0 if there is no pool */
+	int workers;
+	/* run the asynchronous commands for a window in one shell */
+	int coalesce;
+	/* quiet period for property changes in ms, 0 to handle them at once */
+	int debounce;
+	/* reload when a configuration file changes */
+	int watch_configs;
+	/* number of threads that match windows, 0 to match in the event loop */
+	int match_threads;
+	/* apply the rules on the windows that exist at startup */
+	int apply_existing;
+	/* trace to write, trace to play back, and if it is played at once */
+	char *record;
+	char *replay;
+	int replay_fast;
+	/* path of the control socket */
+	char *ctl_path;
+	/* count matches and time rules and commands, per block */
+	int profile;
+};
+
+/* counters printed with -S */
+struct stats {
+	unsigned long memo_hits;
+	unsigned long memo_misses;
+	/* commands run by the worker pool and by new shells */
+	unsigned long pool_jobs;
+	unsigned long spawns;
+	/* commands run without a shell */
+	unsigned long direct_spawns;
+	/* commands joined into the shell of another, i.e. spawns saved */
+	unsigned long coalesced;
+	/* events merged with others of the same window, and thrown away */
+	unsigned long events_coalesced;
+	unsigned long events_dropped;
+	/* regexes found compiled, and compiled */
+	unsigned long regcache_hits;
+	unsigned long regcache_misses;
+	/* blocks found unchanged and changed by reloads */
+	unsigned long blocks_same;
+	unsigned long blocks_changed;
+	/* files and criteria reloads found unchanged, and didn't compile again */
+	unsigned long files_reused;
+	unsigned long criteria_reused;
+	/* rules whose command is run without and with a shell */
+	unsigned long direct_rules;
+	unsigned long shell_rules;
+	/* windows the rules were applied on, and most of them in a second */
+	unsigned long windows;
+	unsigned long windows_peak;
+	/* time from the events of the windows to their commands, in µs */
+	unsigned long latency_count;
+	unsigned long long latency_total;
+	unsigned long long latency_max;
+	/* X events read, by type */
+	unsigned long events_map;
+	unsigned long events_property;
+	unsigned long events_destroy;
+	unsigned long events_other;
+	/* commands started, and the ones that couldn't be */
+	unsigned long commands_started;
+	unsigned long commands_failed;
+	/* time to fetch the properties of a window, match it and start a command, in ns */
+	struct hist fetch;
+	struct hist match;
+	struct hist start;
 };
 
 void yyerror(const char *);
@@ -83,28 +262,36 @@ int yywrap(void);
 int yylex(void);
 int yyparse(void);
 void yyrestart(FILE *);
+extern int yylineno;
 
 void print_usage(const char *, int);
 void print_version(void);
 char * strip_quotes(char *);
 
+char * literal_pattern(const char *, size_t *, int *);
 struct descriptor * new_descriptor(char *, char *);
 void desc(char *, char *);
 void descriptor_free(struct descriptor *);
+struct descriptor * descriptor_copy(struct descriptor *);
 
 void list_add(struct list **, void *node);
-void list_remove(struct list **, struct list *);
+void list_delete(struct list **, struct list *);
 void list_free(struct list **);
 
 command_t new_command(char *);
 void comm(char *);
 
 struct block * new_block(struct list *, command_t);
+command_t block_command(struct block *, int *);
 void block(void);
 void block_free(struct block *);
+struct block * block_copy(struct block *);
+void copy_blocks(struct list **, struct list *, struct block *);
+void copy_stamps(struct ruleset *, struct ruleset *, const char *);
 
 struct win_props * new_win_props(void);
 void free_win_props(struct win_props *);
+struct win_props * copy_win_props(struct win_props *);
 void print_win_props(struct win_props *);
 
 void init_ewmh(void);
@@ -112,30 +299,99 @@ xcb_atom_t get_atom(const char *);
 void populate_allowed_atoms(void);
 
 char * window_type_to_string(xcb_ewmh_get_atoms_reply_t *);
+xcb_get_property_cookie_t get_string_prop_cookie(xcb_window_t, xcb_atom_t, int);
+char * get_string_prop_reply(xcb_get_property_cookie_t);
 char * get_string_prop(xcb_window_t, xcb_atom_t, int);
 
+void request_props(xcb_window_t, int, struct props_cookie *);
+void collect_props(struct props_cookie *, struct win_props *);
 struct win_props * get_props(xcb_window_t);
-int match_props(struct win_props *, struct list *);
-void find_matching_blocks(struct win_props *, struct list *, struct list **);
 
-void execute(char **);
-void spawn(char *, command_t);
-void run_command(char *shell, command_t, int);
+struct win_props * props_cache_get(xcb_window_t);
+void props_cache_put(xcb_window_t, struct win_props *);
+void props_cache_drop(xcb_window_t);
+char * prop_value(struct win_props *, enum criterion);
+int descriptor_match(struct descriptor *, const char *);
+int match_props(struct win_props *, struct list *);
 
-void execute_matching_block(struct win_props *, struct list *);
+pid_t spawn_argv(char **, posix_spawn_file_actions_t *, char **);
+pid_t spawn(char *, command_t, char **);
+void run_command(char *shell, command_t, int, char **);
+void count_start(pid_t, long long);
+struct direct_cmd;
+void run_direct(struct direct_cmd *, int, char **);
+
+void run_joined(struct block **, int, char **);
+struct ruleset;
+void execute_blocks(struct ruleset *, int *, int, long long, xcb_window_t);
+void execute_matching_block(struct win_props *, struct ruleset *, long long, xcb_window_t);
+int profile_match(struct ruleset *, struct win_props *, int *);
+void profile_finished(struct block *, long long, struct rusage *, struct rusage *);
+void profile_run(struct ruleset *, struct block *, command_t, int, char **);
+void profile_reap(void);
+unsigned long long block_cost(struct block *);
+int cmp_cost(const void *, const void *);
+void print_profile(FILE *, int);
 
 void register_events(void);
-void set_environ(xcb_window_t);
+char ** window_env(xcb_window_t);
+const char * env_wid(char **);
+int is_listable_reply(xcb_get_window_attributes_cookie_t);
+int batch_add_event(xcb_generic_event_t *, struct batch_entry *);
+int batch_want_window(struct batch_entry *);
+long long now_ms(void);
+long long now_us(void);
+long long now_ns(void);
+void count_window(int);
+void count_latency(long long);
+void debounce_event(struct batch_entry *);
+int debounce_take(xcb_window_t, struct batch_entry *);
+void debounce_drop(xcb_window_t);
+long long debounce_next(void);
+void debounce_flush(void);
+void apply_rules(struct batch_entry *, int);
+void handle_entries(struct batch_entry *, int);
+int handle_event_batch(void);
+void watch_configs(void);
+void handle_inotify(int);
+void handle_x_events(int);
+void handle_pool(int);
+void handle_timer(int);
+void add_loop_fds(void);
 void handle_events(void);
+void handle_replay(int);
+void handle_ctl(int);
+void handle_ctl_client(int);
+struct ctl_req;
+void ctl_add(FILE *, char *, struct ctl_req *);
+void ctl_remove(FILE *, char *, struct ctl_req *);
+void ctl_list(FILE *, char *, struct ctl_req *);
+void ctl_pause(FILE *, char *, struct ctl_req *);
+void ctl_resume(FILE *, char *, struct ctl_req *);
+void ctl_stats(FILE *, char *, struct ctl_req *);
+void ctl_profile(FILE *, char *, struct ctl_req *);
+void replay_events(void);
 
 int is_new_window(xcb_window_t);
+void start_recording(void);
+void start_replay(void);
 
 void cleanup(void);
+void print_stats(FILE *);
 
 void init_conf(void);
 
 void handle_sig(int);
-int parse_file(char *);
+int parse_file(char *, struct ruleset *, struct file_stamp *);
+void parse_stream(FILE *, const char *);
+struct list * parse_take(int);
+struct list * parse_text(const char *, size_t);
+char * default_config_path(void);
+struct ruleset * load_rules(int, struct ruleset *);
+void count_rules(struct ruleset *);
+void * reload_main(void *);
 void reload_config(void);
+void set_rules(struct ruleset *);
+void handle_reload(int);
 
 #endif
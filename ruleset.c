@@ -0,0 +1,937 @@
+#include <ctype.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lit.h"
+#include "ruler.h"
+#include "ruleset.h"
+
+#define HASH_BASE 1099511628211ULL
+
+#define BIT_SET(b, i) ((b)[(i) >> 6] |= (uint64_t)1 << ((i) & 63))
+#define BIT_HAS(b, i) (((b)[(i) >> 6] >> ((i) & 63)) & 1)
+
+extern struct conf conf;
+extern struct stats stats;
+extern const int _debug;
+
+/*
+ * Hash of a string of `len` bytes. The hash of consecutive substrings
+ * of the same length can be computed with lit_roll.
+ */
+static uint64_t
+lit_hash(const char *s, size_t len)
+{
+	uint64_t h = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = h * HASH_BASE + (unsigned char)s[i];
+
+	return h;
+}
+
+/*
+ * Slide the hash `h` of a substring one byte to the right.
+ * `pow` is HASH_BASE to the power of the substring length.
+ */
+static uint64_t
+lit_roll(uint64_t h, uint64_t pow, unsigned char out, unsigned char in)
+{
+	return h * HASH_BASE + in - pow * out;
+}
+
+static int
+cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static int
+cmp_size(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a, y = *(const size_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Choose the descriptor a block is indexed by.
+ *
+ * Anchored literals are preferred because they can match at fewer
+ * places, then the longest one. Returns NULL if there is no literal.
+ */
+static struct descriptor *
+block_key(struct block *b)
+{
+	struct list *l;
+	struct descriptor *best = NULL, *d;
+
+	for (l = b->d; l != NULL; l = l->next) {
+		d = l->n;
+		if (d->lit == NULL || d->reg == NULL)
+			continue;
+
+		if (best == NULL
+				|| (d->lit_anchor != 0 && best->lit_anchor == 0)
+				|| ((d->lit_anchor != 0) == (best->lit_anchor != 0)
+					&& d->lit_len > best->lit_len))
+			best = d;
+	}
+
+	return best;
+}
+
+/*
+ * Build the literal index of the literal descriptors in `descs`.
+ */
+static void
+lit_index_build(struct lit_index *idx, struct descriptor **descs, int nr, int *key_block)
+{
+	struct descriptor *d;
+	struct lit_entry e;
+	size_t pool_len = 0, i;
+	uint32_t *fill;
+	int id, nr_lits = 0;
+
+	for (id = 0; id < nr; id++) {
+		if (descs[id]->lit != NULL && descs[id]->reg != NULL) {
+			nr_lits++;
+			pool_len += descs[id]->lit_len;
+		}
+	}
+
+	for (idx->size = 16; idx->size < 2 * nr_lits; idx->size *= 2)
+		;
+	idx->start = calloc(idx->size + 1, sizeof(uint32_t));
+	idx->entries = malloc((nr_lits + 1) * sizeof(struct lit_entry));
+	idx->pool = malloc(pool_len + 1);
+	idx->lens = malloc((nr_lits + 1) * sizeof(size_t));
+	idx->nr_lens = 0;
+	fill = calloc(idx->size, sizeof(uint32_t));
+
+	/* count the entries of each bucket, then place them */
+	for (id = 0; id < nr; id++) {
+		d = descs[id];
+		if (d->lit != NULL && d->reg != NULL)
+			idx->start[(lit_hash(d->lit, d->lit_len) & (idx->size - 1)) + 1]++;
+	}
+	for (i = 0; i < idx->size; i++)
+		idx->start[i + 1] += idx->start[i];
+
+	pool_len = 0;
+	for (id = 0; id < nr; id++) {
+		d = descs[id];
+		if (d->lit == NULL || d->reg == NULL)
+			continue;
+
+		e.hash = lit_hash(d->lit, d->lit_len);
+		e.off = pool_len;
+		e.len = d->lit_len;
+		e.anchor = d->lit_anchor;
+		e.id = id;
+		e.block = key_block[id];
+		memcpy(idx->pool + pool_len, d->lit, d->lit_len);
+		pool_len += d->lit_len;
+
+		i = e.hash & (idx->size - 1);
+		idx->entries[idx->start[i] + fill[i]++] = e;
+
+		for (i = 0; i < idx->nr_lens && idx->lens[i] != d->lit_len; i++)
+			;
+		if (i == idx->nr_lens)
+			idx->lens[idx->nr_lens++] = d->lit_len;
+	}
+	free(fill);
+
+	qsort(idx->lens, idx->nr_lens, sizeof(size_t), cmp_size);
+}
+
+static void
+lit_index_free(struct lit_index *idx)
+{
+	free(idx->start);
+	free(idx->entries);
+	free(idx->pool);
+	free(idx->lens);
+}
+
+/*
+ * Whether the descriptors of a criterion are the ones of the same criterion
+ * of another ruleset, with the same regexes and keys, so that what's compiled
+ * from them can be shared.
+ */
+static int
+crit_rules_same(struct crit_rules *cr, struct crit_rules *old)
+{
+	int i;
+
+	if (cr->nr_descs != old->nr_descs)
+		return 0;
+
+	for (i = 0; i < cr->nr_descs; i++) {
+		/* the regex cache gives the same regex_t for the same pattern */
+		if (cr->descs[i]->reg != old->descs[i]->reg
+				|| cr->key_block[i] != old->key_block[i]
+				|| strcmp(cr->descs[i]->str, old->descs[i]->str) != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Sort the descriptors of a criterion into the literal index,
+ * the combined regex and the ones left for regexec, or share them with
+ * the same criterion of an older ruleset if it has the same descriptors.
+ *
+ * Returns 1 if they were shared, 0 if they were compiled.
+ */
+static int
+crit_rules_compile(struct crit_rules *cr, struct crit_rules *old)
+{
+	struct descriptor **descs = cr->descs;
+	struct descriptor *d;
+	int i;
+
+	if (old != NULL && crit_rules_same(cr, old)) {
+		__atomic_add_fetch(old->refs, 1, __ATOMIC_RELAXED);
+		cr->refs = old->refs;
+		cr->words = old->words;
+		cr->index = old->index;
+		cr->rx = old->rx;
+		cr->rx_descs = old->rx_descs;
+		cr->slow = old->slow;
+		cr->slow_regs = old->slow_regs;
+		cr->slow_lits = old->slow_lits;
+		cr->nr_slow = old->nr_slow;
+		cr->regex_bits = old->regex_bits;
+		return 1;
+	}
+
+	cr->refs = malloc(sizeof(int));
+	if (cr->refs == NULL)
+		err(1, "malloc");
+	*cr->refs = 1;
+
+	cr->words = (cr->nr_descs + 63) / 64;
+	lit_index_build(&cr->index, descs, cr->nr_descs, cr->key_block);
+
+	cr->rx = rx_new(conf.case_insensitive);
+	cr->rx_descs = malloc((cr->nr_descs + 1) * sizeof(int));
+	cr->slow = malloc((cr->nr_descs + 1) * sizeof(int));
+	cr->slow_regs = malloc((cr->nr_descs + 1) * sizeof(regex_t *));
+	cr->slow_lits = malloc((cr->nr_descs + 1) * sizeof(char *));
+	cr->nr_slow = 0;
+	cr->regex_bits = calloc(cr->words + 1, sizeof(uint64_t));
+
+	for (i = 0; i < cr->nr_descs; i++) {
+		d = descs[i];
+		/* a regex that didn't compile never matches */
+		if (d->reg == NULL || d->lit != NULL)
+			continue;
+
+		BIT_SET(cr->regex_bits, i);
+
+#ifndef LIBC_REGEX
+		if (rx_add(cr->rx, d->str) >= 0) {
+			cr->rx_descs[rx_count(cr->rx) - 1] = i;
+			continue;
+		}
+#endif
+		cr->slow[cr->nr_slow] = i;
+		cr->slow_regs[cr->nr_slow] = d->reg;
+		/* regexec may fold more than single bytes when case is ignored */
+		cr->slow_lits[cr->nr_slow++] = conf.case_insensitive
+			? NULL : rx_literal(d->str, 0);
+	}
+
+	rx_compile(cr->rx);
+	return 0;
+}
+
+static void
+crit_rules_free(struct crit_rules *cr)
+{
+	int i;
+
+	free(cr->descs);
+	free(cr->key_block);
+	if (__atomic_sub_fetch(cr->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	free(cr->refs);
+	lit_index_free(&cr->index);
+	rx_free(cr->rx);
+	free(cr->rx_descs);
+	for (i = 0; i < cr->nr_slow; i++)
+		free(cr->slow_lits[i]);
+	free(cr->slow);
+	free(cr->slow_regs);
+	free(cr->slow_lits);
+	free(cr->regex_bits);
+}
+
+static void
+memo_init(struct memo *m)
+{
+	int i;
+
+	m->nr_entries = 0;
+	m->head = m->tail = -1;
+	for (i = 0; i < 2 * MEMO_SIZE; i++)
+		m->buckets[i] = -1;
+	memset(m->once, 0, sizeof(m->once));
+}
+
+static void
+memo_free(struct memo *m)
+{
+	int i;
+
+	for (i = 0; i < m->nr_entries; i++) {
+		free(m->entries[i].value);
+		free(m->entries[i].bits);
+		free(m->entries[i].cand);
+	}
+}
+
+static uint32_t
+memo_hash(enum criterion crit, const char *value)
+{
+	uint32_t h = 2166136261u ^ crit;
+
+	for (; *value != '\0'; value++)
+		h = (h ^ (unsigned char)*value) * 16777619u;
+
+	return h;
+}
+
+static void
+memo_unlink(struct memo *m, int i)
+{
+	struct memo_entry *e = &m->entries[i];
+
+	if (e->prev >= 0)
+		m->entries[e->prev].next = e->next;
+	else
+		m->head = e->next;
+	if (e->next >= 0)
+		m->entries[e->next].prev = e->prev;
+	else
+		m->tail = e->prev;
+}
+
+static void
+memo_push(struct memo *m, int i)
+{
+	struct memo_entry *e = &m->entries[i];
+
+	e->prev = -1;
+	e->next = m->head;
+	if (m->head >= 0)
+		m->entries[m->head].prev = i;
+	m->head = i;
+	if (m->tail < 0)
+		m->tail = i;
+}
+
+/*
+ * Find the entry of a property value and make it the most recently used.
+ * Returns NULL if the value isn't cached.
+ */
+static struct memo_entry *
+memo_get(struct memo *m, enum criterion crit, const char *value, uint32_t h)
+{
+	struct memo_entry *e;
+	int i;
+
+	for (i = m->buckets[h % (2 * MEMO_SIZE)]; i >= 0; i = e->chain) {
+		e = &m->entries[i];
+		if (e->hash == h && e->crit == crit && strcmp(e->value, value) == 0) {
+			memo_unlink(m, i);
+			memo_push(m, i);
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Remember the matches of a property value, evicting the least
+ * recently used entry if the cache is full.
+ */
+static void
+memo_put(struct memo *m, enum criterion crit, const char *value, uint32_t h,
+		uint64_t *bits, int words, int *cand, int nr_cand)
+{
+	struct memo_entry *e;
+	int i, *link;
+
+	if (m->nr_entries < MEMO_SIZE) {
+		i = m->nr_entries++;
+		e = &m->entries[i];
+		e->value = NULL;
+		e->bits = NULL;
+		e->cand = NULL;
+	} else {
+		i = m->tail;
+		e = &m->entries[i];
+		memo_unlink(m, i);
+		for (link = &m->buckets[e->hash % (2 * MEMO_SIZE)]; *link != i; link = &m->entries[*link].chain)
+			;
+		*link = e->chain;
+		free(e->value);
+	}
+
+	e->crit = crit;
+	e->value = strdup(value);
+	e->hash = h;
+	e->bits = realloc(e->bits, (words + 1) * sizeof(uint64_t));
+	memcpy(e->bits, bits, words * sizeof(uint64_t));
+	e->cand = realloc(e->cand, (nr_cand + 1) * sizeof(int));
+	memcpy(e->cand, cand, nr_cand * sizeof(int));
+	e->nr_cand = nr_cand;
+
+	e->chain = m->buckets[h % (2 * MEMO_SIZE)];
+	m->buckets[h % (2 * MEMO_SIZE)] = i;
+	memo_push(m, i);
+}
+
+/*
+ * Compile the blocks of a list made by the parser.
+ *
+ * The list holds the blocks in reverse order, the ruleset in file order.
+ * The ruleset takes the list and its blocks, and starts with one reference.
+ * The criteria left as they are in base, if not NULL, aren't compiled again.
+ */
+struct ruleset *
+ruleset_new(struct list *block_list, struct ruleset *base)
+{
+	struct ruleset *rs = malloc(sizeof(struct ruleset));
+	struct crit_rules *cr;
+	struct descriptor *d, *key;
+	struct block_mask *m;
+	struct list *l;
+	int *block_ids;
+	int i, c, id, word, nr_masks, max_words = 1;
+
+	rs->list = block_list;
+	rs->refs = 1;
+	rs->nr_blocks = 0;
+	for (l = block_list; l != NULL; l = l->next)
+		rs->nr_blocks++;
+
+	rs->blocks = malloc(rs->nr_blocks * sizeof(struct block *));
+	i = rs->nr_blocks;
+	for (l = block_list; l != NULL; l = l->next)
+		rs->blocks[--i] = l->n;
+
+	/* number the descriptors of each criterion, in block order */
+	nr_masks = 0;
+	for (c = 0; c < NR_CRITERIA; c++)
+		rs->crit[c].nr_descs = 0;
+	for (i = 0; i < rs->nr_blocks; i++) {
+		for (l = rs->blocks[i]->d; l != NULL; l = l->next) {
+			rs->crit[((struct descriptor *)l->n)->criterion].nr_descs++;
+			nr_masks++;
+		}
+	}
+	for (c = 0; c < NR_CRITERIA; c++) {
+		cr = &rs->crit[c];
+		cr->descs = malloc((cr->nr_descs + 1) * sizeof(struct descriptor *));
+		cr->key_block = malloc((cr->nr_descs + 1) * sizeof(int));
+		cr->nr_descs = 0;
+	}
+
+	/* the descriptor ids of a block are consecutive in each criterion */
+	block_ids = malloc(nr_masks * sizeof(int));
+	rs->unindexed = malloc(rs->nr_blocks * sizeof(int));
+	rs->nr_unindexed = 0;
+	nr_masks = 0;
+	for (i = 0; i < rs->nr_blocks; i++) {
+		key = block_key(rs->blocks[i]);
+		if (key == NULL)
+			rs->unindexed[rs->nr_unindexed++] = i;
+
+		for (l = rs->blocks[i]->d; l != NULL; l = l->next) {
+			d = l->n;
+			cr = &rs->crit[d->criterion];
+			cr->key_block[cr->nr_descs] = d == key ? i : -1;
+			block_ids[nr_masks++] = cr->nr_descs;
+			cr->descs[cr->nr_descs++] = d;
+		}
+	}
+
+	rs->words = 0;
+	rs->nr_reused = 0;
+	for (c = 0; c < NR_CRITERIA; c++) {
+		cr = &rs->crit[c];
+		rs->nr_reused += crit_rules_compile(cr, base != NULL ? &base->crit[c] : NULL);
+
+		cr->base = rs->words;
+		rs->words += cr->words;
+		if (cr->words > max_words)
+			max_words = cr->words;
+		DMSG("criterion %d: %d descriptors, %d in the combined regex, %d with regexec\n",
+				c, cr->nr_descs, rx_count(cr->rx), cr->nr_slow);
+	}
+
+	/* turn the descriptors of each block into masks of the bitset */
+	rs->mask_start = malloc((rs->nr_blocks + 1) * sizeof(int));
+	rs->masks = malloc((nr_masks + 1) * sizeof(struct block_mask));
+	nr_masks = 0;
+	id = 0;
+	for (i = 0; i < rs->nr_blocks; i++) {
+		rs->mask_start[i] = nr_masks;
+		for (l = rs->blocks[i]->d; l != NULL; l = l->next, id++) {
+			d = l->n;
+			word = rs->crit[d->criterion].base + block_ids[id] / 64;
+			for (m = &rs->masks[rs->mask_start[i]]; m < &rs->masks[nr_masks] && m->word != word; m++)
+				;
+			if (m == &rs->masks[nr_masks]) {
+				m->word = word;
+				m->crit = d->criterion;
+				m->mask = 0;
+				nr_masks++;
+			}
+			m->mask |= (uint64_t)1 << (block_ids[id] % 64);
+		}
+	}
+	rs->mask_start[rs->nr_blocks] = nr_masks;
+	free(block_ids);
+
+	rs->max_words = max_words;
+	rs->ctx = match_ctx_new(rs);
+	rs->files = NULL;
+	rs->nr_files = 0;
+
+	DMSG("%d blocks, %d of them indexed by a literal, %d criteria left as they were\n",
+			rs->nr_blocks, rs->nr_blocks - rs->nr_unindexed, rs->nr_reused);
+
+	return rs;
+}
+
+/*
+ * Hash of the descriptors and the command of a block.
+ */
+static uint64_t
+block_hash(struct block *b)
+{
+	struct list *l;
+	struct descriptor *d;
+	uint64_t h = 14695981039346656037ULL;
+	const char *c;
+
+	for (l = b->d; l != NULL; l = l->next) {
+		d = l->n;
+		h = (h ^ (d->criterion + 1)) * HASH_BASE;
+		for (c = d->str; *c != '\0'; c++)
+			h = (h ^ (unsigned char)*c) * HASH_BASE;
+		h = (h ^ 0xff) * HASH_BASE;
+	}
+	for (c = b->c; *c != '\0'; c++)
+		h = (h ^ (unsigned char)*c) * HASH_BASE;
+
+	return h;
+}
+
+static int
+cmp_hash(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Compare the blocks of two rulesets, counting the blocks of `new` that
+ * are also in `old`. Returns the number of blocks that are the same.
+ */
+int
+ruleset_diff(struct ruleset *old, struct ruleset *new)
+{
+	uint64_t *a, *b;
+	int i, j, same = 0;
+
+	a = malloc((old->nr_blocks + 1) * sizeof(uint64_t));
+	b = malloc((new->nr_blocks + 1) * sizeof(uint64_t));
+	if (a == NULL || b == NULL)
+		err(1, "malloc");
+
+	for (i = 0; i < old->nr_blocks; i++)
+		a[i] = block_hash(old->blocks[i]);
+	for (i = 0; i < new->nr_blocks; i++)
+		b[i] = block_hash(new->blocks[i]);
+	qsort(a, old->nr_blocks, sizeof(uint64_t), cmp_hash);
+	qsort(b, new->nr_blocks, sizeof(uint64_t), cmp_hash);
+
+	for (i = j = 0; i < old->nr_blocks && j < new->nr_blocks; ) {
+		if (a[i] == b[j]) {
+			same++;
+			i++;
+			j++;
+		} else if (a[i] < b[j]) {
+			i++;
+		} else {
+			j++;
+		}
+	}
+
+	free(a);
+	free(b);
+	return same;
+}
+
+/*
+ * Take a reference to the ruleset, so that it isn't freed while in use.
+ */
+struct ruleset *
+ruleset_get(struct ruleset *rs)
+{
+	__atomic_add_fetch(&rs->refs, 1, __ATOMIC_RELAXED);
+	return rs;
+}
+
+/*
+ * Drop a reference to the ruleset, and free it with the last one.
+ */
+void
+ruleset_put(struct ruleset *rs)
+{
+	if (rs != NULL && __atomic_sub_fetch(&rs->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		ruleset_free(rs);
+}
+
+/*
+ * Free the ruleset with its blocks.
+ */
+void
+ruleset_free(struct ruleset *rs)
+{
+	struct list *l;
+	int c, i;
+
+	for (l = rs->list; l != NULL; l = l->next)
+		block_free(l->n);
+	list_free(&rs->list);
+
+	match_ctx_free(rs->ctx);
+	for (c = 0; c < NR_CRITERIA; c++)
+		crit_rules_free(&rs->crit[c]);
+	free(rs->blocks);
+	free(rs->mask_start);
+	free(rs->masks);
+	free(rs->unindexed);
+	for (i = 0; i < rs->nr_files; i++)
+		free(rs->files[i].text);
+	free(rs->files);
+	free(rs);
+}
+
+/*
+ * Make the state needed to match windows against a ruleset.
+ */
+struct match_ctx *
+match_ctx_new(struct ruleset *rs)
+{
+	struct match_ctx *ctx = malloc(sizeof(struct match_ctx));
+	int c;
+
+	if (ctx == NULL)
+		err(1, "malloc");
+
+	ctx->rs = rs;
+	for (c = 0; c < NR_CRITERIA; c++)
+		ctx->dfa[c] = rx_dfa_new(rs->crit[c].rx);
+	memo_init(&ctx->memo);
+	ctx->bits = malloc((rs->words + 1) * sizeof(uint64_t));
+	ctx->rx_bits = malloc(rs->max_words * sizeof(uint64_t));
+	ctx->done = malloc((rs->words + 1) * sizeof(uint64_t));
+	ctx->seen = calloc(rs->nr_blocks + 1, sizeof(unsigned int));
+	ctx->gen = 0;
+
+	return ctx;
+}
+
+void
+match_ctx_free(struct match_ctx *ctx)
+{
+	int c;
+
+	for (c = 0; c < NR_CRITERIA; c++)
+		rx_dfa_free(ctx->dfa[c]);
+	memo_free(&ctx->memo);
+	free(ctx->bits);
+	free(ctx->rx_bits);
+	free(ctx->done);
+	free(ctx->seen);
+	free(ctx);
+}
+
+/*
+ * Look up every substring of `value` in the literal index. The matching
+ * descriptors are set in `bits` and the blocks whose key is found are
+ * put in `cand`.
+ *
+ * Substrings are only checked for the lengths that are in the index,
+ * with a rolling hash, so this takes one pass over `value` per length.
+ * Returns the new number of candidates.
+ */
+static int
+lit_index_lookup(struct match_ctx *ctx, struct lit_index *idx, const char *value,
+		uint64_t *bits, int *cand, int nr_cand)
+{
+	struct lit_entry *e, *end;
+	size_t vlen = strlen(value), n, off, k, b;
+	uint64_t h, pow;
+	int i;
+
+	for (i = 0; i < idx->nr_lens && (n = idx->lens[i]) <= vlen; i++) {
+		pow = 1;
+		for (k = 0; k < n; k++)
+			pow *= HASH_BASE;
+
+		h = lit_hash(value, n);
+		for (off = 0; ; off++) {
+			b = h & (idx->size - 1);
+			end = &idx->entries[idx->start[b + 1]];
+			for (e = &idx->entries[idx->start[b]]; e < end; e++) {
+				if (e->hash != h || e->len != n
+						|| BIT_HAS(bits, e->id)
+						|| ((e->anchor & LIT_BOL) && off != 0)
+						|| ((e->anchor & LIT_EOL) && off + n != vlen)
+						|| memcmp(idx->pool + e->off, value + off, n) != 0)
+					continue;
+
+				BIT_SET(bits, e->id);
+				if (e->block >= 0 && ctx->seen[e->block] != ctx->gen) {
+					ctx->seen[e->block] = ctx->gen;
+					cand[nr_cand++] = e->block;
+				}
+			}
+
+			if (off + n == vlen)
+				break;
+			h = lit_roll(h, pow, value[off], value[off + n]);
+		}
+	}
+
+	return nr_cand;
+}
+
+/*
+ * Search for each literal of a small index in `value`, like
+ * lit_index_lookup. Case is ignored by the search, so `value` isn't
+ * folded first.
+ */
+static int
+lit_index_scan(struct match_ctx *ctx, struct lit_index *idx, const char *value,
+		uint64_t *bits, int *cand, int nr_cand)
+{
+	struct lit_entry *e, *end = &idx->entries[idx->start[idx->size]];
+
+	for (e = idx->entries; e < end; e++) {
+		if (BIT_HAS(bits, e->id) || !lit_match(value, idx->pool + e->off,
+					e->len, e->anchor, conf.case_insensitive))
+			continue;
+
+		BIT_SET(bits, e->id);
+		if (e->block >= 0 && ctx->seen[e->block] != ctx->gen) {
+			ctx->seen[e->block] = ctx->gen;
+			cand[nr_cand++] = e->block;
+		}
+	}
+
+	return nr_cand;
+}
+
+/*
+ * Find the literal descriptors of a criterion that match a property and
+ * the blocks whose key is among them. The other bits are cleared.
+ */
+static int
+crit_rules_match_lits(struct match_ctx *ctx, int c, const char *value,
+		uint64_t *bits, int *cand, int nr_cand)
+{
+	struct crit_rules *cr = &ctx->rs->crit[c];
+	char *folded = NULL;
+	int i;
+
+	memset(bits, 0, cr->words * sizeof(uint64_t));
+
+	if (cr->index.start[cr->index.size] <= LIT_SCAN_MAX) {
+		nr_cand = lit_index_scan(ctx, &cr->index, value, bits, cand, nr_cand);
+	} else {
+		if (conf.case_insensitive) {
+			folded = strdup(value);
+			for (i = 0; folded[i] != '\0'; i++)
+				folded[i] = tolower((unsigned char)folded[i]);
+		}
+		nr_cand = lit_index_lookup(ctx, &cr->index, folded ? folded : value,
+				bits, cand, nr_cand);
+		free(folded);
+	}
+
+	return nr_cand;
+}
+
+/*
+ * Find the descriptors of a criterion matched with rx or regexec that
+ * match a property.
+ */
+static void
+crit_rules_match_regex(struct match_ctx *ctx, int c, const char *value, uint64_t *bits)
+{
+	struct crit_rules *cr = &ctx->rs->crit[c];
+	int i, w, id;
+
+	if (rx_count(cr->rx) > 0) {
+		memset(ctx->rx_bits, 0, ((rx_count(cr->rx) + 63) / 64) * sizeof(uint64_t));
+		if (rx_exec(ctx->dfa[c], value, ctx->rx_bits) > 0) {
+			for (w = 0; w < (rx_count(cr->rx) + 63) / 64; w++) {
+				while (ctx->rx_bits[w] != 0) {
+					id = w * 64 + __builtin_ctzll(ctx->rx_bits[w]);
+					ctx->rx_bits[w] &= ctx->rx_bits[w] - 1;
+					BIT_SET(bits, cr->rx_descs[id]);
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < cr->nr_slow; i++) {
+		if (cr->slow_lits[i] != NULL && strstr(value, cr->slow_lits[i]) == NULL)
+			continue;
+		if (regexec(cr->slow_regs[i], value, 0, NULL, 0) == 0)
+			BIT_SET(bits, cr->slow[i]);
+	}
+}
+
+/*
+ * Match the regex descriptors of a mask that weren't matched yet for
+ * a window, one at a time. Stops at the first one that fails, as the
+ * block can't match then.
+ */
+static void
+block_mask_resolve(struct match_ctx *ctx, struct block_mask *m, struct win_props *p)
+{
+	struct crit_rules *cr = &ctx->rs->crit[m->crit];
+	uint64_t todo;
+	int id;
+
+	todo = m->mask & cr->regex_bits[m->word - cr->base] & ~ctx->done[m->word];
+	while (todo != 0) {
+		id = (m->word - cr->base) * 64 + __builtin_ctzll(todo);
+		ctx->done[m->word] |= todo & -todo;
+		if (!descriptor_match(cr->descs[id], prop_value(p, m->crit)))
+			return;
+		ctx->bits[m->word] |= todo & -todo;
+		todo &= todo - 1;
+	}
+}
+
+/*
+ * Find the blocks that match a window, using the state of the ruleset.
+ *
+ * The indices of the matching blocks are put in `matches`, which must have
+ * room for all the blocks, in file order. Returns the number of matches.
+ * The result is the same as matching every block with match_props.
+ */
+int
+ruleset_match(struct ruleset *rs, struct win_props *p, int *matches)
+{
+	return match_ctx_match(rs->ctx, p, matches);
+}
+
+/*
+ * Find the blocks of the ruleset of ctx that match a window,
+ * like ruleset_match.
+ */
+int
+match_ctx_match(struct match_ctx *ctx, struct win_props *p, int *matches)
+{
+	struct ruleset *rs = ctx->rs;
+	struct block_mask *m, *end;
+	struct crit_rules *cr;
+	struct memo_entry *e;
+	uint64_t *bits;
+	char *value;
+	uint32_t h;
+	int *cand;
+	int nr_cand, nr_matches, i, j, b, c;
+
+	if (rs->nr_blocks == 0)
+		return 0;
+
+	/* a new generation makes all the blocks unseen */
+	if (++ctx->gen == 0) {
+		memset(ctx->seen, 0, rs->nr_blocks * sizeof(unsigned int));
+		ctx->gen = 1;
+	}
+
+	cand = malloc(rs->nr_blocks * sizeof(int));
+	nr_cand = 0;
+	ctx->lazy = 0;
+	for (c = 0; c < NR_CRITERIA; c++) {
+		cr = &rs->crit[c];
+		if (cr->nr_descs == 0)
+			continue;
+
+		bits = ctx->bits + cr->base;
+		value = prop_value(p, c);
+		h = memo_hash(c, value);
+		e = memo_get(&ctx->memo, c, value, h);
+		if (e != NULL) {
+			__atomic_add_fetch(&stats.memo_hits, 1, __ATOMIC_RELAXED);
+			memcpy(bits, e->bits, cr->words * sizeof(uint64_t));
+			for (i = 0; i < e->nr_cand; i++) {
+				if (ctx->seen[e->cand[i]] != ctx->gen) {
+					ctx->seen[e->cand[i]] = ctx->gen;
+					cand[nr_cand++] = e->cand[i];
+				}
+			}
+		} else {
+			__atomic_add_fetch(&stats.memo_misses, 1, __ATOMIC_RELAXED);
+			i = nr_cand;
+			nr_cand = crit_rules_match_lits(ctx, c, value, bits, cand, nr_cand);
+			if ((rx_count(cr->rx) > 0 || cr->nr_slow > 0)
+					&& ctx->memo.once[h % MEMO_SIZE] != h) {
+				/* the regex descriptors are matched per block */
+				ctx->memo.once[h % MEMO_SIZE] = h;
+				ctx->lazy |= 1 << c;
+				memset(ctx->done + cr->base, 0, cr->words * sizeof(uint64_t));
+			} else {
+				crit_rules_match_regex(ctx, c, value, bits);
+				memo_put(&ctx->memo, c, value, h, bits, cr->words, cand + i, nr_cand - i);
+			}
+		}
+	}
+	qsort(cand, nr_cand, sizeof(int), cmp_int);
+
+	/* merge the candidates with the unindexed blocks, keeping file order */
+	nr_matches = 0;
+	i = j = 0;
+	while (i < nr_cand || j < rs->nr_unindexed) {
+		if (j == rs->nr_unindexed || (i < nr_cand && cand[i] < rs->unindexed[j]))
+			b = cand[i++];
+		else
+			b = rs->unindexed[j++];
+
+		end = &rs->masks[rs->mask_start[b + 1]];
+		for (m = &rs->masks[rs->mask_start[b]]; m < end; m++) {
+			if (ctx->lazy & (1 << m->crit))
+				block_mask_resolve(ctx, m, p);
+			if ((ctx->bits[m->word] & m->mask) != m->mask)
+				break;
+		}
+		DMSG("block %d: %s\n", b, m == end ? "match" : "no match");
+		if (m == end)
+			matches[nr_matches++] = b;
+	}
+	free(cand);
+
+	return nr_matches;
+}
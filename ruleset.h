@@ -0,0 +1,196 @@
+#ifndef __RULESET_H
+#define __RULESET_H
+
+#include <stdint.h>
+
+#include "ruler.h"
+#include "rx.h"
+
+/* indexes with up to this many literals are searched one literal at a time */
+#define LIT_SCAN_MAX 8
+
+/* a literal descriptor in the literal index */
+struct lit_entry {
+	uint64_t hash;
+	uint32_t off;	/* position of the literal in the pool */
+	uint32_t len;
+	int anchor;
+	int id;		/* index of the descriptor in its criterion */
+	int block;	/* block that uses it as key, -1 if none */
+};
+
+/*
+ * Hash table of the literal descriptors of one criterion.
+ *
+ * The entries of bucket `i` are entries[start[i]] to entries[start[i + 1] - 1]
+ * and the literals are stored one after another in `pool`.
+ */
+struct lit_index {
+	size_t size;	/* number of buckets, a power of two */
+	uint32_t *start;
+	struct lit_entry *entries;
+	char *pool;
+	/* distinct lengths of the literals, in ascending order */
+	size_t *lens;
+	int nr_lens;
+};
+
+/*
+ * The descriptors of one criterion.
+ *
+ * What's compiled from them is shared with the ruleset made by the next
+ * reload if the criterion has the same descriptors, keyed by the same
+ * blocks, and freed with the last ruleset that uses it.
+ */
+struct crit_rules {
+	int nr_descs;
+	struct descriptor **descs;
+	int *key_block;	/* block that uses each descriptor as key, -1 if none */
+	int *refs;	/* rulesets sharing the compiled descriptors */
+	/* first word of the criterion in the descriptor bitset of the ruleset */
+	int base;
+	int words;
+
+	/* literal descriptors */
+	struct lit_index index;
+
+	/* other descriptors, matched together in one pass */
+	struct rx *rx;
+	int *rx_descs;	/* descriptor of each pattern of rx */
+
+	/*
+	 * descriptors that rx doesn't support, or all of them when built with
+	 * REGEX=libc, matched with regexec if their literal is found
+	 */
+	int *slow;
+	regex_t **slow_regs;
+	char **slow_lits;
+	int nr_slow;
+
+	/* the descriptors matched with rx or regexec, `words` words */
+	uint64_t *regex_bits;
+};
+
+/* number of property values remembered by a ruleset */
+#define MEMO_SIZE 1024
+
+/* descriptors and key blocks matching a property value */
+struct memo_entry {
+	enum criterion crit;
+	char *value;
+	uint32_t hash;
+	uint64_t *bits;
+	int *cand;
+	int nr_cand;
+	/* next entry in the hash chain and in the LRU list, -1 for none */
+	int chain;
+	int prev, next;
+};
+
+/*
+ * LRU cache of the matches of property values.
+ *
+ * The same classes and types come up for most windows, so the matching
+ * is done once per value. Being part of a match_ctx, the cache is thrown
+ * away with the ruleset when the configuration is reloaded.
+ */
+struct memo {
+	struct memo_entry entries[MEMO_SIZE];
+	int nr_entries;
+	int buckets[2 * MEMO_SIZE];
+	int head, tail;	/* most and least recently used */
+	/* hashes of the values seen once, by hash modulo MEMO_SIZE */
+	uint32_t once[MEMO_SIZE];
+};
+
+/* some of the descriptors of a block that share a word of the bitset */
+struct block_mask {
+	int word;
+	enum criterion crit;
+	uint64_t mask;
+};
+
+/*
+ * Blocks of the configuration, in file order, compiled for matching.
+ *
+ * The descriptors are numbered per criterion, and the matching descriptors
+ * of all the criteria form one bitset. For a window, the descriptors matching
+ * each property are found all at once: literals by looking up the substrings
+ * of the property in a hash table, the others with one scan of a combined
+ * regex. Each block is the mask of the descriptors it requires, and it
+ * matches if all of them are in the bitset.
+ *
+ * Each block that has a literal descriptor uses it as key. The block can
+ * match only if the key is found, so only those blocks and the blocks
+ * without literals are checked.
+ *
+ * A ruleset isn't changed after it's made. Everything that changes while
+ * matching is in a struct match_ctx, and a ruleset has one of its own for
+ * ruleset_match. A reload makes a new ruleset, and the old one is freed
+ * when its last reference is dropped.
+ */
+struct ruleset {
+	/* the block list of the parser, owned by the ruleset */
+	struct list *list;
+	int refs;
+
+	int nr_blocks;
+	struct block **blocks;
+	/* mask of block `b` is masks[mask_start[b]] to masks[mask_start[b + 1] - 1] */
+	int *mask_start;
+	struct block_mask *masks;
+
+	struct crit_rules crit[NR_CRITERIA];
+	int words;
+	/* most words used by the descriptors of a criterion */
+	int max_words;
+
+	/* blocks without literal descriptors, in file order */
+	int *unindexed;
+	int nr_unindexed;
+
+	struct match_ctx *ctx;
+
+	/* criteria whose compiled descriptors were taken from the base ruleset */
+	int nr_reused;
+
+	/* configuration files the blocks were read from, for load_rules */
+	struct file_stamp *files;
+	int nr_files;
+};
+
+/*
+ * What changes while matching windows against a ruleset: the DFAs of the
+ * combined regexes, which are built lazily, the memo and scratch space.
+ * Each thread that matches needs its own.
+ *
+ * A property value seen for the first time, like most window names, would
+ * build DFA states that are never used again. Only its literals are looked
+ * up, and the regex descriptors of the blocks that are checked are matched
+ * one at a time: `lazy` has a bit for each criterion matched that way, and
+ * `done` the descriptors already matched for the window. If the value comes
+ * up again, it goes through the DFA and into the memo.
+ */
+struct match_ctx {
+	struct ruleset *rs;
+	struct rx_dfa *dfa[NR_CRITERIA];
+	struct memo memo;
+	uint64_t *bits;
+	uint64_t *rx_bits;
+	int lazy;
+	uint64_t *done;
+	unsigned int *seen;
+	unsigned int gen;
+};
+
+struct ruleset * ruleset_new(struct list *, struct ruleset *);
+int ruleset_diff(struct ruleset *, struct ruleset *);
+struct ruleset * ruleset_get(struct ruleset *);
+void ruleset_put(struct ruleset *);
+void ruleset_free(struct ruleset *);
+int ruleset_match(struct ruleset *, struct win_props *, int *);
+struct match_ctx * match_ctx_new(struct ruleset *);
+void match_ctx_free(struct match_ctx *);
+int match_ctx_match(struct match_ctx *, struct win_props *, int *);
+
+#endif
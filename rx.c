@@ -0,0 +1,1174 @@
+#include <ctype.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rx.h"
+
+/* the limits of what a pattern may expand to, bigger ones go to regexec */
+#define RX_MAX_PATTERN_STATES 20000
+#define RX_DUP_MAX 255
+
+/* the DFA is thrown away and built again when it grows past these */
+#define RX_MAX_DFA_STATES 2048
+#define RX_MAX_DFA_ITEMS (1 << 20)
+
+/* sets with more patterns than this are matched without the prefilter */
+#define RX_MAX_PREFILTER 8
+
+/* the characters that stand for themselves after a backslash */
+#define RX_META ".[]()*+?{}|^$\\"
+
+typedef uint64_t rx_charset[4];
+
+enum rx_node_type {
+	N_SET,
+	N_CAT,
+	N_ALT,
+	N_REP,
+	N_BOL,
+	N_EOL,
+	N_EMPTY
+};
+
+/* parsed regex */
+struct rx_node {
+	enum rx_node_type type;
+	int set;
+	int min, max;	/* max is -1 for no upper bound */
+	struct rx_node *a, *b;
+};
+
+enum rx_state_type {
+	S_SET,		/* consume a byte of the set `arg` */
+	S_SPLIT,	/* go to both `out` and `out1` */
+	S_BOL,		/* only at the start of the string */
+	S_EOL,		/* only at the end of the string */
+	S_MATCH		/* pattern `arg` matched */
+};
+
+/* NFA state */
+struct rx_state {
+	enum rx_state_type type;
+	int arg;
+	int out, out1;
+};
+
+struct rx {
+	int icase;
+
+	struct rx_state *states;
+	int nr_states, cap_states;
+
+	rx_charset *sets;
+	int nr_sets, cap_sets;
+
+	/* entry state of each pattern */
+	int *starts;
+	int nr_patterns;
+
+	/* string that each match of a pattern contains, NULL if none is known */
+	char **lits;
+	/* set if every pattern has one, so a string without any can't match */
+	int prefilter;
+
+	/* bytes that no set tells apart share a class */
+	unsigned char classes[256];
+	int nr_classes;
+};
+
+/* DFA state, a set of NFA states */
+struct rx_dstate {
+	int *items;	/* sorted S_SET, S_EOL and S_MATCH states */
+	int nr_items;
+	int nr_matches;	/* the S_MATCH states are the last items */
+	unsigned int hash;
+	int initial;
+	/* patterns that match if the string ends here, -1 if not computed */
+	int *eol_matches;
+	int nr_eol_matches;
+};
+
+struct rx_dfa {
+	struct rx *rx;
+
+	struct rx_dstate *states;
+	int nr_states, cap_states;
+	int nr_items;
+
+	/* next state for each state and byte class, -1 if not computed yet */
+	int *trans;
+
+	/* hash table of states, -1 for empty slots */
+	int *table;
+	int table_size;
+
+	/* scratch space for closures */
+	unsigned int *mark;
+	unsigned int gen;
+	int *stack;
+	int *buf;
+};
+
+/* parser */
+struct rx_parser {
+	struct rx *rx;
+	const char *s;
+	int error;
+	int depth;
+	/* start of the current top level branch */
+	const char *branch;
+};
+
+static struct rx_node * parse_alt(struct rx_parser *);
+
+static struct rx_node *
+new_node(enum rx_node_type type, struct rx_node *a, struct rx_node *b)
+{
+	struct rx_node *n = malloc(sizeof(struct rx_node));
+
+	n->type = type;
+	n->set = -1;
+	n->min = n->max = 0;
+	n->a = a;
+	n->b = b;
+
+	return n;
+}
+
+static void
+free_node(struct rx_node *n)
+{
+	if (n == NULL)
+		return;
+	free_node(n->a);
+	free_node(n->b);
+	free(n);
+}
+
+static int
+new_set(struct rx *rx)
+{
+	if (rx->nr_sets == rx->cap_sets) {
+		rx->cap_sets = rx->cap_sets ? rx->cap_sets * 2 : 16;
+		rx->sets = realloc(rx->sets, rx->cap_sets * sizeof(rx_charset));
+		if (rx->sets == NULL)
+			err(1, "couldn't allocate regex");
+	}
+	memset(rx->sets[rx->nr_sets], 0, sizeof(rx_charset));
+
+	return rx->nr_sets++;
+}
+
+static void
+set_add(rx_charset set, int c)
+{
+	set[c >> 6] |= (uint64_t)1 << (c & 63);
+}
+
+static int
+set_has(rx_charset set, int c)
+{
+	return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+/*
+ * With REG_ICASE, a byte matches its other case too.
+ */
+static void
+set_fold(rx_charset set)
+{
+	int c;
+
+	for (c = 0; c < 256; c++) {
+		if (set_has(set, c)) {
+			set_add(set, tolower(c));
+			set_add(set, toupper(c));
+		}
+	}
+}
+
+static struct rx_node *
+parse_char(struct rx_parser *p, int c)
+{
+	struct rx_node *n = new_node(N_SET, NULL, NULL);
+
+	n->set = new_set(p->rx);
+	set_add(p->rx->sets[n->set], c);
+	if (p->rx->icase)
+		set_fold(p->rx->sets[n->set]);
+
+	return n;
+}
+
+static int
+class_has(const char *name, int len, int c)
+{
+#define CLASS(s, f) if (len == sizeof(s) - 1 && strncmp(name, s, len) == 0) return f(c) != 0;
+	CLASS("alpha", isalpha)
+	CLASS("digit", isdigit)
+	CLASS("alnum", isalnum)
+	CLASS("upper", isupper)
+	CLASS("lower", islower)
+	CLASS("space", isspace)
+	CLASS("blank", isblank)
+	CLASS("punct", ispunct)
+	CLASS("print", isprint)
+	CLASS("graph", isgraph)
+	CLASS("cntrl", iscntrl)
+	CLASS("xdigit", isxdigit)
+#undef CLASS
+
+	return -1;
+}
+
+/*
+ * Parse a collating element or equivalence class of one character,
+ * `[.c.]` or `[=c=]`. `p->s` points after the opening `[`.
+ */
+static int
+parse_coll(struct rx_parser *p, char delim)
+{
+	int c;
+
+	if (p->s[0] == '\0' || p->s[1] != delim || p->s[2] != ']') {
+		p->error = 1;
+		return 0;
+	}
+	c = (unsigned char)p->s[0];
+	p->s += 3;
+
+	return c;
+}
+
+static struct rx_node *
+parse_bracket(struct rx_parser *p)
+{
+	struct rx_node *n = new_node(N_SET, NULL, NULL);
+	rx_charset set = { 0 };
+	int negate = 0, first = 1, lo, hi, c, len;
+	const char *name;
+
+	if (*p->s == '^') {
+		negate = 1;
+		p->s++;
+	}
+
+	while (!p->error && (*p->s != ']' || first)) {
+		first = 0;
+		if (*p->s == '\0') {
+			p->error = 1;
+			break;
+		}
+
+		if (p->s[0] == '[' && p->s[1] == ':') {
+			name = p->s + 2;
+			for (len = 0; name[len] != '\0' && name[len] != ':'; len++)
+				;
+			if (name[len] != ':' || name[len + 1] != ']' || class_has(name, len, 'a') < 0) {
+				p->error = 1;
+				break;
+			}
+			for (c = 1; c < 256; c++)
+				if (class_has(name, len, c))
+					set_add(set, c);
+			p->s = name + len + 2;
+			continue;
+		}
+
+		if (p->s[0] == '[' && (p->s[1] == '.' || p->s[1] == '=')) {
+			p->s += 2;
+			lo = parse_coll(p, p->s[-1]);
+		} else {
+			lo = (unsigned char)*p->s++;
+		}
+
+		/* a range, unless the '-' is the last character */
+		hi = lo;
+		if (p->s[0] == '-' && p->s[1] != ']' && p->s[1] != '\0') {
+			p->s++;
+			if (p->s[0] == '[' && p->s[1] == '.') {
+				p->s += 2;
+				hi = parse_coll(p, '.');
+			} else if (p->s[0] == '[') {
+				p->error = 1;
+			} else {
+				hi = (unsigned char)*p->s++;
+			}
+			if (hi < lo)
+				p->error = 1;
+		}
+
+		for (c = lo; c <= hi; c++)
+			set_add(set, c);
+	}
+	p->s++;
+
+	if (p->rx->icase)
+		set_fold(set);
+	if (negate) {
+		for (c = 0; c < 4; c++)
+			set[c] = ~set[c];
+	}
+	/* strings can't contain NUL */
+	set[0] &= ~(uint64_t)1;
+
+	n->set = new_set(p->rx);
+	memcpy(p->rx->sets[n->set], set, sizeof(rx_charset));
+
+	return n;
+}
+
+static struct rx_node *
+parse_atom(struct rx_parser *p)
+{
+	struct rx_node *n;
+	int c = (unsigned char)*p->s;
+
+	switch (c) {
+		case '(':
+			p->s++;
+			p->depth++;
+			if (*p->s == ')')
+				n = new_node(N_EMPTY, NULL, NULL);
+			else
+				n = parse_alt(p);
+			if (*p->s != ')')
+				p->error = 1;
+			else
+				p->s++;
+			p->depth--;
+			return n;
+		case '[':
+			p->s++;
+			return parse_bracket(p);
+		case '.':
+			p->s++;
+			n = new_node(N_SET, NULL, NULL);
+			n->set = new_set(p->rx);
+			for (c = 1; c < 256; c++)
+				set_add(p->rx->sets[n->set], c);
+			return n;
+		/*
+		 * glibc lets anchors inside a pattern match next to newlines,
+		 * so only the anchors at the ends of top level branches are
+		 * handled here.
+		 */
+		case '^':
+			if (p->depth > 0 || p->s != p->branch) {
+				p->error = 1;
+				return NULL;
+			}
+			p->s++;
+			return new_node(N_BOL, NULL, NULL);
+		case '$':
+			if (p->depth > 0 || (p->s[1] != '\0' && p->s[1] != '|')) {
+				p->error = 1;
+				return NULL;
+			}
+			p->s++;
+			return new_node(N_EOL, NULL, NULL);
+		case '\\':
+			c = (unsigned char)p->s[1];
+			/*
+			 * Only metacharacters can be escaped. The other escapes are
+			 * back-references or GNU extensions, like the word anchors
+			 * \< and \>, and are left to regexec.
+			 */
+			if (c == '\0' || strchr(RX_META, c) == NULL) {
+				p->error = 1;
+				return NULL;
+			}
+			p->s += 2;
+			return parse_char(p, c);
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+		case ')':
+		case '|':
+		case '\0':
+			p->error = 1;
+			return NULL;
+		default:
+			p->s++;
+			return parse_char(p, c);
+	}
+}
+
+static int
+parse_number(struct rx_parser *p)
+{
+	int n = 0;
+
+	if (!isdigit((unsigned char)*p->s)) {
+		p->error = 1;
+		return 0;
+	}
+	while (isdigit((unsigned char)*p->s)) {
+		n = n * 10 + *p->s++ - '0';
+		if (n > RX_DUP_MAX)
+			p->error = 1;
+	}
+
+	return n;
+}
+
+static struct rx_node *
+parse_repeat(struct rx_parser *p)
+{
+	struct rx_node *n = parse_atom(p), *r;
+	int min, max;
+
+	while (!p->error) {
+		switch (*p->s) {
+			case '*': min = 0; max = -1; break;
+			case '+': min = 1; max = -1; break;
+			case '?': min = 0; max = 1; break;
+			case '{':
+				p->s++;
+				min = max = parse_number(p);
+				if (*p->s == ',') {
+					p->s++;
+					max = *p->s == '}' ? -1 : parse_number(p);
+				}
+				if (*p->s != '}' || (max != -1 && max < min))
+					p->error = 1;
+				break;
+			default:
+				return n;
+		}
+		if (p->error)
+			break;
+		p->s++;
+
+		if (n->type == N_BOL || n->type == N_EOL) {
+			p->error = 1;
+			break;
+		}
+		r = new_node(N_REP, n, NULL);
+		r->min = min;
+		r->max = max;
+		n = r;
+	}
+
+	return n;
+}
+
+static struct rx_node *
+parse_cat(struct rx_parser *p)
+{
+	struct rx_node *n = NULL, *a;
+
+	if (p->depth == 0)
+		p->branch = p->s;
+
+	while (!p->error && *p->s != '\0' && *p->s != '|' && *p->s != ')') {
+		a = parse_repeat(p);
+		n = n == NULL ? a : new_node(N_CAT, n, a);
+	}
+
+	if (n == NULL)
+		p->error = 1;
+
+	return n;
+}
+
+static struct rx_node *
+parse_alt(struct rx_parser *p)
+{
+	struct rx_node *n = parse_cat(p);
+
+	while (!p->error && *p->s == '|') {
+		p->s++;
+		n = new_node(N_ALT, n, parse_cat(p));
+	}
+
+	return n;
+}
+
+/* required literals */
+
+/* the longest literal found so far and the one being read */
+struct rx_lit {
+	char *best, *cur;
+	int best_len, cur_len;
+	int size;	/* of the buffers, the length of the pattern */
+};
+
+/*
+ * Returns the byte of a set that has only one, or -1.
+ */
+static int
+set_single(rx_charset set)
+{
+	int i, c = -1;
+
+	for (i = 0; i < 4; i++) {
+		if (set[i] == 0)
+			continue;
+		if (c >= 0 || (set[i] & (set[i] - 1)) != 0)
+			return -1;
+		c = i * 64 + __builtin_ctzll(set[i]);
+	}
+
+	return c;
+}
+
+static void
+lit_init(struct rx_lit *l, int size)
+{
+	l->best = malloc(size + 1);
+	l->cur = malloc(size + 1);
+	if (l->best == NULL || l->cur == NULL)
+		err(1, "couldn't allocate regex");
+	l->best_len = l->cur_len = 0;
+	l->size = size;
+}
+
+static void
+lit_end(struct rx_lit *l)
+{
+	if (l->cur_len > l->best_len) {
+		memcpy(l->best, l->cur, l->cur_len);
+		l->best_len = l->cur_len;
+	}
+	l->cur_len = 0;
+}
+
+/*
+ * Find the runs of single bytes that every match of a node goes through.
+ *
+ * Alternatives and optional repeats end a run. A repeat that happens at
+ * least once contains the literals of its node, but they can't be joined
+ * with the bytes around it. With REG_ICASE, letters are sets of two bytes
+ * and end runs too.
+ */
+static void
+lit_walk(struct rx *rx, struct rx_node *n, struct rx_lit *l)
+{
+	struct rx_lit inner;
+	int c;
+
+	switch (n->type) {
+		case N_CAT:
+			lit_walk(rx, n->a, l);
+			lit_walk(rx, n->b, l);
+			break;
+		case N_SET:
+			c = set_single(rx->sets[n->set]);
+			if (c >= 0)
+				l->cur[l->cur_len++] = c;
+			else
+				lit_end(l);
+			break;
+		case N_REP:
+			lit_end(l);
+			if (n->min == 0)
+				break;
+			lit_init(&inner, l->size);
+			lit_walk(rx, n->a, &inner);
+			lit_end(&inner);
+			l->cur_len = inner.best_len;
+			memcpy(l->cur, inner.best, inner.best_len);
+			lit_end(l);
+			free(inner.best);
+			free(inner.cur);
+			break;
+		case N_ALT:
+			lit_end(l);
+			break;
+		case N_BOL:
+		case N_EOL:
+		case N_EMPTY:
+			break;
+	}
+}
+
+/*
+ * Returns the longest string that every match of a parsed pattern
+ * contains, NULL if there is none.
+ */
+static char *
+node_literal(struct rx *rx, struct rx_node *n, int size)
+{
+	struct rx_lit l;
+
+	lit_init(&l, size);
+	lit_walk(rx, n, &l);
+	lit_end(&l);
+	free(l.cur);
+
+	if (l.best_len == 0) {
+		free(l.best);
+		return NULL;
+	}
+	l.best[l.best_len] = '\0';
+
+	return l.best;
+}
+
+/*
+ * Find a string that every match of a pattern contains, so that strings
+ * without it can be skipped without running the regex. If `icase` is not
+ * 0, letters are never part of it.
+ *
+ * Returns the longest one found, to be freed, or NULL if there is none or
+ * the pattern isn't supported.
+ */
+char *
+rx_literal(const char *pattern, int icase)
+{
+	struct rx *rx = rx_new(icase);
+	struct rx_parser p;
+	struct rx_node *n;
+	char *lit = NULL;
+
+	p.rx = rx;
+	p.s = pattern;
+	p.error = 0;
+	p.depth = 0;
+
+	n = parse_alt(&p);
+	if (!p.error && *p.s == '\0')
+		lit = node_literal(rx, n, strlen(pattern));
+	free_node(n);
+	rx_free(rx);
+
+	return lit;
+}
+
+static int
+new_state(struct rx *rx, enum rx_state_type type, int arg, int out, int out1)
+{
+	if (rx->nr_states == rx->cap_states) {
+		rx->cap_states = rx->cap_states ? rx->cap_states * 2 : 64;
+		rx->states = realloc(rx->states, rx->cap_states * sizeof(struct rx_state));
+		if (rx->states == NULL)
+			err(1, "couldn't allocate regex");
+	}
+	rx->states[rx->nr_states].type = type;
+	rx->states[rx->nr_states].arg = arg;
+	rx->states[rx->nr_states].out = out;
+	rx->states[rx->nr_states].out1 = out1;
+
+	return rx->nr_states++;
+}
+
+/*
+ * Build the states for a node, ending in the state `next`.
+ * Returns the entry state, or -1 if the pattern is too big.
+ */
+static int
+build(struct rx *rx, struct rx_node *n, int next, int limit)
+{
+	int i, loop, entry;
+
+	if (next < 0 || rx->nr_states > limit)
+		return -1;
+
+	switch (n->type) {
+		case N_SET:
+			return new_state(rx, S_SET, n->set, next, -1);
+		case N_EMPTY:
+			return next;
+		case N_BOL:
+			return new_state(rx, S_BOL, 0, next, -1);
+		case N_EOL:
+			return new_state(rx, S_EOL, 0, next, -1);
+		case N_CAT:
+			return build(rx, n->a, build(rx, n->b, next, limit), limit);
+		case N_ALT:
+			entry = build(rx, n->a, next, limit);
+			if (entry < 0)
+				return -1;
+			return new_state(rx, S_SPLIT, 0, entry, build(rx, n->b, next, limit));
+		case N_REP:
+			if (n->max == -1) {
+				loop = new_state(rx, S_SPLIT, 0, -1, next);
+				entry = build(rx, n->a, loop, limit);
+				rx->states[loop].out = entry;
+				if (entry < 0)
+					return -1;
+				entry = loop;
+			} else {
+				entry = next;
+				for (i = n->min; i < n->max && entry >= 0; i++)
+					entry = new_state(rx, S_SPLIT, 0, build(rx, n->a, entry, limit), next);
+			}
+			for (i = 0; i < n->min && entry >= 0; i++)
+				entry = build(rx, n->a, entry, limit);
+			return entry;
+	}
+
+	return -1;
+}
+
+/*
+ * Create an empty set of patterns.
+ * If `icase` is not 0, case is ignored like with REG_ICASE.
+ */
+struct rx *
+rx_new(int icase)
+{
+	struct rx *rx = calloc(1, sizeof(struct rx));
+
+	if (rx == NULL)
+		err(1, "couldn't allocate regex");
+	rx->icase = icase;
+
+	return rx;
+}
+
+/*
+ * Add a pattern to the set.
+ *
+ * Returns the id of the pattern, which are given in order starting from 0,
+ * or -1 if the pattern isn't supported.
+ */
+int
+rx_add(struct rx *rx, const char *pattern)
+{
+	struct rx_parser p;
+	struct rx_node *n;
+	int nr_states = rx->nr_states, nr_sets = rx->nr_sets;
+	int entry = -1;
+
+	p.rx = rx;
+	p.s = pattern;
+	p.error = 0;
+	p.depth = 0;
+
+	n = parse_alt(&p);
+	if (!p.error && *p.s == '\0') {
+		entry = new_state(rx, S_MATCH, rx->nr_patterns, -1, -1);
+		entry = build(rx, n, entry, nr_states + RX_MAX_PATTERN_STATES);
+	}
+
+	if (entry < 0) {
+		free_node(n);
+		rx->nr_states = nr_states;
+		rx->nr_sets = nr_sets;
+		return -1;
+	}
+
+	rx->starts = realloc(rx->starts, (rx->nr_patterns + 1) * sizeof(int));
+	rx->lits = realloc(rx->lits, (rx->nr_patterns + 1) * sizeof(char *));
+	if (rx->starts == NULL || rx->lits == NULL)
+		err(1, "couldn't allocate regex");
+	rx->starts[rx->nr_patterns] = entry;
+	rx->lits[rx->nr_patterns] = node_literal(rx, n, strlen(pattern));
+	free_node(n);
+
+	return rx->nr_patterns++;
+}
+
+/*
+ * Finish the set after all the patterns are added.
+ */
+void
+rx_compile(struct rx *rx)
+{
+	int map[256][2];
+	int i, c, k, nr;
+
+	/* split the bytes into classes that all sets agree on */
+	memset(rx->classes, 0, sizeof(rx->classes));
+	rx->nr_classes = 1;
+	for (i = 0; i < rx->nr_sets; i++) {
+		for (k = 0; k < rx->nr_classes; k++)
+			map[k][0] = map[k][1] = -1;
+
+		nr = 0;
+		for (c = 0; c < 256; c++) {
+			int *m = &map[rx->classes[c]][set_has(rx->sets[i], c)];
+			if (*m == -1)
+				*m = nr++;
+			rx->classes[c] = *m;
+		}
+		rx->nr_classes = nr;
+	}
+
+	/* small sets of patterns that all have a literal are prefiltered */
+	rx->prefilter = rx->nr_patterns > 0 && rx->nr_patterns <= RX_MAX_PREFILTER;
+	for (i = 0; i < rx->nr_patterns && rx->prefilter; i++) {
+		if (rx->lits[i] == NULL)
+			rx->prefilter = 0;
+	}
+}
+
+/*
+ * Returns the number of patterns in the set.
+ */
+int
+rx_count(struct rx *rx)
+{
+	return rx->nr_patterns;
+}
+
+void
+rx_free(struct rx *rx)
+{
+	int i;
+
+	if (rx == NULL)
+		return;
+	free(rx->states);
+	free(rx->sets);
+	for (i = 0; i < rx->nr_patterns; i++)
+		free(rx->lits[i]);
+	free(rx->lits);
+	free(rx->starts);
+	free(rx);
+}
+
+/* DFA */
+
+static void
+dfa_reset(struct rx_dfa *d)
+{
+	int i;
+
+	for (i = 0; i < d->nr_states; i++) {
+		free(d->states[i].items);
+		free(d->states[i].eol_matches);
+	}
+	d->nr_states = 0;
+	d->nr_items = 0;
+	for (i = 0; i < d->table_size; i++)
+		d->table[i] = -1;
+}
+
+/*
+ * Create an empty DFA for a compiled set.
+ */
+struct rx_dfa *
+rx_dfa_new(struct rx *rx)
+{
+	struct rx_dfa *d = calloc(1, sizeof(struct rx_dfa));
+	int n = rx->nr_states + 1;
+
+	if (d == NULL)
+		err(1, "couldn't allocate regex");
+	d->rx = rx;
+	d->cap_states = RX_MAX_DFA_STATES;
+	d->states = malloc(d->cap_states * sizeof(struct rx_dstate));
+	d->trans = malloc(d->cap_states * rx->nr_classes * sizeof(int));
+	d->table_size = 2 * RX_MAX_DFA_STATES;
+	d->table = malloc(d->table_size * sizeof(int));
+	d->mark = calloc(n, sizeof(unsigned int));
+	d->stack = malloc(n * sizeof(int));
+	d->buf = malloc(n * sizeof(int));
+	if (d->states == NULL || d->trans == NULL || d->table == NULL
+			|| d->mark == NULL || d->stack == NULL || d->buf == NULL)
+		err(1, "couldn't allocate regex");
+	dfa_reset(d);
+
+	return d;
+}
+
+void
+rx_dfa_free(struct rx_dfa *d)
+{
+	if (d == NULL)
+		return;
+	dfa_reset(d);
+	free(d->states);
+	free(d->trans);
+	free(d->table);
+	free(d->mark);
+	free(d->stack);
+	free(d->buf);
+	free(d);
+}
+
+static void
+next_gen(struct rx_dfa *d)
+{
+	if (++d->gen == 0) {
+		memset(d->mark, 0, (d->rx->nr_states + 1) * sizeof(unsigned int));
+		d->gen = 1;
+	}
+}
+
+/*
+ * Follow the empty transitions from the states on the stack and add
+ * the reached S_SET, S_EOL and S_MATCH states to `d->buf`.
+ *
+ * S_BOL is passed only if `bol` is set and S_EOL only if `eol` is set,
+ * otherwise S_EOL is kept for later.
+ */
+static int
+closure(struct rx_dfa *d, int sp, int nr, int bol, int eol)
+{
+	struct rx_state *st;
+	int s;
+
+	while (sp > 0) {
+		s = d->stack[--sp];
+		if (s < 0 || d->mark[s] == d->gen)
+			continue;
+		d->mark[s] = d->gen;
+
+		st = &d->rx->states[s];
+		switch (st->type) {
+			case S_SPLIT:
+				d->stack[sp++] = st->out1;
+				d->stack[sp++] = st->out;
+				break;
+			case S_BOL:
+				if (bol)
+					d->stack[sp++] = st->out;
+				break;
+			case S_EOL:
+				if (eol)
+					d->stack[sp++] = st->out;
+				else
+					d->buf[nr++] = s;
+				break;
+			case S_SET:
+			case S_MATCH:
+				d->buf[nr++] = s;
+				break;
+		}
+	}
+
+	return nr;
+}
+
+static int
+cmp_item(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Find or create the DFA state for the NFA states in `d->buf`.
+ * Returns -1 if the DFA is full.
+ */
+static int
+dstate(struct rx_dfa *d, int nr, int initial)
+{
+	struct rx_dstate *ds;
+	unsigned int h = 2166136261u;
+	int i, slot, m, tmp;
+
+	/* the S_MATCH states go last */
+	for (i = m = 0; i < nr; i++) {
+		if (d->rx->states[d->buf[i]].type != S_MATCH) {
+			tmp = d->buf[m];
+			d->buf[m++] = d->buf[i];
+			d->buf[i] = tmp;
+		}
+	}
+	qsort(d->buf, m, sizeof(int), cmp_item);
+	qsort(d->buf + m, nr - m, sizeof(int), cmp_item);
+
+	for (i = 0; i < nr; i++)
+		h = (h ^ d->buf[i]) * 16777619u;
+
+	slot = h & (d->table_size - 1);
+	if (!initial) {
+		for (; d->table[slot] != -1; slot = (slot + 1) & (d->table_size - 1)) {
+			ds = &d->states[d->table[slot]];
+			if (ds->hash == h && ds->nr_items == nr && !ds->initial
+					&& memcmp(ds->items, d->buf, nr * sizeof(int)) == 0)
+				return d->table[slot];
+		}
+	}
+
+	if (d->nr_states == d->cap_states || d->nr_items + nr > RX_MAX_DFA_ITEMS)
+		return -1;
+
+	ds = &d->states[d->nr_states];
+	ds->items = malloc((nr + 1) * sizeof(int));
+	if (ds->items == NULL)
+		err(1, "couldn't allocate regex");
+	memcpy(ds->items, d->buf, nr * sizeof(int));
+	ds->nr_items = nr;
+	ds->nr_matches = nr - m;
+	ds->hash = h;
+	ds->initial = initial;
+	ds->eol_matches = NULL;
+	ds->nr_eol_matches = -1;
+	d->nr_items += nr;
+	for (i = 0; i < d->rx->nr_classes; i++)
+		d->trans[d->nr_states * d->rx->nr_classes + i] = -1;
+
+	if (!initial)
+		d->table[slot] = d->nr_states;
+
+	return d->nr_states++;
+}
+
+static int
+initial_state(struct rx_dfa *d)
+{
+	int i, sp = 0;
+
+	next_gen(d);
+	for (i = 0; i < d->rx->nr_patterns; i++)
+		d->stack[sp++] = d->rx->starts[i];
+
+	return dstate(d, closure(d, sp, 0, 1, 0), 1);
+}
+
+/*
+ * Compute the state reached from `from` with a byte of class `cls`.
+ * Returns -1 if the DFA is full.
+ */
+static int
+step(struct rx_dfa *d, int from, int cls)
+{
+	struct rx_dstate *ds = &d->states[from];
+	struct rx_state *st;
+	int i, c, sp = 0, to;
+
+	/* a representative byte of the class */
+	for (c = 0; d->rx->classes[c] != cls; c++)
+		;
+
+	next_gen(d);
+	for (i = 0; i < d->rx->nr_patterns; i++)
+		d->stack[sp++] = d->rx->starts[i];
+	for (i = 0; i < ds->nr_items; i++) {
+		st = &d->rx->states[ds->items[i]];
+		if (st->type == S_SET && set_has(d->rx->sets[st->arg], c))
+			d->stack[sp++] = st->out;
+	}
+
+	to = dstate(d, closure(d, sp, 0, 0, 0), 0);
+	if (to >= 0)
+		d->trans[from * d->rx->nr_classes + cls] = to;
+
+	return to;
+}
+
+/*
+ * Compute the patterns that match if the string ends in a state.
+ */
+static void
+eol_matches(struct rx_dfa *d, struct rx_dstate *ds)
+{
+	int i, nr, sp = 0;
+
+	next_gen(d);
+	for (i = 0; i < ds->nr_items; i++) {
+		if (d->rx->states[ds->items[i]].type == S_EOL)
+			d->stack[sp++] = d->rx->states[ds->items[i]].out;
+	}
+
+	nr = closure(d, sp, 0, ds->initial, 1);
+	ds->eol_matches = malloc((nr + 1) * sizeof(int));
+	ds->nr_eol_matches = 0;
+	for (i = 0; i < nr; i++) {
+		if (d->rx->states[d->buf[i]].type == S_MATCH)
+			ds->eol_matches[ds->nr_eol_matches++] = d->rx->states[d->buf[i]].arg;
+	}
+}
+
+static int
+add_matches(struct rx_dfa *d, struct rx_dstate *ds, uint64_t *ids)
+{
+	int i, id, n = 0;
+
+	for (i = ds->nr_items - ds->nr_matches; i < ds->nr_items; i++) {
+		id = d->rx->states[ds->items[i]].arg;
+		if (!((ids[id >> 6] >> (id & 63)) & 1)) {
+			ids[id >> 6] |= (uint64_t)1 << (id & 63);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Throw away all the states of the DFA except `cur`.
+ * Returns the new index of `cur`.
+ */
+static int
+dfa_flush(struct rx_dfa *d, int cur)
+{
+	struct rx_dstate *ds = &d->states[cur];
+	int *items, nr = ds->nr_items;
+
+	if (ds->initial) {
+		dfa_reset(d);
+		return initial_state(d);
+	}
+
+	items = ds->items;
+	ds->items = NULL;
+	dfa_reset(d);
+	initial_state(d);
+	memcpy(d->buf, items, nr * sizeof(int));
+	free(items);
+
+	return dstate(d, nr, 0);
+}
+
+/*
+ * Match a string against all the patterns of the set.
+ *
+ * The bit of each matching pattern is set in `ids`, which must be
+ * zeroed by the caller and have room for rx_count bits.
+ * Returns the number of matching patterns.
+ */
+int
+rx_exec(struct rx_dfa *d, const char *str, uint64_t *ids)
+{
+	struct rx_dstate *ds;
+	const unsigned char *s = (const unsigned char *)str;
+	int cur, next, cls, i, id, n = 0;
+
+	if (d->rx->nr_patterns == 0)
+		return 0;
+
+	/* a string that has none of the literals can't match */
+	if (d->rx->prefilter) {
+		for (i = 0; i < d->rx->nr_patterns; i++) {
+			if (strstr(str, d->rx->lits[i]) != NULL)
+				break;
+		}
+		if (i == d->rx->nr_patterns)
+			return 0;
+	}
+
+	if (d->nr_states == 0)
+		initial_state(d);
+	cur = 0;
+
+	for (; *s != '\0' && n < d->rx->nr_patterns; s++) {
+		if (d->states[cur].nr_matches > 0)
+			n += add_matches(d, &d->states[cur], ids);
+
+		cls = d->rx->classes[*s];
+		next = d->trans[cur * d->rx->nr_classes + cls];
+		if (next < 0) {
+			next = step(d, cur, cls);
+			if (next < 0) {
+				/* the DFA is full, start over keeping only the current state */
+				cur = dfa_flush(d, cur);
+				next = step(d, cur, cls);
+			}
+		}
+		cur = next;
+	}
+
+	ds = &d->states[cur];
+	if (ds->nr_matches > 0)
+		n += add_matches(d, ds, ids);
+
+	if (ds->nr_eol_matches < 0)
+		eol_matches(d, ds);
+	for (i = 0; i < ds->nr_eol_matches; i++) {
+		id = ds->eol_matches[i];
+		if (!((ids[id >> 6] >> (id & 63)) & 1)) {
+			ids[id >> 6] |= (uint64_t)1 << (id & 63);
+			n++;
+		}
+	}
+
+	return n;
+}
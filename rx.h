@@ -0,0 +1,40 @@
+#ifndef __RX_H
+#define __RX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A set of POSIX extended regular expressions matched together.
+ *
+ * The patterns are compiled into one NFA. Matching runs a DFA that is built
+ * lazily from the NFA, so a string is scanned only once for all the patterns
+ * and the result is the set of patterns that match it somewhere.
+ *
+ * The string that each match of a pattern has to contain is found when it's
+ * added. If a small set has one for every pattern, strings that contain none
+ * of them are rejected with strstr, which is vectorized in most C libraries,
+ * without running the DFA.
+ *
+ * Only matching is supported, like with REG_NOSUB. Patterns that use
+ * something the engine doesn't know (back-references, GNU extensions)
+ * are rejected by rx_add and have to be matched with regexec.
+ *
+ * The compiled set is read-only. The DFA is kept in a struct rx_dfa,
+ * which can't be shared between threads.
+ */
+struct rx;
+struct rx_dfa;
+
+struct rx * rx_new(int);
+int rx_add(struct rx *, const char *);
+void rx_compile(struct rx *);
+int rx_count(struct rx *);
+void rx_free(struct rx *);
+char * rx_literal(const char *, int);
+
+struct rx_dfa * rx_dfa_new(struct rx *);
+int rx_exec(struct rx_dfa *, const char *, uint64_t *);
+void rx_dfa_free(struct rx_dfa *);
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * Compare the vectorized literal search with the byte by byte one, and
+ * both with regexec.
+ *
+ * scalar_lit_match is lit_match built with LIT_NO_SIMD. The haystacks
+ * start at every alignment and have lengths around the vector widths, so
+ * that the tails left to the byte by byte loop are covered too.
+ */
+#include <ctype.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lit.h"
+
+#define ROUNDS 300000
+#define MAX_HAYSTACK 100
+#define MAX_NEEDLE 40
+
+int scalar_lit_match(const char *, const char *, size_t, int, int);
+
+static int failures;
+static unsigned int seed = 1;
+
+static int
+rnd(int n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) % n;
+}
+
+/*
+ * Length of a haystack, most of the time next to a multiple of 16.
+ */
+static int
+gen_len(void)
+{
+	int len;
+
+	if (rnd(2))
+		return rnd(MAX_HAYSTACK + 1);
+	len = 16 * (1 + rnd(4)) + rnd(5) - 2;
+	return len < 0 ? 0 : len;
+}
+
+static void
+check(const char *hay, const char *needle, int anchor, int icase)
+{
+	char lit[MAX_NEEDLE + 1], re_s[MAX_NEEDLE + 3];
+	size_t n = strlen(needle), i, j = 0;
+	int simd, scalar, libc;
+	regex_t re;
+
+	for (i = 0; i <= n; i++)
+		lit[i] = icase ? tolower((unsigned char)needle[i]) : needle[i];
+
+	if (anchor & LIT_BOL)
+		re_s[j++] = '^';
+	memcpy(re_s + j, needle, n);
+	j += n;
+	if (anchor & LIT_EOL)
+		re_s[j++] = '$';
+	re_s[j] = '\0';
+
+	if (regcomp(&re, re_s, REG_EXTENDED | REG_NOSUB | (icase ? REG_ICASE : 0)) != 0) {
+		printf("FAIL couldn't compile /%s/\n", re_s);
+		failures++;
+		return;
+	}
+	libc = regexec(&re, hay, 0, NULL, 0) == 0;
+	regfree(&re);
+
+	simd = lit_match(hay, lit, n, anchor, icase);
+	scalar = scalar_lit_match(hay, lit, n, anchor, icase);
+	if ((simd != scalar || simd != libc) && failures++ < 20)
+		printf("FAIL /%s/%s on \"%s\": simd %d, scalar %d, libc %d\n",
+				re_s, icase ? "i" : "", hay, simd, scalar, libc);
+}
+
+int
+main(void)
+{
+	/* letters that fold, a byte of each case next to them, and the high bit */
+	static const char chars[] = "aaabbAB[{\xe1\xc1 ";
+	char buf[MAX_HAYSTACK + 64], needle[MAX_NEEDLE + 1], *hay;
+	int round, len, n, i, off;
+
+	for (round = 0; round < ROUNDS; round++) {
+		hay = buf + rnd(32);
+		len = gen_len();
+		for (i = 0; i < len; i++)
+			hay[i] = chars[rnd(sizeof(chars) - 1)];
+		hay[len] = '\0';
+
+		n = 1 + rnd(rnd(4) ? 4 : MAX_NEEDLE);
+		for (i = 0; i < n; i++)
+			needle[i] = "abAB"[rnd(4)];
+		needle[n] = '\0';
+
+		/* put the needle in most haystacks, often at the very end */
+		if (n <= len && rnd(4) != 0) {
+			off = rnd(3) == 0 ? len - n : rnd(len - n + 1);
+			memcpy(hay + off, needle, n);
+			if (rnd(2))
+				hay[off + rnd(n)] ^= 0x20;
+		}
+
+		check(hay, needle, rnd(4), rnd(2));
+	}
+
+	if (failures > 0) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("lit: ok\n");
+	return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * Compare ruleset_match with match_props.
+ *
+ * A compiled ruleset has to find the same blocks as matching every block
+ * with match_props, for literal descriptors, the ones matched together with
+ * rx and the ones left to regexec, with and without -i.
+ *
+ * Linked with the objects of ruler, its main renamed.
+ */
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ruler.h"
+#include "../ruleset.h"
+
+/* random rule sets tried, each against RANDOM_WINDOWS windows */
+#define RANDOM_RULESETS 200
+#define RANDOM_WINDOWS 200
+/* most blocks in a rule set, and descriptors in a block */
+#define MAX_BLOCKS 40
+#define MAX_DESCS 3
+
+extern struct conf conf;
+
+static const char *criteria[] = { "class", "instance", "type", "name", "role" };
+
+/* literals, anchored or not, regexes rx matches and ones it leaves to regexec */
+static const char *patterns[] = {
+	"ab", "^ab", "ab$", "^ab$", "Ab", "bx", "^x", "x$", "b",
+	"a.b", "a.*x", "^(ab|x)+$", "[ab]x", "B+", "^$", "a?b?x",
+	"\\<ab", "x\\>", "\\bb"
+};
+
+static int failures;
+
+/* random number from a fixed seed, so that failures can be reproduced */
+static unsigned int seed = 1;
+
+static int
+rnd(int n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) % n;
+}
+
+static char *
+gen_value(void)
+{
+	static const char chars[] = "aabbxxAB -";
+	char buf[16];
+	int i, n = rnd(8);
+
+	for (i = 0; i < n; i++)
+		buf[i] = chars[rnd(sizeof(chars) - 1)];
+	buf[n] = '\0';
+
+	return strdup(buf);
+}
+
+/*
+ * Add a descriptor to a block being made, like the parser does.
+ */
+static void
+add_descriptor(struct list **d, const char *criterion, const char *pattern)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "\"%s\"", pattern);
+	list_add(d, new_descriptor((char *)criterion, strdup(buf)));
+}
+
+/*
+ * Make the blocks of a random rule set, last first, as the parser makes
+ * them.
+ */
+static struct list *
+gen_rules(void)
+{
+	struct list *l = NULL, *d;
+	int i, j, n = 1 + rnd(MAX_BLOCKS), nr_descs;
+
+	for (i = 0; i < n; i++) {
+		d = NULL;
+		nr_descs = 1 + rnd(MAX_DESCS);
+		for (j = 0; j < nr_descs; j++)
+			add_descriptor(&d, criteria[rnd(NR_CRITERIA)],
+					patterns[rnd(sizeof(patterns) / sizeof(*patterns))]);
+		list_add(&l, new_block(d, strdup("\ttrue")));
+	}
+
+	return l;
+}
+
+static struct win_props *
+gen_props(void)
+{
+	struct win_props *p = new_win_props();
+
+	p->class = gen_value();
+	p->instance = gen_value();
+	p->type = gen_value();
+	p->name = gen_value();
+	p->role = gen_value();
+
+	return p;
+}
+
+/*
+ * Check the blocks ruleset_match finds for a window against match_props
+ * on each block.
+ */
+static void
+check(struct ruleset *rs, struct win_props *p)
+{
+	int *matches = malloc(rs->nr_blocks * sizeof(int));
+	int i, b, n, want, got;
+
+	if (matches == NULL)
+		err(1, "malloc");
+	n = ruleset_match(rs, p, matches);
+
+	for (b = 0, i = 0; b < rs->nr_blocks; b++) {
+		want = match_props(p, rs->blocks[b]->d) > 0;
+		got = i < n && matches[i] == b;
+		i += got;
+		if (want != got && failures++ < 20)
+			printf("FAIL block %d%s on class=\"%s\" instance=\"%s\" type=\"%s\" "
+					"name=\"%s\" role=\"%s\": match_props %d, ruleset %d\n",
+					b, conf.case_insensitive ? " (-i)" : "", p->class,
+					p->instance, p->type, p->name, p->role, want, got);
+	}
+	if (i != n && failures++ < 20)
+		printf("FAIL ruleset_match found %d matches out of order\n", n);
+
+	free(matches);
+}
+
+static void
+test_random(int icase)
+{
+	struct win_props *p;
+	struct ruleset *rs;
+	int i, j;
+
+	conf.case_insensitive = icase;
+	for (i = 0; i < RANDOM_RULESETS; i++) {
+		rs = ruleset_new(gen_rules(), NULL);
+		for (j = 0; j < RANDOM_WINDOWS; j++) {
+			p = gen_props();
+			check(rs, p);
+			free_win_props(p);
+		}
+		ruleset_put(rs);
+	}
+	conf.case_insensitive = 0;
+}
+
+/*
+ * A block whose last descriptor fails doesn't match, even if the ones
+ * before it do.
+ */
+static void
+test_last_fails(void)
+{
+	struct list *l = NULL, *d = NULL;
+	struct win_props *p = new_win_props();
+	struct ruleset *rs;
+	int matches[1];
+
+	/* the list is built last first */
+	add_descriptor(&d, "name", "^nomatch$");
+	add_descriptor(&d, "class", "^ab$");
+	list_add(&l, new_block(d, strdup("\ttrue")));
+	rs = ruleset_new(l, NULL);
+
+	p->class = strdup("ab");
+	p->instance = strdup("");
+	p->type = strdup("");
+	p->name = strdup("xb");
+	p->role = strdup("");
+	if (match_props(p, rs->blocks[0]->d) != 0 && failures++ < 20)
+		printf("FAIL match_props matches a block whose last descriptor fails\n");
+	if (ruleset_match(rs, p, matches) != 0 && failures++ < 20)
+		printf("FAIL ruleset_match matches a block whose last descriptor fails\n");
+	check(rs, p);
+
+	free_win_props(p);
+	ruleset_put(rs);
+}
+
+int
+main(void)
+{
+	test_last_fails();
+	test_random(0);
+	test_random(1);
+
+	if (failures > 0) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("ruleset: ok\n");
+	return 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * Compare the rx engine with regcomp and regexec.
+ *
+ * rx has to give the same result as regexec for every pattern it accepts,
+ * and to reject the patterns whose meaning it doesn't know, so that they
+ * are matched with regexec.
+ */
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../rx.h"
+
+/* random patterns tried, each against RANDOM_SUBJECTS subjects */
+#define RANDOM_PATTERNS 20000
+#define RANDOM_SUBJECTS 20
+/* patterns matched together as one set */
+#define SET_SIZE 4
+
+struct rx_case {
+	const char *pattern;
+	const char *subject;
+	int icase;
+};
+
+/* GNU escapes that aren't literal characters */
+static struct rx_case escapes[] = {
+	{ "\\<fox", "a fox", 0 },
+	{ "\\<Fire", "Firefox", 0 },
+	{ "\\<Fire", "firefox", 1 },
+	{ "fox\\>", "a fox", 0 },
+	{ "\\`a", "ab", 0 },
+	{ "a\\'", "ba", 0 },
+	{ "\\bfox", "a fox", 0 },
+	{ "\\w+", "fox", 0 },
+	{ NULL, NULL, 0 }
+};
+
+static int failures;
+
+/*
+ * Match a subject with regexec.
+ * Returns 1 if it matches, 0 if not, -1 if the pattern doesn't compile.
+ */
+static int
+libc_match(const char *pattern, const char *subject, int icase)
+{
+	regex_t re;
+	int m;
+
+	if (regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB | (icase ? REG_ICASE : 0)) != 0)
+		return -1;
+	m = regexec(&re, subject, 0, NULL, 0) == 0;
+	regfree(&re);
+
+	return m;
+}
+
+/*
+ * Match a subject with rx.
+ * Returns 1 if it matches, 0 if not, -1 if the pattern is rejected.
+ */
+static int
+rx_match(const char *pattern, const char *subject, int icase)
+{
+	struct rx *rx = rx_new(icase);
+	struct rx_dfa *d;
+	uint64_t ids = 0;
+	int m = -1;
+
+	if (rx_add(rx, pattern) >= 0) {
+		rx_compile(rx);
+		d = rx_dfa_new(rx);
+		m = rx_exec(d, subject, &ids) > 0;
+		rx_dfa_free(d);
+	}
+	rx_free(rx);
+
+	return m;
+}
+
+static void
+check(const char *pattern, const char *subject, int icase)
+{
+	int libc = libc_match(pattern, subject, icase);
+	int rx = rx_match(pattern, subject, icase);
+
+	if (libc < 0 || rx < 0 || libc == rx)
+		return;
+	if (failures++ < 20)
+		printf("FAIL /%s/%s on \"%s\": libc %d, rx %d\n",
+				pattern, icase ? "i" : "", subject, libc, rx);
+}
+
+static void
+test_escapes(void)
+{
+	struct rx_case *c;
+	char *lit;
+
+	for (c = escapes; c->pattern != NULL; c++) {
+		if (rx_match(c->pattern, c->subject, c->icase) >= 0 && failures++ < 20)
+			printf("FAIL /%s/ is accepted by rx\n", c->pattern);
+		if ((lit = rx_literal(c->pattern, c->icase)) != NULL && failures++ < 20)
+			printf("FAIL /%s/ has the literal \"%s\"\n", c->pattern, lit);
+		free(lit);
+		check(c->pattern, c->subject, c->icase);
+	}
+
+	/* escaped metacharacters stand for themselves */
+	check("a\\.b", "a.b", 0);
+	check("a\\.b", "axb", 0);
+	check("\\(x\\)", "(x)", 0);
+	check("\\^\\$\\|\\\\", "^$|\\", 0);
+}
+
+/* random number from a fixed seed, so that failures can be reproduced */
+static unsigned int seed = 1;
+
+static int
+rnd(int n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) % n;
+}
+
+static void
+gen_atom(char *buf, size_t *len, int depth)
+{
+	static const char *atoms[] = {
+		"a", "a", "b", "b", "x", "A", "B", ".", "[ab]", "[^a]",
+		"[[:upper:]]", "[a-c]", "\\.", "\\(", "\\<", "\\>", "<", "\\w"
+	};
+	static const char *reps[] = {
+		"", "", "", "", "", "", "*", "+", "?", "{2}", "{1,2}", "{0,}"
+	};
+	const char *a;
+
+	if (depth < 2 && rnd(5) == 0) {
+		buf[(*len)++] = '(';
+		gen_atom(buf, len, depth + 1);
+		gen_atom(buf, len, depth + 1);
+		if (rnd(2)) {
+			buf[(*len)++] = '|';
+			gen_atom(buf, len, depth + 1);
+		}
+		buf[(*len)++] = ')';
+	} else {
+		a = atoms[rnd(sizeof(atoms) / sizeof(*atoms))];
+		memcpy(buf + *len, a, strlen(a));
+		*len += strlen(a);
+	}
+
+	a = reps[rnd(sizeof(reps) / sizeof(*reps))];
+	memcpy(buf + *len, a, strlen(a));
+	*len += strlen(a);
+}
+
+static void
+gen_pattern(char *buf)
+{
+	size_t len = 0;
+	int i, n = 1 + rnd(4);
+
+	if (rnd(4) == 0)
+		buf[len++] = '^';
+	for (i = 0; i < n; i++)
+		gen_atom(buf, &len, 0);
+	if (rnd(5) == 0) {
+		buf[len++] = '|';
+		gen_atom(buf, &len, 0);
+	}
+	if (rnd(4) == 0)
+		buf[len++] = '$';
+	buf[len] = '\0';
+}
+
+static void
+gen_subject(char *buf)
+{
+	static const char chars[] = "aaabbbxxAB.(< ";
+	int i, n = rnd(16);
+
+	for (i = 0; i < n; i++)
+		buf[i] = chars[rnd(sizeof(chars) - 1)];
+	buf[n] = '\0';
+}
+
+/*
+ * Match random subjects against sets of random patterns with rx, and
+ * against each pattern with regexec. The required literal of a pattern
+ * has to be in every subject it matches.
+ */
+static void
+test_random(int icase)
+{
+	char patterns[SET_SIZE][256], subject[32], *lits[SET_SIZE];
+	regex_t regs[SET_SIZE];
+	int ids[SET_SIZE], ok[SET_SIZE];
+	struct rx_dfa *d;
+	struct rx *rx;
+	uint64_t bits;
+	int i, j, k, libc;
+
+	for (i = 0; i < RANDOM_PATTERNS / SET_SIZE; i++) {
+		rx = rx_new(icase);
+		for (k = 0; k < SET_SIZE; k++) {
+			gen_pattern(patterns[k]);
+			ok[k] = regcomp(&regs[k], patterns[k],
+					REG_EXTENDED | REG_NOSUB | (icase ? REG_ICASE : 0)) == 0;
+			ids[k] = ok[k] ? rx_add(rx, patterns[k]) : -1;
+			lits[k] = ok[k] ? rx_literal(patterns[k], icase) : NULL;
+		}
+		rx_compile(rx);
+		d = rx_dfa_new(rx);
+
+		for (j = 0; j < RANDOM_SUBJECTS; j++) {
+			gen_subject(subject);
+			bits = 0;
+			rx_exec(d, subject, &bits);
+			for (k = 0; k < SET_SIZE; k++) {
+				if (!ok[k])
+					continue;
+				libc = regexec(&regs[k], subject, 0, NULL, 0) == 0;
+				if (ids[k] >= 0 && libc != (int)((bits >> ids[k]) & 1)
+						&& failures++ < 20)
+					printf("FAIL /%s/%s on \"%s\": libc %d, rx %d\n",
+							patterns[k], icase ? "i" : "", subject,
+							libc, !libc);
+				if (libc && lits[k] != NULL && strstr(subject, lits[k]) == NULL
+						&& failures++ < 20)
+					printf("FAIL /%s/%s matches \"%s\" without \"%s\"\n",
+							patterns[k], icase ? "i" : "", subject, lits[k]);
+			}
+		}
+
+		for (k = 0; k < SET_SIZE; k++) {
+			if (ok[k])
+				regfree(&regs[k]);
+			free(lits[k]);
+		}
+		rx_dfa_free(d);
+		rx_free(rx);
+	}
+}
+
+int
+main(void)
+{
+	test_escapes();
+	test_random(0);
+	test_random(1);
+
+	if (failures > 0) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("rx: ok\n");
+	return 0;
+}
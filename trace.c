@@ -0,0 +1,336 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ruler.h"
+#include "trace.h"
+
+/* a batch entry as written in a trace */
+struct trace_entry {
+	uint32_t win;
+	uint8_t type;
+	uint8_t mask;
+	uint8_t check_attr;
+	uint8_t pad;
+};
+
+/*
+ * Stop recording after a failed write, keeping what was written.
+ */
+static void
+write_failed(struct trace *t)
+{
+	warn("couldn't write the trace, recording stopped");
+	fclose(t->f);
+	t->f = NULL;
+	t->mode = TRACE_OFF;
+}
+
+static void
+read_failed(struct trace *t)
+{
+	if (feof(t->f))
+		errx(1, "the trace is truncated");
+	err(1, "couldn't read the trace");
+}
+
+static void
+read_all(struct trace *t, void *buf, size_t len)
+{
+	if (len > 0 && fread(buf, len, 1, t->f) != 1)
+		read_failed(t);
+}
+
+/*
+ * Read the kind of the next record, which has to be kind.
+ */
+static void
+expect(struct trace *t, enum trace_kind kind)
+{
+	int c = getc(t->f);
+
+	if (c == EOF)
+		read_failed(t);
+	if (c != kind)
+		errx(1, "the trace doesn't match: got a '%c' record "
+				"instead of a '%c' one", c, kind);
+}
+
+static void
+write_string(struct trace *t, const char *s)
+{
+	uint32_t len = s == NULL ? 0 : strlen(s);
+
+	fwrite(&len, sizeof(len), 1, t->f);
+	fwrite(s, 1, len, t->f);
+}
+
+static char *
+read_string(struct trace *t)
+{
+	uint32_t len;
+	char *s;
+
+	read_all(t, &len, sizeof(len));
+	s = malloc(len + 1);
+	if (s == NULL)
+		err(1, "malloc");
+	read_all(t, s, len);
+	s[len] = '\0';
+
+	return s;
+}
+
+/*
+ * Create a trace at path and write its header.
+ *
+ * Returns -1 if the file can't be written.
+ */
+int
+trace_create(struct trace *t, const char *path, struct trace_header *h)
+{
+	t->mode = TRACE_OFF;
+	t->f = fopen(path, "w");
+	if (t->f == NULL) {
+		warn("couldn't create %s", path);
+		return -1;
+	}
+
+	if (fwrite(TRACE_MAGIC, strlen(TRACE_MAGIC), 1, t->f) != 1
+			|| fwrite(h, sizeof(*h), 1, t->f) != 1) {
+		warn("couldn't write %s", path);
+		fclose(t->f);
+		t->f = NULL;
+		return -1;
+	}
+
+	t->mode = TRACE_RECORD;
+	t->start = now_us();
+	return 0;
+}
+
+/*
+ * Open the trace at path to play it back, and read its header.
+ *
+ * Returns -1 if the file can't be read or isn't a trace.
+ */
+int
+trace_open(struct trace *t, const char *path, struct trace_header *h)
+{
+	char magic[sizeof(TRACE_MAGIC)];
+
+	t->mode = TRACE_OFF;
+	t->f = fopen(path, "r");
+	if (t->f == NULL) {
+		warn("couldn't open %s", path);
+		return -1;
+	}
+
+	if (fread(magic, strlen(TRACE_MAGIC), 1, t->f) != 1
+			|| memcmp(magic, TRACE_MAGIC, strlen(TRACE_MAGIC)) != 0
+			|| fread(h, sizeof(*h), 1, t->f) != 1) {
+		warnx("%s isn't a trace", path);
+		fclose(t->f);
+		t->f = NULL;
+		return -1;
+	}
+
+	t->mode = TRACE_REPLAY;
+	t->next = 0;
+	return 0;
+}
+
+void
+trace_close(struct trace *t)
+{
+	if (t->f != NULL && fclose(t->f) == EOF && t->mode == TRACE_RECORD)
+		warn("couldn't write the trace");
+	t->f = NULL;
+	t->mode = TRACE_OFF;
+}
+
+/*
+ * Write a record of nr batch entries, for an event that came at time,
+ * in µs on the monotonic clock.
+ */
+void
+trace_entries(struct trace *t, enum trace_kind kind, struct batch_entry *entries,
+		int nr, long long time)
+{
+	struct trace_entry te;
+	int64_t rel = time - t->start;
+	uint32_t n = nr;
+	int i;
+
+	putc(kind, t->f);
+	fwrite(&rel, sizeof(rel), 1, t->f);
+	fwrite(&n, sizeof(n), 1, t->f);
+	for (i = 0; i < nr; i++) {
+		memset(&te, 0, sizeof(te));
+		te.win = entries[i].win;
+		te.type = entries[i].type;
+		te.mask = entries[i].mask;
+		te.check_attr = entries[i].check_attr;
+		fwrite(&te, sizeof(te), 1, t->f);
+	}
+
+	if (ferror(t->f))
+		write_failed(t);
+}
+
+/*
+ * Write the reply to an attributes request.
+ */
+void
+trace_attr(struct trace *t, int listable)
+{
+	putc(TRACE_ATTR, t->f);
+	putc(listable, t->f);
+
+	if (ferror(t->f))
+		write_failed(t);
+}
+
+/*
+ * Write the properties in mask that were fetched for win.
+ */
+void
+trace_props(struct trace *t, xcb_window_t win, int mask, struct win_props *p)
+{
+	uint32_t w = win;
+
+	putc(TRACE_PROPS, t->f);
+	fwrite(&w, sizeof(w), 1, t->f);
+	putc(mask, t->f);
+	if (mask & PROP_CLASS) {
+		write_string(t, p->class);
+		write_string(t, p->instance);
+	}
+	if (mask & PROP_TYPE)
+		write_string(t, p->type);
+	if (mask & PROP_NAME)
+		write_string(t, p->name);
+	if (mask & PROP_ROLE)
+		write_string(t, p->role);
+
+	if (ferror(t->f))
+		write_failed(t);
+}
+
+/*
+ * Read the kind and the time of the next record, in µs from the start of
+ * the trace. The record itself is read by trace_read_entries.
+ *
+ * Returns the kind of the record, or 0 at the end of the trace.
+ */
+int
+trace_next(struct trace *t, long long *time)
+{
+	int64_t rel;
+	int c;
+
+	if (t->next == 0) {
+		c = getc(t->f);
+		if (c == EOF) {
+			if (ferror(t->f))
+				read_failed(t);
+			return 0;
+		}
+		if (c != TRACE_BATCH && c != TRACE_SCAN && c != TRACE_FLUSH
+				&& c != TRACE_DROP)
+			errx(1, "the trace doesn't match: got a '%c' record "
+					"between batches", c);
+		read_all(t, &rel, sizeof(rel));
+		t->next = c;
+		t->next_time = rel;
+	}
+
+	*time = t->next_time;
+	return t->next;
+}
+
+/*
+ * Read the entries of the record found by trace_next.
+ *
+ * Returns an array of nr entries, to be freed.
+ */
+struct batch_entry *
+trace_read_entries(struct trace *t, int *nr)
+{
+	struct batch_entry *entries;
+	struct trace_entry te;
+	uint32_t n, i;
+
+	read_all(t, &n, sizeof(n));
+	entries = malloc((n + 1) * sizeof(struct batch_entry));
+	if (entries == NULL)
+		err(1, "malloc");
+
+	for (i = 0; i < n; i++) {
+		read_all(t, &te, sizeof(te));
+		entries[i].win = te.win;
+		entries[i].type = te.type;
+		entries[i].mask = te.mask;
+		entries[i].check_attr = te.check_attr;
+	}
+
+	t->next = 0;
+	*nr = n;
+	return entries;
+}
+
+/*
+ * Read the reply to an attributes request.
+ *
+ * Returns 1 if the window was listable.
+ */
+int
+trace_read_attr(struct trace *t)
+{
+	int c;
+
+	expect(t, TRACE_ATTR);
+	c = getc(t->f);
+	if (c == EOF)
+		read_failed(t);
+
+	return c;
+}
+
+/*
+ * Read the properties fetched for win into p, replacing the ones in mask.
+ */
+void
+trace_read_props(struct trace *t, xcb_window_t win, int mask, struct win_props *p)
+{
+	uint32_t w;
+	int m;
+
+	expect(t, TRACE_PROPS);
+	read_all(t, &w, sizeof(w));
+	m = getc(t->f);
+	if (w != win || m != mask)
+		errx(1, "the trace doesn't match: got the properties of 0x%08x "
+				"instead of 0x%08x", w, win);
+
+	if (mask & PROP_CLASS) {
+		free(p->class);
+		free(p->instance);
+		p->class = read_string(t);
+		p->instance = read_string(t);
+	}
+	if (mask & PROP_TYPE) {
+		free(p->type);
+		p->type = read_string(t);
+	}
+	if (mask & PROP_NAME) {
+		free(p->name);
+		p->name = read_string(t);
+	}
+	if (mask & PROP_ROLE) {
+		free(p->role);
+		p->role = read_string(t);
+	}
+}
@@ -0,0 +1,79 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <xcb/xcb.h>
+
+#define TRACE_MAGIC "rulertr1"
+
+/*
+ * Traces of what ruler got from the X server, written with -T and played
+ * back with -X.
+ *
+ * A trace holds what crosses the boundary between ruler and the X server,
+ * in the order ruler used it:
+ *  - batches of events, after they were turned into batch entries
+ *  - the windows of the startup scan with -a
+ *  - the windows whose held back changes were handled with -d, or thrown
+ *    away while paused
+ *  - the replies to the attributes requests, as listable or not
+ *  - the fetched properties of the windows
+ *
+ * Playing a trace back runs the same code on it, with the replies read from
+ * the trace instead of the X server. The options that change what is
+ * asked to the X server are kept in the header and used for the replay.
+ *
+ * The file starts with TRACE_MAGIC and the header. Every record starts with
+ * its kind. Numbers are in the byte order of the machine that wrote them.
+ */
+enum trace_kind {
+	TRACE_BATCH = 'B',
+	TRACE_SCAN  = 'S',
+	TRACE_FLUSH = 'D',
+	TRACE_DROP  = 'd',
+	TRACE_ATTR  = 'A',
+	TRACE_PROPS = 'P'
+};
+
+enum trace_mode {
+	TRACE_OFF,
+	TRACE_RECORD,
+	TRACE_REPLAY
+};
+
+struct trace_header {
+	uint8_t exec_on_prop_change;
+	uint8_t exec_on_map;
+	uint8_t catch_override_redirect;
+	uint8_t apply_existing;
+	int32_t debounce;
+};
+
+struct trace {
+	FILE *f;
+	enum trace_mode mode;
+	/* when recording started, in µs on the monotonic clock */
+	long long start;
+	/* kind and time of the next record, read by trace_next */
+	int next;
+	long long next_time;
+};
+
+struct batch_entry;
+struct win_props;
+
+int trace_create(struct trace *, const char *, struct trace_header *);
+int trace_open(struct trace *, const char *, struct trace_header *);
+void trace_close(struct trace *);
+
+void trace_entries(struct trace *, enum trace_kind, struct batch_entry *, int, long long);
+void trace_attr(struct trace *, int);
+void trace_props(struct trace *, xcb_window_t, int, struct win_props *);
+
+int trace_next(struct trace *, long long *);
+struct batch_entry * trace_read_entries(struct trace *, int *);
+int trace_read_attr(struct trace *);
+void trace_read_props(struct trace *, xcb_window_t, int, struct win_props *);
+
+#endif
@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "winmap.h"
+
+#define WINMAP_MIN_SIZE 64
+
+/*
+ * Return the slot where the search for a window starts.
+ */
+static size_t
+winmap_home(struct winmap *m, xcb_window_t win)
+{
+	/* window ids are mostly sequential, spread them with a Fibonacci hash */
+	return ((uint32_t)win * 2654435769u) & (m->size - 1);
+}
+
+/*
+ * Return the slot of a window, or the empty slot where it would go.
+ */
+static size_t
+winmap_slot(struct winmap *m, xcb_window_t win)
+{
+	size_t i = winmap_home(m, win);
+
+	while (m->keys[i] != XCB_NONE && m->keys[i] != win)
+		i = (i + 1) & (m->size - 1);
+
+	return i;
+}
+
+static void
+winmap_alloc(struct winmap *m, size_t size)
+{
+	m->size = size;
+	m->count = 0;
+	m->keys = calloc(size, sizeof(xcb_window_t));
+	m->vals = calloc(size, sizeof(void *));
+	if (m->keys == NULL || m->vals == NULL)
+		err(1, "couldn't allocate window table");
+}
+
+/*
+ * Move all the windows to a table with `size` slots.
+ */
+static void
+winmap_resize(struct winmap *m, size_t size)
+{
+	struct winmap old = *m;
+	size_t i, j;
+
+	winmap_alloc(m, size);
+	for (i = 0; i < old.size; i++) {
+		if (old.keys[i] == XCB_NONE)
+			continue;
+		j = winmap_slot(m, old.keys[i]);
+		m->keys[j] = old.keys[i];
+		m->vals[j] = old.vals[i];
+		m->count++;
+	}
+
+	winmap_free(&old);
+}
+
+/*
+ * Initialize empty table.
+ */
+void
+winmap_init(struct winmap *m)
+{
+	winmap_alloc(m, WINMAP_MIN_SIZE);
+}
+
+/*
+ * Free the table. The values are not freed.
+ */
+void
+winmap_free(struct winmap *m)
+{
+	free(m->keys);
+	free(m->vals);
+	m->keys = NULL;
+	m->vals = NULL;
+	m->size = m->count = 0;
+}
+
+/*
+ * Return the value of a window, or NULL if it isn't in the table.
+ */
+void *
+winmap_get(struct winmap *m, xcb_window_t win)
+{
+	size_t i = winmap_slot(m, win);
+
+	return m->keys[i] == win ? m->vals[i] : NULL;
+}
+
+/*
+ * Returns 1 if the window is in the table.
+ */
+int
+winmap_has(struct winmap *m, xcb_window_t win)
+{
+	return m->keys[winmap_slot(m, win)] == win;
+}
+
+/*
+ * Set the value of a window.
+ *
+ * Returns 1 if the window wasn't in the table, 0 otherwise.
+ */
+int
+winmap_put(struct winmap *m, xcb_window_t win, void *val)
+{
+	size_t i;
+
+	/* keep the load under 3/4 so the probe sequences stay short */
+	if (4 * (m->count + 1) > 3 * m->size)
+		winmap_resize(m, m->size * 2);
+
+	i = winmap_slot(m, win);
+	m->vals[i] = val;
+	if (m->keys[i] == win)
+		return 0;
+
+	m->keys[i] = win;
+	m->count++;
+
+	return 1;
+}
+
+/*
+ * Remove a window from the table and put its value in `val`, if not NULL.
+ *
+ * The windows that follow it in the probe sequence are shifted back
+ * into the hole, so no tombstones are left behind.
+ *
+ * Returns 1 if the window was in the table, 0 otherwise.
+ */
+int
+winmap_del(struct winmap *m, xcb_window_t win, void **val)
+{
+	size_t mask = m->size - 1;
+	size_t i, j, home;
+
+	i = winmap_slot(m, win);
+	if (m->keys[i] != win)
+		return 0;
+
+	if (val != NULL)
+		*val = m->vals[i];
+
+	for (j = (i + 1) & mask; m->keys[j] != XCB_NONE; j = (j + 1) & mask) {
+		home = winmap_home(m, m->keys[j]);
+		/* move the window only if the hole is on its probe path */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			m->keys[i] = m->keys[j];
+			m->vals[i] = m->vals[j];
+			i = j;
+		}
+	}
+	m->keys[i] = XCB_NONE;
+	m->vals[i] = NULL;
+	m->count--;
+
+	if (m->size > WINMAP_MIN_SIZE && 8 * m->count < m->size)
+		winmap_resize(m, m->size / 2);
+
+	return 1;
+}
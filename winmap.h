@@ -0,0 +1,27 @@
+#ifndef __WINMAP_H
+#define __WINMAP_H
+
+#include <stddef.h>
+#include <xcb/xcb.h>
+
+/*
+ * Hash table of windows, with open addressing and linear probing.
+ *
+ * The window id 0 (XCB_NONE) marks an empty slot, so it can't be stored.
+ * When values aren't needed, it can be used as a set of windows.
+ */
+struct winmap {
+	size_t size;	/* number of slots, a power of two */
+	size_t count;
+	xcb_window_t *keys;
+	void **vals;
+};
+
+void winmap_init(struct winmap *);
+void winmap_free(struct winmap *);
+void * winmap_get(struct winmap *, xcb_window_t);
+int winmap_has(struct winmap *, xcb_window_t);
+int winmap_put(struct winmap *, xcb_window_t, void *);
+int winmap_del(struct winmap *, xcb_window_t, void **);
+
+#endif